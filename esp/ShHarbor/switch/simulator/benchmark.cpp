@@ -0,0 +1,159 @@
+/*
+	Home: ShHarbor.
+
+	Automation rules benchmark.
+
+	Compiles sample rules with RuleEngine as the switch and the thermostat
+	do on /SetRules, checks they act as written and measures how long the
+	interpretation of one event takes. Clock is the host one, so run
+	times are relative: ESP8266 at 80MHz is some 20-50 times slower.
+
+	Build:
+	  g++ -std=gnu++11 -O2 -I../../../ShWade/floorheating/simulator/shim \
+	    -I../../../shared/rules -I../../../shared/http \
+	    benchmark.cpp ../../../shared/rules/RuleEngine.cpp -o benchmark
+
+	Run:
+	  ./benchmark [events=1000000]
+*/
+
+#include <Arduino.h>
+#include <HTTPPool.h>
+#include <RuleEngine.h>
+#include <chrono>
+
+#define LINES		3
+
+HardwareSerial Serial;
+EspClass ESP;
+
+unsigned long clockMillis = 0;
+
+unsigned long millis() { return clockMillis; }
+unsigned long micros()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Requests are counted, not sent
+int requests = 0;
+String lastRequest;
+
+bool HTTPPool::GET(const String& url, ResponseCallback callback, void* context, BodyFilter filter)
+{
+	requests++;
+	lastRequest = url;
+	return true;
+}
+
+int lines[LINES];
+float temperature = 25;
+float target = 28;
+
+float readForRules(uint8_t source, uint8_t index)
+{
+	if (RULE_LINE == source && index < LINES)
+		return lines[index];
+	if (RULE_TEMP == source)
+		return temperature;
+	return NAN;
+}
+
+void writeForRules(uint8_t target, uint8_t index, float value)
+{
+	if (RULE_LINE == target && index < LINES)
+		lines[index] = value != 0;
+	if (RULE_TARGET == target)
+		::target = value;
+}
+
+int failures = 0;
+
+void check(bool condition, const char* what)
+{
+	if (!condition)
+	{
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+const char* rules =
+	"# wall switch 1 toggles line 0, switch 2 turns line 2 on and off\n"
+	"on input 1 if value == 1 do toggle 0\n"
+	"on input 2 do line 2 = value; get \"http://switch-b.local/ChangeLine?line=0&state=\" value\n"
+	"on temp 0 above 30 if line 0 and not line 1 do target = temp 0 - 4; line 1 = 1\n"
+	"on temp 0 below 26.5 do target = 28; line 1 = 0\n"
+	"on every 60 if (line 0 or line 2) and temp 0 >= 20 + 1 do get \"http://hub.local/alive\"\n";
+
+int main(int argc, char* argv[])
+{
+	long events = argc > 1 ? atol(argv[1]) : 1000000;
+
+	uint8_t program[RULES_PROGRAM_LEN];
+	String error = RuleEngine::compile(rules, program);
+	if (error.length())
+	{
+		printf("Compile error: %s\n", error.c_str());
+		return 1;
+	}
+	int size = 0;
+	while (program[size])
+		size += program[size];
+	printf("Program: %d bytes of %d\n", size + 1, RULES_PROGRAM_LEN);
+
+	uint8_t broken[RULES_PROGRAM_LEN];
+	check(RuleEngine::compile("on input 1 do line 0 = ", broken).length(), "error reported");
+	check(RuleEngine::compile("on input 1 do toggle 0\non tmp 1 do toggle 0", broken).c_str()[5] == '2',
+		"error line");
+	check(RuleEngine::compile("", broken).length() == 0 && !broken[0], "empty rules");
+
+	RuleEngine::init(program, readForRules, writeForRules);
+
+	// Acting as written
+	RuleEngine::onInput(1, 1);
+	check(lines[0] == 1, "toggle on press");
+	RuleEngine::onInput(1, 0);
+	check(lines[0] == 1, "release ignored");
+	RuleEngine::onInput(2, 1);
+	check(lines[2] == 1 && lastRequest == String("http://switch-b.local/ChangeLine?line=0&state=1"),
+		"line and request with value");
+
+	RuleEngine::onTemperature(0, temperature);
+	check(target == 28, "first reading doesn't fire");
+	temperature = 31;
+	RuleEngine::onTemperature(0, temperature);
+	check(target == 27 && lines[1] == 1, "crossing above");
+	temperature = 32;
+	RuleEngine::onTemperature(0, temperature);
+	check(target == 27, "no crossing no run");
+	temperature = 26;
+	RuleEngine::onTemperature(0, temperature);
+	check(target == 28 && lines[1] == 0, "crossing below");
+
+	int sent = requests;
+	clockMillis = 59000;
+	RuleEngine::update();
+	check(requests == sent, "timer not due");
+	clockMillis = 60000;
+	RuleEngine::update();
+	check(requests == sent + 1 && lastRequest == String("http://hub.local/alive"), "timer due");
+
+	// Run time: input events run the short rule, temperature events
+	// evaluate the long condition
+	unsigned long startedAt = micros();
+	for (long i = 0; i < events; i++)
+		RuleEngine::onInput(1, i & 1);
+	double inputTime = (double)(micros() - startedAt) / events;
+
+	startedAt = micros();
+	for (long i = 0; i < events; i++)
+		RuleEngine::onTemperature(0, i & 1 ? 35 : 25);
+	double temperatureTime = (double)(micros() - startedAt) / events;
+
+	printf("Input event: %.3f us, temperature event: %.3f us\n", inputTime, temperatureTime);
+	printf("Statistics: %s\n", RuleEngine::getStatistics().c_str());
+	printf("%s\n", failures ? "FAILED" : "OK");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,346 @@
+/*
+	Home: ShHarbor.
+
+	Linked switches simulator.
+
+	Runs two switches, A and B, with line 0 of each linked to the other
+	one, on Linux under a virtual clock. Each switch has its own LinkedLines
+	doing propagation and its /ChangeLine handler as in switch.cpp. HTTPPool
+	is replaced with a virtual network: requests take a random round trip
+	time and some are lost, failing by timeout as the real pool does.
+
+	Users toggle the wall switches of both, sometimes several times within
+	a fraction of a second. Latency is measured from a local change till
+	the linked switch light follows it.
+
+	With reboot=<minutes> switch A restarts that often: a new LinkedLines
+	with a new boot id, its requests in flight are gone, lights stay as
+	they were. Its changes must still be followed after each restart.
+	check=1 fails the run if some change was never followed or the lights
+	end up different.
+
+	Build:
+	  g++ -std=gnu++11 -O2 -I../../../ShWade/floorheating/simulator/shim \
+	    -I../../../shared/link -I../../../shared/http \
+	    simulator.cpp ../../../shared/link/LinkedLines.cpp -o simulator
+
+	Run:
+	  ./simulator [hours=1] [loss=0.05] [seed=1] [reboot=0] [check=0] [log=1]
+*/
+
+#include <Arduino.h>
+#include <HTTPPool.h>
+#include <LinkedLines.h>
+#include <vector>
+
+#define NODES			2
+#define MIN_TRIP		5		// network round trip, ms
+#define MAX_TRIP		40		// ms
+#define READ_TIMEOUT		3000		// lost request fails after, ms
+#define HTTPC_ERROR_READ_TIMEOUT	(-11)
+
+// Virtual Arduino core
+HardwareSerial Serial;
+EspClass ESP;
+
+unsigned long clockMillis = 0;
+
+unsigned long millis() { return clockMillis; }
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+int digitalRead(uint8_t pin) { return 0; }
+
+unsigned long randomState;
+
+// Deterministic random 0..1
+double randomValue()
+{
+	randomState = randomState * 1103515245 + 12345;
+	return ((randomState >> 16) & 0x7FFF) / 32768.0;
+}
+
+// Switch with one line linked to the other switch
+struct Node
+{
+	const char*	address;
+	LinkedLines*	links;
+	int		input;			// wall switch
+	int		remoteControlBit;
+	int		output;			// light
+
+	unsigned long	changedAt;		// local change waiting for the peer
+	bool		waiting;
+};
+
+Node nodes[NODES];
+
+// Metrics
+unsigned long changes = 0;
+unsigned long followed = 0;
+unsigned long superseded = 0;
+double latencySum = 0;
+unsigned long latencyMax = 0;
+unsigned long requests = 0;
+unsigned long reboots = 0;
+unsigned long interrupted = 0;		// change still sending when rebooted
+
+// Light follows the peer: latency of the change that was waited for
+void checkFollowed(Node* from, Node* to)
+{
+	if (from->waiting && from->output == to->output)
+	{
+		unsigned long latency = clockMillis - from->changedAt;
+		latencySum += latency;
+		latencyMax = max(latencyMax, latency);
+		followed++;
+		from->waiting = false;
+	}
+}
+
+// updateLine of switch.cpp
+void updateLine(Node* node, uint32_t origin, uint32_t boot, uint32_t seq)
+{
+	int state = node->input ^ node->remoteControlBit;
+	if (state == node->output)
+		return;
+
+	node->output = state;
+	node->links->propagate(0, state, origin, boot, seq);
+	for (uint8_t i = 0; i < NODES; i++)
+		if (&nodes[i] != node)
+			checkFollowed(&nodes[i], node);
+}
+
+// HandleHTTPChangeLine of switch.cpp, HTTP code returned
+int changeLine(Node* node, int state, uint32_t origin, uint32_t boot, uint32_t seq)
+{
+	if (!node->links->accept(origin, boot, seq))
+		return 200;
+
+	if (node->output != state)
+	{
+		node->remoteControlBit = !node->remoteControlBit;
+		updateLine(node, origin, boot, seq);
+	}
+	return 200;
+}
+
+// Wall switch toggled by a user
+void toggle(Node* node)
+{
+	if (node->waiting)
+		superseded++;
+
+	node->input = !node->input;
+	changes++;
+	node->changedAt = clockMillis;
+	node->waiting = true;
+	updateLine(node, 0, 0, 0);
+}
+
+// Virtual network in place of HTTPPool
+struct Request
+{
+	Node*				source;
+	Node*				target;
+	int				state;
+	uint32_t			origin;
+	uint32_t			boot;
+	uint32_t			seq;
+	bool				lost;
+	unsigned long			deliverAt;
+	unsigned long			respondAt;
+	bool				delivered;
+	HTTPPool::ResponseCallback	callback;
+	void*				context;
+};
+
+std::vector<Request> network;
+double loss = 0.05;
+Node* sender = NULL;			// node in its LinkedLines::update()
+
+namespace HTTPPool
+{
+	bool GET(const String& url, ResponseCallback callback, void* context, BodyFilter filter)
+	{
+		Request request;
+		request.target = NULL;
+		for (uint8_t i = 0; i < NODES; i++)
+			if (strstr(url.c_str(), nodes[i].address))
+				request.target = &nodes[i];
+
+		const char* query = strchr(url.c_str(), '?');
+		unsigned int line, state, origin, boot, seq;
+		if (!request.target || !query ||
+			5 != sscanf(query, "?line=%u&state=%u&origin=%u&boot=%u&seq=%u",
+				&line, &state, &origin, &boot, &seq))
+			return false;
+
+		unsigned long trip = MIN_TRIP + randomValue() * (MAX_TRIP - MIN_TRIP);
+		request.source = sender;
+		request.state = state;
+		request.origin = origin;
+		request.boot = boot;
+		request.seq = seq;
+		request.lost = randomValue() < loss;
+		request.deliverAt = clockMillis + trip / 2;
+		request.respondAt = clockMillis + (request.lost ? READ_TIMEOUT : trip);
+		request.delivered = false;
+		request.callback = callback;
+		request.context = context;
+		network.push_back(request);
+		requests++;
+		return true;
+	}
+
+	bool POST(const String& url, const String& payload, ResponseCallback callback, void* context)
+	{
+		return false;
+	}
+
+	void update()
+	{
+		for (size_t i = 0; i < network.size(); i++)
+		{
+			Request* request = &network[i];
+			if (!request->lost && !request->delivered && clockMillis >= request->deliverAt)
+			{
+				request->delivered = true;
+				changeLine(request->target, request->state, request->origin, request->boot,
+					request->seq);
+			}
+		}
+
+		for (size_t i = 0; i < network.size(); )
+		{
+			if (clockMillis >= network[i].respondAt)
+			{
+				Request request = network[i];
+				network.erase(network.begin() + i);
+				if (request.callback)
+					request.callback(request.lost ? HTTPC_ERROR_READ_TIMEOUT : 200,
+						String(), request.context);
+			}
+			else
+			{
+				i++;
+			}
+		}
+	}
+
+	bool busy()
+	{
+		return !network.empty();
+	}
+
+	String getStatistics()
+	{
+		return String("{ \"Requests\" : ") + String(requests) + " }";
+	}
+}
+
+// Switch restarts: requests in flight and pending changes are gone, lights
+// are restored as they were
+void reboot(Node* node)
+{
+	for (size_t i = 0; i < network.size(); i++)
+		if (network[i].source == node)
+			network[i].callback = NULL;
+
+	if (node->waiting)
+		interrupted++;
+	node->waiting = false;
+
+	uint8_t index = node - nodes;
+	uint32_t boot = ((uint32_t)(randomValue() * 0x8000) << 15) | (uint32_t)(randomValue() * 0x8000);
+	delete node->links;
+	node->links = new LinkedLines(0xA0 + index, boot);
+	node->links->setLink(0, nodes[(index + 1) % NODES].address, 0);
+	reboots++;
+}
+
+int main(int argc, char** argv)
+{
+	float hours = 1;
+	float rebootMinutes = 0;
+	bool check = false;
+	randomState = 1;
+	for (int i = 1; i < argc; i++)
+	{
+		char* value = strchr(argv[i], '=');
+		if (!value)
+			continue;
+		*value++ = '\0';
+
+		if (!strcmp(argv[i], "hours")) hours = atof(value); else
+		if (!strcmp(argv[i], "loss")) loss = atof(value); else
+		if (!strcmp(argv[i], "seed")) randomState = atol(value); else
+		if (!strcmp(argv[i], "reboot")) rebootMinutes = atof(value); else
+		if (!strcmp(argv[i], "check")) check = atoi(value); else
+		if (!strcmp(argv[i], "log")) Serial.enabled = atoi(value);
+	}
+
+	const char* addresses[NODES] = { "switch-a.local", "switch-b.local" };
+	for (uint8_t i = 0; i < NODES; i++)
+	{
+		memset(&nodes[i], 0, sizeof(Node));
+		nodes[i].address = addresses[i];
+		nodes[i].links = new LinkedLines(0xA0 + i, i + 1);
+		nodes[i].links->setLink(0, addresses[(i + 1) % NODES], 0);
+	}
+
+	// Users: a toggle every 20 s on average, every fifth one is a burst of
+	// quick toggles. Last minute is quiet to let the links settle.
+	unsigned long duration = hours * 3600000L;
+	unsigned long nextToggle = 1000;
+	unsigned long rebootEvery = rebootMinutes * 60000;
+	unsigned long nextReboot = rebootEvery;
+	int burst = 0;
+	Node* user = &nodes[0];
+
+	for (clockMillis = 0; clockMillis < duration; clockMillis++)
+	{
+		if (clockMillis >= nextToggle && clockMillis < duration - 60000)
+		{
+			if (!burst)
+			{
+				user = &nodes[randomValue() < 0.5 ? 0 : 1];
+				burst = randomValue() < 0.2 ? 2 + randomValue() * 3 : 1;
+			}
+			toggle(user);
+			burst--;
+			nextToggle = clockMillis +
+				(burst ? 50 + randomValue() * 250 : 1000 + randomValue() * 38000);
+		}
+
+		if (rebootEvery && clockMillis >= nextReboot && clockMillis < duration - 120000)
+		{
+			reboot(&nodes[0]);
+			nextReboot += rebootEvery;
+		}
+
+		for (uint8_t i = 0; i < NODES; i++)
+		{
+			sender = &nodes[i];
+			nodes[i].links->update();
+		}
+		HTTPPool::update();
+	}
+
+	// Every change is either followed, replaced by a newer one before
+	// that or cut by a reboot
+	unsigned long lost = changes - followed - superseded - interrupted;
+	bool consistent = nodes[0].output == nodes[1].output;
+
+	printf("{ \"Hours\" : %.1f, \"Loss\" : %.2f, \"Changes\" : %lu, \"Followed\" : %lu, "
+		"\"Superseded\" : %lu, \"Requests\" : %lu,\n",
+		hours, loss, changes, followed, superseded, requests);
+	printf("  \"Reboots\" : %lu, \"Interrupted\" : %lu, \"Lost\" : %lu,\n",
+		reboots, interrupted, lost);
+	printf("  \"LatencyAvg\" : %.1f, \"LatencyMax\" : %lu, \"Consistent\" : %d,\n",
+		followed ? latencySum / followed : 0.0, latencyMax, consistent);
+	printf("  \"Links\" : [ %s, %s ]\n}\n",
+		nodes[0].links->getStatistics().c_str(), nodes[1].links->getStatistics().c_str());
+
+	return (check && (lost || !consistent)) ? 1 : 0;
+}
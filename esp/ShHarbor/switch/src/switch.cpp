@@ -6,6 +6,7 @@
 	- REST API to monitor/contol light.
 	- Wall mounted switches support.
 	- Multiple linked switches.
+	- Local automation rules.
 	- OTA firmware update.
 	- Built in web UI to control switch settings.
 
@@ -19,20 +20,25 @@
 #include <ESP8266WiFi.h>
 #include <WiFiClient.h>
 #include <ESP8266WebServer.h>
-#include <ESP8266HTTPClient.h>
+#include <HTTPPool.h>
+#include <JobQueue.h>
+#include <DeviceJobs.h>
 #include <ESP8266mDNS.h>
 #include <Timer.h>
 #include <FS.h>
 #include <OTA.h>
 #include <ConnectedESPConfiguration.h>
 #include <WiFiManager.h>
+#include <SwitchInputs.h>
+#include <LinkedLines.h>
+#include <SwitchGroups.h>
+#include <RuleEngine.h>
+#include <DeviceShadow.h>
 
 #define WEB_SERVER_PORT         80
 #define CHECK_SW_UPDATES_EVERY	(60000L*5)	// every 5 min
-#define UPDATE_POWER_EVERY	500		// every 500 ms
 #define LINKED_SWITCH_ADDR_LEN	80
 #define SW_LINES		3
-#define CHANGE_LINE_METHOD	"/ChangeLine"
 
 #define TEXT_HTML		"text/html"
 #define TEXT_PLAIN		"text/plain"
@@ -59,11 +65,15 @@
 const char* FW_URL_BASE = "http://192.168.1.200/firmware/ShHarbor/switch/";
 
 void checkSoftwareUpdates();
+void updateLine(int lineNumber, uint32_t origin = 0, uint32_t boot = 0, uint32_t seq = 0);
+float readForRules(uint8_t source, uint8_t index);
+void writeForRules(uint8_t target, uint8_t index, float value);
 
 struct ControllerData
 {
 	ESP8266WebServer*       switchServer;
 	Timer*                  timer;
+	LinkedLines*		links;				// linked switches updates
 	int			remoteControlBits[SW_LINES];	// remote control bits by channels
 	int			switchPins[SW_LINES];		// switch pins by channels
 	int 			powerPins[SW_LINES];		// power pins by channels
@@ -74,6 +84,8 @@ struct ConfigurationData : ConnectedESPConfiguration
 {
 	char			linkedSwitchAddress[SW_LINES][LINKED_SWITCH_ADDR_LEN + 1];
 	int			linkedSwitchLine[SW_LINES];
+	SwitchGroup		groups[SWITCH_GROUPS_MAX];
+	uint8_t			rules[RULES_PROGRAM_LEN];
 } config;
 
 // HTTP GET /Status
@@ -97,12 +109,22 @@ void HandleHTTPGetStatus()
 		json += String("\n\r");
 	}
 
+	json += String("\"Inputs\" : ") + SwitchInputs::getStatistics() + ", ";
+	json += String("\"Links\" : ") + gd->links->getStatistics() + ", ";
+	json += String("\"Groups\" : ") + SwitchGroups::getStatistics() + ", ";
+	json += String("\"Rules\" : ") + RuleEngine::getStatistics() + ", ";
+	json += String("\"Shadow\" : ") + DeviceShadow::getStatistics() + ", ";
+	json += String("\"OutboundHTTP\" : ") + HTTPPool::getStatistics() + ", ";
+	json += String("\"Jobs\" : ") + JobQueue::getStatistics() + ", ";
+	json += String("\"Timers\" : ") + gd->timer->getStatistics() + ", ";
+	json += String("\"WiFiConnectTime\" : ") + String(WiFiManager::getConnectionTime()) + ", ";
 	json += String("\"Build\" : ") + String(FW_VERSION) + " }\n\r";
 
 	gd->switchServer->send(200, APPLICATION_JSON, json);
 }
 
-// HTTP GET /ChangeLine
+// HTTP GET /ChangeLine, origin, boot and seq tag changes propagated by
+// linked switches
 void HandleHTTPChangeLine()
 {
 	// Warning: uses global data
@@ -110,20 +132,32 @@ void HandleHTTPChangeLine()
 
 	String line = gd->switchServer->arg("line");
 	String newState = gd->switchServer->arg("state");
+	uint32_t origin = strtoul(gd->switchServer->arg("origin").c_str(), NULL, 10);
+	uint32_t boot = strtoul(gd->switchServer->arg("boot").c_str(), NULL, 10);
+	uint32_t seq = strtoul(gd->switchServer->arg("seq").c_str(), NULL, 10);
 
 	int lineNum = line.toInt();
 	int newStateVal = newState.toInt();
 
 	if (lineNum >= 0 && lineNum <= 2)
 	{
-		if (newStateVal >= 0 && newStateVal <= 1)
+		if (newStateVal >= 0 && newStateVal <= 1 && !gd->links->accept(origin, boot, seq))
+		{
+			// Echo of own change or seen already, not an error for the sender
+			gd->switchServer->send(200, APPLICATION_JSON,
+				"Ignored: " + String(origin) + "/" + String(seq) + "\r\n");
+		}
+		else if (newStateVal >= 0 && newStateVal <= 1)
 		{
 			int currentLineState =
 				(digitalRead(gd->powerPins[lineNum]) == HIGH)
 				? 1 : 0;
 			if (currentLineState != newStateVal)
+			{
 				gd->remoteControlBits[lineNum] =
 					!gd->remoteControlBits[lineNum];
+				updateLine(lineNum, origin, boot, seq);
+			}
 
 			gd->switchServer->send(200, APPLICATION_JSON,
 				"Updated to: " + newState + "\r\n");
@@ -162,6 +196,7 @@ void HandleHTTPSetLinkedSwitch()
 			LINKED_SWITCH_ADDR_LEN);
 
 		config.linkedSwitchLine[lineNum] = linkedLineNum;
+		gd->links->setLink(lineNum, config.linkedSwitchAddress[lineNum], linkedLineNum);
 
 		saveConfiguration(&config, sizeof(ConfigurationData));
 		gd->switchServer->send(200, APPLICATION_JSON,
@@ -175,43 +210,100 @@ void HandleHTTPSetLinkedSwitch()
 	}
 }
 
-// HTTP GET /CheckSoftwareUpdates
-void HandleHTTPCheckSoftwareUpdates()
+// HTTP GET /SetGroup, joins group @name with @lines (bit per line) and
+// their scene @states, empty name leaves the group in @slot
+void HandleHTTPSetGroup()
 {
 	// Warning: uses global data
 	ControllerData *gd = &GD;
 
-	gd->switchServer->send(200, TEXT_HTML,
-		"Checking new firmware availability...\r\n");
-	checkSoftwareUpdates();
+	String slot = gd->switchServer->arg("slot");
+	String name = gd->switchServer->arg("name");
+	int lines = gd->switchServer->arg("lines").toInt();
+	int states = gd->switchServer->arg("states").toInt();
 
-	// if there was new version we wouldn't get here, so
-	// TODO: this never works as the connection seems to be closed already.
-	gd->switchServer->send(200, TEXT_HTML,
-		"No update available now.\r\n");
+	if (SwitchGroups::setGroup(slot.toInt(), name, lines, states))
+	{
+		saveConfiguration(&config, sizeof(ConfigurationData));
+		gd->switchServer->send(200, APPLICATION_JSON,
+			"Updated to: " + name + " in slot: " + slot + "\r\n");
+	}
+	else
+	{
+		gd->switchServer->send(401, TEXT_HTML,
+			"Wrong group: " + slot + " " + name + "\r\n");
+	}
 }
 
-// Go check if there is a new firmware or SPIFFS got available.
-void checkSoftwareUpdates()
+// HTTP GET /GroupCommand, multicasts ON, OFF or SCENE @command to group
+// @name members
+void HandleHTTPGroupCommand()
 {
-	int spiffsVersion = 0;
-	File versionInfo = SPIFFS.open("/version.info", "r");
-	if (versionInfo)
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	String name = gd->switchServer->arg("name");
+	String command = gd->switchServer->arg("command");
+	command.toUpperCase();
+	bool ack = gd->switchServer->arg("ack").toInt();
+
+	if (command != "ON" && command != "OFF" && command != "SCENE")
 	{
-		spiffsVersion = versionInfo.parseInt();
-		versionInfo.close();
+		gd->switchServer->send(401, TEXT_HTML,
+			"Wrong command: " + command + "\r\n");
+		return;
 	}
 
-	updateAll(FW_VERSION, spiffsVersion, FW_URL_BASE);
+	uint32_t seq = SwitchGroups::send(name.c_str(), command.c_str(), ack);
+	if (seq)
+		gd->switchServer->send(200, APPLICATION_JSON,
+			"Sent: " + String(seq) + "\r\n");
+	else
+		gd->switchServer->send(503, TEXT_HTML, "Not connected.\r\n");
 }
 
-// Map switch input and remote control bit to power output, fire linked changes
-void updateLine(int lineNumber)
+// HTTP GET /SetRules, compiles automation @rules text and runs them from
+// now on, see RuleEngine.h
+void HandleHTTPSetRules()
 {
 	// Warning: uses global data
 	ControllerData *gd = &GD;
 
-	int lineState = digitalRead(gd->switchPins[lineNumber]);
+	uint8_t program[RULES_PROGRAM_LEN];
+	String error = RuleEngine::compile(gd->switchServer->arg("rules").c_str(), program);
+	if (error.length())
+	{
+		gd->switchServer->send(401, TEXT_HTML, error + "\r\n");
+		return;
+	}
+
+	memcpy(config.rules, program, RULES_PROGRAM_LEN);
+	saveConfiguration(&config, sizeof(ConfigurationData));
+	RuleEngine::init(config.rules, readForRules, writeForRules);
+	gd->switchServer->send(200, APPLICATION_JSON, RuleEngine::getStatistics() + "\r\n");
+}
+
+// HTTP GET /CheckSoftwareUpdates, the check runs as a job after the reply,
+// its status is at JOBS_PATH<id>.
+void HandleHTTPCheckSoftwareUpdates()
+{
+	DeviceJobs::acceptUpdateCheck(FW_VERSION, FW_URL_BASE);
+}
+
+// Go check if there is a new firmware or SPIFFS got available.
+void checkSoftwareUpdates()
+{
+	updateAll(FW_VERSION, getSPIFFSVersion(), FW_URL_BASE);
+}
+
+// Map switch input and remote control bit to power output, fire linked
+// changes. Remote change passes its @origin, @boot and @seq along.
+void updateLine(int lineNumber, uint32_t origin, uint32_t boot, uint32_t seq)
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	int lineState = SwitchInputs::getLevel(lineNumber);
 	if (gd->remoteControlBits[lineNumber])
 		lineState = (lineState == HIGH) ? LOW : HIGH;
 
@@ -221,27 +313,7 @@ void updateLine(int lineNumber)
 
 		digitalWrite(gd->powerPins[lineNumber], lineState);
 
-		if (config.linkedSwitchAddress[lineNumber][0] != '\0')
-		{
-
-			// linked swich update HTTP reqiest
-			String changeLinkedLineURL =
-				String("http://") +
-
-				String(config.linkedSwitchAddress[lineNumber]) +
-				String(CHANGE_LINE_METHOD) +
-				String("?line=") + String(config.linkedSwitchLine[lineNumber]) +
-				String("&state=") + String(lineState);
-
-			Serial.print("Linked update reqiest url: ");
-			Serial.println(changeLinkedLineURL);
-
-			HTTPClient httpClient;
-			httpClient.begin(changeLinkedLineURL);
-			int httpCode = httpClient.sendRequest("GET");
-			Serial.printf("Responce code: %d\n", httpCode);
-			httpClient.end();
-		}
+		gd->links->propagate(lineNumber, lineState, origin, boot, seq);
 	}
 }
 
@@ -252,6 +324,84 @@ void updateLines()
 		updateLine(i);
 }
 
+// Wall switch input has settled at a new level
+void onInputChange(uint8_t line, int level)
+{
+	updateLine(line);
+	RuleEngine::onInput(line, level);
+}
+
+// Group command or rule sets @line to @state, same way as /ChangeLine does
+void setLine(uint8_t line, int state)
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	if (line >= SW_LINES || digitalRead(gd->powerPins[line]) == state)
+		return;
+
+	gd->remoteControlBits[line] = !gd->remoteControlBits[line];
+	updateLine(line);
+}
+
+// Rules read line states
+float readForRules(uint8_t source, uint8_t index)
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	if (RULE_LINE == source && index < SW_LINES)
+		return digitalRead(gd->powerPins[index]);
+	return NAN;
+}
+
+// Rules set lines
+void writeForRules(uint8_t target, uint8_t index, float value)
+{
+	if (RULE_LINE == target)
+		setLine(index, value != 0 ? HIGH : LOW);
+}
+
+// Desired state properties, see DeviceShadow.h
+const char* const shadowProperties[SW_LINES] = { "Line0", "Line1", "Line2" };
+
+float readForShadow(uint8_t property)
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	return digitalRead(gd->powerPins[property]);
+}
+
+bool writeForShadow(uint8_t property, float value)
+{
+	if (0 != value && 1 != value)
+		return false;
+	setLine(property, value);
+	return true;
+}
+
+// HTTP PUT /Shadow, reconciles lines to desired state document in the body
+// and replies with the version applied and what is not as desired. HTTP
+// GET /Shadow gives the reported state.
+void HandleHTTPShadow()
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	if (HTTPMethod::HTTP_GET == gd->switchServer->method())
+	{
+		gd->switchServer->send(200, APPLICATION_JSON, DeviceShadow::getReported() + "\r\n");
+		return;
+	}
+
+	// Line states are not in config, nothing to save
+	String reply;
+	bool changed;
+	int code = DeviceShadow::apply(gd->switchServer->arg("plain"), &reply, &changed);
+	gd->switchServer->send(code, APPLICATION_JSON, reply + "\r\n");
+}
+
 // Returns content type based on @filename extension.
 String getContentType(String filename)
 {
@@ -277,7 +427,12 @@ void handleSPIFFSFileRead()
 	// Warning: uses global data
 	ControllerData *gd = &GD;
 
+	// HTTP GET /jobs/<id>
+	if (DeviceJobs::handleStatus())
+		return;
+
 	String path = gd->switchServer->uri();
+
 	Serial.println("handleFileRead: " + path);
 
 	if (path.endsWith("/"))
@@ -319,6 +474,16 @@ void setup()
 	gd->switchServer = new ESP8266WebServer(WEB_SERVER_PORT);
 	gd->timer = new Timer();
 
+	// Random on every boot, so peers and group members take the restarted
+	// sequences
+	uint32_t boot = ESP.random();
+
+	gd->links = new LinkedLines(ESP.getChipId(), boot);
+	for (int i = 0; i < SW_LINES; i++)
+		gd->links->setLink(i, config.linkedSwitchAddress[i], config.linkedSwitchLine[i]);
+	SwitchGroups::init(config.groups, setLine, boot);
+	DeviceShadow::init(shadowProperties, SW_LINES, readForShadow, writeForShadow);
+
 	if (SPIFFS.begin())
 		Serial.println("SPIFFS mount succesfull.");
 	else
@@ -327,8 +492,14 @@ void setup()
 	gd->switchServer->on("/Status", HTTPMethod::HTTP_GET, HandleHTTPGetStatus);
 	gd->switchServer->on(CHANGE_LINE_METHOD, HTTPMethod::HTTP_GET, HandleHTTPChangeLine);
 	gd->switchServer->on("/SetLinkedSwitch", HTTPMethod::HTTP_GET, HandleHTTPSetLinkedSwitch);
+	gd->switchServer->on("/SetGroup", HTTPMethod::HTTP_GET, HandleHTTPSetGroup);
+	gd->switchServer->on("/GroupCommand", HTTPMethod::HTTP_GET, HandleHTTPGroupCommand);
+	gd->switchServer->on("/SetRules", HTTPMethod::HTTP_GET, HandleHTTPSetRules);
+	gd->switchServer->on("/Shadow", HandleHTTPShadow);
 	gd->switchServer->on("/CheckSoftwareUpdates", HTTPMethod::HTTP_GET, HandleHTTPCheckSoftwareUpdates);
 
+	DeviceJobs::init(gd->switchServer);
+
 	//called when the url is not defined here to load content from SPIFFS
 	gd->switchServer->onNotFound(handleSPIFFSFileRead);
 
@@ -341,20 +512,31 @@ void setup()
 	Serial.println("HTTP server started.");
 
 	// Set up regulars
-	gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates);
-	gd->timer->every(UPDATE_POWER_EVERY, updateLines);
+	gd->timer->setName(gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates), "checkSoftwareUpdates");
+	setUpdateTimer(gd->timer);
 
 	// outputs
 	pinMode(O1, OUTPUT);
 	pinMode(O2, OUTPUT);
 	pinMode(O3, OUTPUT);
+
+	// inputs are handled on change, outputs follow them from now on
+	SwitchInputs::init(gd->switchPins, SW_LINES, onInputChange);
+	updateLines();
+	RuleEngine::init(config.rules, readForRules, writeForRules);
 }
 
 void loop()
 {
 	ControllerData *gd = &GD;
 
+	SwitchInputs::update();
 	gd->switchServer->handleClient();
 	gd->timer->update();
 	WiFiManager::update();
+	gd->links->update();
+	SwitchGroups::update();
+	RuleEngine::update();
+	HTTPPool::update();
+	JobQueue::update();
 }
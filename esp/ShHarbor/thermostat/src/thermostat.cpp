@@ -7,6 +7,7 @@
 	- DS1820 temperature control sensor.
 	- AC 220V power control.
 	- REST API to monitor/contol heating parameters.
+	- Local automation rules.
 	- OTA firmware update.
 	- Built in configuration web UI at /config.
 	- WiFi access point to configure and troubleshoot.
@@ -23,13 +24,19 @@
 #include <ESP8266WiFi.h>
 #include <WiFiClient.h>
 #include <ESP8266WebServer.h>
+#include <HTTPPool.h>
+#include <JobQueue.h>
+#include <DeviceJobs.h>
 #include <ESP8266mDNS.h>
 #include <Timer.h>
 #include <DS1820.h>
 #include <OTA.h>
 #include <ConnectedESPConfiguration.h>
+#include <DeviceShadow.h>
 #include <WiFiManager.h>
 #include <ESPTemplateProcessor.h>
+#include <PIDController.h>
+#include <RuleEngine.h>
 
 #define ONE_WIRE_PIN            5
 #define AC_CONTROL_PIN          13
@@ -55,18 +62,25 @@ struct ControllerData
 	ESP8266WebServer*       thermostatServer;
 	Timer*                  timer;
 	uint8_t                 heatingOn;
+	PIDController		pid;
 } GD;
 
 /* will have ssid, secret, initialised, MDNSHost plus:
  *	- target temperature,
  *	- active flag,
- *	- OTA URL.
+ *	- OTA URL,
+ *	- power policy,
+ *	- control mode,
+ *	- automation rules.
  */
 struct ConfigurationData : ConnectedESPConfiguration
 {
 	float                   targetTemp;
 	int8_t			active;
 	char			OTA_URL[OTA_URL_LEN + 1];
+	uint8_t			powerPolicy;
+	uint8_t			controlMode;
+	uint8_t			rules[RULES_PROGRAM_LEN];
 } config;
 
 // Go to sensor and get current temperature.
@@ -85,15 +99,46 @@ void temperatureUpdate()
 
 	// Here goes workaround for %f which wasnt working right.
 	Serial.printf("Temperature: %d.%02d\n", (int)temp, (int)(temp*100)%100);
+
+	RuleEngine::onTemperature(0, temp);
 }
 
-// Heating control.
+// Rules read the temperature and line 0, the active flag
+float readForRules(uint8_t source, uint8_t index)
+{
+	if (RULE_TEMP == source && 0 == index)
+		return getTemperature();
+	if (RULE_LINE == source && 0 == index)
+		return config.active;
+	return NAN;
+}
+
+// Rules set the target temperature and switch heating on and off (line 0),
+// not saved, what's in config stays after reboot
+void writeForRules(uint8_t target, uint8_t index, float value)
+{
+	if (RULE_TARGET == target && value > 0.0 && value < 100.0)
+		config.targetTemp = value;
+	else if (RULE_LINE == target && 0 == index)
+		config.active = value != 0;
+}
+
+// Heating control: on below the target or for PID duty part of the window.
 void controlHeating()
 {
 	// Warning: uses global data.
 	ControllerData *gd = &GD;
 
-	gd->heatingOn = config.active && getTemperature() < config.targetTemp;
+	if (CONTROL_PID == config.controlMode && config.active)
+	{
+		gd->pid.compute(config.targetTemp, getTemperature());
+		gd->heatingOn = gd->pid.getState(millis());
+	}
+	else
+	{
+		gd->pid.reset();
+		gd->heatingOn = config.active && getTemperature() < config.targetTemp;
+	}
 	digitalWrite(AC_CONTROL_PIN, gd->heatingOn);
 	Serial.printf("Heating state: %d\n", gd->heatingOn);
 }
@@ -114,6 +159,20 @@ void HandleHTTPGetStatus()
 	", " +
 	"\"Heating\" : " + String(gd->heatingOn) +
 	", " +
+	"\"ControlMode\" : " + String(config.controlMode) +
+	", " +
+	"\"Duty\" : " + String(gd->pid.getDuty(), 2) +
+	", " +
+	"\"Rules\" : " + RuleEngine::getStatistics() +
+	", " +
+	"\"Shadow\" : " + DeviceShadow::getStatistics() +
+	", " +
+	"\"Jobs\" : " + JobQueue::getStatistics() +
+	", " +
+	"\"Timers\" : " + gd->timer->getStatistics() +
+	", " +
+	"\"WiFiConnectTime\" : " + String(WiFiManager::getConnectionTime()) +
+	", " +
 	"\"Build\" : " + String(FW_VERSION) +
 	" }\r\n";
 
@@ -165,6 +224,78 @@ void HandleHTTPActive()
 	}
 }
 
+// HTTP PUT /rules, compiles automation @rules text and runs them from now
+// on, see RuleEngine.h
+void HandleHTTPRules()
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	uint8_t program[RULES_PROGRAM_LEN];
+	String error = RuleEngine::compile(gd->thermostatServer->arg("rules").c_str(), program);
+	if (error.length())
+	{
+		gd->thermostatServer->send(401, TEXT_HTML, error + "\r\n");
+		return;
+	}
+
+	memcpy(config.rules, program, RULES_PROGRAM_LEN);
+	saveConfiguration(&config, sizeof(ConfigurationData));
+	RuleEngine::init(config.rules, readForRules, writeForRules);
+	gd->thermostatServer->send(200, APPLICATION_JSON, RuleEngine::getStatistics() + "\r\n");
+}
+
+// Desired state properties, see DeviceShadow.h
+const char* const shadowProperties[] = { "Active", "TargetTemperature", "ControlMode" };
+
+float readForShadow(uint8_t property)
+{
+	if (0 == property) return config.active;
+	if (1 == property) return config.targetTemp;
+	return config.controlMode;
+}
+
+// Takes valid values only, as /Active and /TargetTemperature do
+bool writeForShadow(uint8_t property, float value)
+{
+	if (0 == property && (0 == value || 1 == value))
+		config.active = value;
+	else if (1 == property && value > 0.0 && value < 100.0)
+		config.targetTemp = value;
+	else if (2 == property && (CONTROL_ON_OFF == value || CONTROL_PID == value))
+		config.controlMode = value;
+	else
+		return false;
+	return true;
+}
+
+// HTTP PUT /shadow, reconciles to desired state document in the body and
+// replies with the version applied and what is not as desired. HTTP GET
+// /shadow gives the reported state.
+// to test:
+//	$ curl -X PUT -d '{ "Version" : 1, "Desired" : { "Active" : 1 } }' 192.168.1.15/shadow
+void HandleHTTPShadow()
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	if (HTTPMethod::HTTP_GET == gd->thermostatServer->method())
+	{
+		gd->thermostatServer->send(200, APPLICATION_JSON, DeviceShadow::getReported() + "\r\n");
+		return;
+	}
+
+	String reply;
+	bool changed;
+	int code = DeviceShadow::apply(gd->thermostatServer->arg("plain"), &reply, &changed);
+	if (changed)
+	{
+		saveConfiguration(&config, sizeof(ConfigurationData));
+		controlHeating();
+	}
+	gd->thermostatServer->send(code, APPLICATION_JSON, reply + "\r\n");
+}
+
 // Maps config.html parameters to configuration values.
 String mapConfigParameters(const String& key)
 {
@@ -179,7 +310,11 @@ String mapConfigParameters(const String& key)
 	if (key == "DS1820ID") return String(gd->sensorAddress); else
 	if (key == "T_TEMP") return String(config.targetTemp); else
 	if (key == "CHECKED") return config.active ? "checked" : ""; else
+	if (key == "PID_CHECKED") return CONTROL_PID == config.controlMode ? "checked" : ""; else
 	if (key == "OTA_URL") return String(config.OTA_URL); else
+	if (key == "POWER_FULL") return config.powerPolicy == WiFiManager::POWER_FULL ? "selected" : ""; else
+	if (key == "POWER_BALANCED") return config.powerPolicy == WiFiManager::POWER_BALANCED ? "selected" : ""; else
+	if (key == "POWER_SAVING") return config.powerPolicy == WiFiManager::POWER_SAVING ? "selected" : ""; else
 	return "Mapping value undefined.";
 }
 
@@ -215,13 +350,9 @@ void HandleConfig()
 
 		saveConfiguration(&config, sizeof(config));
 
-		// redirect to the same page without arguments
-		gd->thermostatServer->sendHeader("Location", String("/config"), true);
-		gd->thermostatServer->send(302, TEXT_PLAIN, "");
-
-		// Try connecting with new credentials
-		WiFi.disconnect();
-		WiFiManager::handleWiFiConnectivity();
+		// Try connecting with new credentials once the reply is out
+		DeviceJobs::accept("reconnectWiFi", DeviceJobs::reconnectWiFi);
+		return;
 	}
 
 	// Reboot
@@ -243,6 +374,9 @@ void HandleConfig()
 		gd->thermostatServer->arg("OTA_URL").toCharArray(
 			config.OTA_URL, OTA_URL_LEN);
 
+		config.powerPolicy = gd->thermostatServer->arg("POWER_POLICY").toInt();
+		WiFiManager::setPowerPolicy(config.powerPolicy);
+		config.controlMode = gd->thermostatServer->hasArg("PID_MODE") ? CONTROL_PID : CONTROL_ON_OFF;
 		saveConfiguration(&config, sizeof(ConfigurationData));
 	}
 
@@ -250,7 +384,8 @@ void HandleConfig()
 	if (gd->thermostatServer->hasArg("CHECK_UPDATE_NOW"))
 	{
 		Serial.println("Checking software updates available.");
-		checkSoftwareUpdates();
+		DeviceJobs::acceptUpdateCheck(FW_VERSION, config.OTA_URL);
+		return;
 	}
 
 	ESPTemplateProcessor(*gd->thermostatServer).send(
@@ -261,15 +396,7 @@ void HandleConfig()
 // Go check if there is a new firmware or SPIFFS got available.
 void checkSoftwareUpdates()
 {
-	int spiffsVersion = 0;
-	File versionInfo = SPIFFS.open("/version.info", "r");
-	if (versionInfo)
-	{
-		spiffsVersion = versionInfo.parseInt();
-		versionInfo.close();
-	}
-
-	updateAll(FW_VERSION, spiffsVersion, config.OTA_URL);
+	updateAll(FW_VERSION, getSPIFFSVersion(), config.OTA_URL);
 }
 
 void setup()
@@ -278,12 +405,21 @@ void setup()
 	Serial.println("Initialisation.");
 	Serial.printf("ShHarbor thermostat build %d.\n", FW_VERSION);
 
-	Serial.println("Configuration loading.");
-	loadConfiguration(&config, sizeof(ConfigurationData));
-
 	// Warning: uses global data
 	ControllerData *gd = &GD;
 
+	// Heating is back right after a warm reboot (OTA, crash), not at the
+	// next control cycle
+	uint32_t outputs = 0;
+	if (loadOutputState(&outputs))
+		Serial.printf("Heating state restored: %d\n", outputs & 1);
+	gd->heatingOn = outputs & 1;
+	pinMode(AC_CONTROL_PIN, OUTPUT);
+	digitalWrite(AC_CONTROL_PIN, gd->heatingOn);
+
+	Serial.println("Configuration loading.");
+	loadConfiguration(&config, sizeof(ConfigurationData));
+
 	// Initialise DS1820 temperature sensor
 	gd->temperatureSensor = new TemperatureSensor(ONE_WIRE_PIN);
 	pinMode(ONE_WIRE_PIN, INPUT_PULLUP);
@@ -294,6 +430,16 @@ void setup()
 	// care of WiFi anymore, all handled inside it
 	WiFiManager::init(&config);
 
+	// Uninitialised in EEPROM after upgrade
+	if (config.powerPolicy > WiFiManager::POWER_SAVING)
+		config.powerPolicy = WiFiManager::POWER_FULL;
+	WiFiManager::setPowerPolicy(config.powerPolicy);
+	if (config.controlMode > CONTROL_PID)
+		config.controlMode = CONTROL_ON_OFF;
+	DeviceShadow::init(shadowProperties, sizeof(shadowProperties) / sizeof(shadowProperties[0]),
+		readForShadow, writeForShadow);
+	RuleEngine::init(config.rules, readForRules, writeForRules);
+
 	gd->thermostatServer = new ESP8266WebServer(WEB_SERVER_PORT);
 	gd->timer = new Timer();
 
@@ -305,6 +451,8 @@ void setup()
 	gd->thermostatServer->on("/status", HTTPMethod::HTTP_GET, HandleHTTPGetStatus);
 	gd->thermostatServer->on("/TargetTemperature", HTTPMethod::HTTP_PUT, HandleHTTPTargetTemperature);
 	gd->thermostatServer->on("/Active", HTTPMethod::HTTP_PUT, HandleHTTPActive);
+	gd->thermostatServer->on("/shadow", HandleHTTPShadow);
+	gd->thermostatServer->on("/rules", HTTPMethod::HTTP_PUT, HandleHTTPRules);
 	gd->thermostatServer->on("/config", HandleConfig);
 
 	// captive pages
@@ -315,22 +463,32 @@ void setup()
 	gd->thermostatServer->serveStatic(
 		"/bootstrap.min.css", SPIFFS, "/bootstrap.min.css");
 
+	DeviceJobs::init(gd->thermostatServer);
+	gd->thermostatServer->onNotFound(DeviceJobs::handleNotFound);
+
 	gd->thermostatServer->begin();
 	Serial.println("HTTP server started.");
 
 	// Set up regulars
-	gd->timer->every(UPDATE_TEMP_EVERY, temperatureUpdate);
-	gd->timer->every(CHECK_HEATING_EVERY, controlHeating);
-	gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates);
-
-	pinMode(AC_CONTROL_PIN, OUTPUT);
+	gd->timer->setName(gd->timer->every(UPDATE_TEMP_EVERY, temperatureUpdate), "temperatureUpdate");
+	gd->timer->setName(gd->timer->every(CHECK_HEATING_EVERY, controlHeating), "controlHeating");
+	gd->timer->setName(gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates), "checkSoftwareUpdates");
+	setUpdateTimer(gd->timer);
 }
 
 void loop()
 {
 	ControllerData *gd = &GD;
 
+	saveOutputState(gd->heatingOn);
 	gd->thermostatServer->handleClient();
 	gd->timer->update();
 	WiFiManager::update();
+	JobQueue::update();
+	RuleEngine::update();
+	HTTPPool::update();
+
+	// Sleep until the next job as power policy allows, don't while
+	// waiting for outbound HTTP response or with queued jobs
+	WiFiManager::idle(HTTPPool::busy() || JobQueue::busy() ? millis() : gd->timer->nextDeadline());
 }
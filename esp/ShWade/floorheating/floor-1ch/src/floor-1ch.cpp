@@ -32,10 +32,15 @@
 #include <DS1820.h>
 #include <OTA.h>
 #include <ConnectedESPConfiguration.h>
+#include <DeviceShadow.h>
 #include <WiFiManager.h>
 #include <ESPTemplateProcessor.h>
-#include <ArduinoJson.h>
-#include <ESP8266HttpClient.h>
+#include <JSONPathFilter.h>
+#include <HTTPPool.h>
+#include <JobQueue.h>
+#include <DeviceJobs.h>
+#include <PowerBudget.h>
+#include <HeatingEngine.h>
 
 #define ONE_WIRE_PIN            5
 #define AC_CONTROL_PIN          D7
@@ -63,13 +68,14 @@ struct ControllerData
 	char			sensorAddress[ONE_WIRE_ADDR_LEN + 1];
 	ESP8266WebServer*       thermostatServer;
 	Timer*                  timer;
-	uint8_t                 heatingOn;
 } GD;
 
 /* will have ssid, secret, initialised, MDNSHost plus:
  *	- target temperature,
  *	- active flag,
- *	- OTA URL.
+ *	- OTA URL,
+ *	- power policy,
+ *	- control mode.
  */
 struct ConfigurationData : ConnectedESPConfiguration
 {
@@ -77,28 +83,27 @@ struct ConfigurationData : ConnectedESPConfiguration
 	int8_t			active;
 	char			OTA_URL[OTA_URL_LEN + 1];
 	int			heaterPower;
+	uint8_t			powerPolicy;
+	uint8_t			controlMode;
 } config;
 
-// Check current power consumption via API
-float getPowerConsumption()
+// Power meter response is streamed through it, only P.sum is kept
+JSONPathFilter powerSumFilter("P.sum");
+
+// The only heating channel: relay pin, power from config, priority and
+// temperature from the sensor.
+Heater heater = { AC_CONTROL_PIN, 0, 1, 0 };
+HeatingEngine heatingEngine(&heater, 1, MAX_ALLOWED_POWER);
+
+// Power consumption from the power meter API response, -1 if failed
+float getPowerConsumption(int httpCode)
 {
-	if (WL_CONNECTED == WiFi.status())
+	if (httpCode > 0 && powerSumFilter.found())
 	{
-		HTTPClient httpRequest;
-		httpRequest.begin("http://192.168.1.162:81/API/1.1/consumption/electricity/GetPowerMeterData");
-		int httpCode = httpRequest.GET();
-
-		if (httpCode > 0)
-		{
-			StaticJsonDocument<2048> jsonResponce;
-			deserializeJson(jsonResponce, httpRequest.getString());
-
-			float power = jsonResponce["P"]["sum"];
-			Serial.print("getPowerConsumption: ");
-			Serial.println(power);
-			return power;
-		}
-		httpRequest.end();
+		float power = powerSumFilter.toFloat();
+		Serial.print("getPowerConsumption: ");
+		Serial.println(power);
+		return power;
 	}
 	return -1;
 }
@@ -111,10 +116,6 @@ void postTemperature()
 
 	if (WL_CONNECTED == WiFi.status())
 	{
-		HTTPClient httpRequest;
-		httpRequest.begin("http://192.168.1.162:81/API/1.1/climate/data/temperature");
-		httpRequest.addHeader("Content-Type", APPLICATION_JSON);
-
 		// Prepare payload by the template: [{ "temperature" : 21.5, "sensorId": "28FF72BF47160342" }]
 		String temperaturePayload =
 			String("[{ ") +
@@ -124,7 +125,9 @@ void postTemperature()
 			" }]";
 		
 		// Just fire and forget
-		httpRequest.POST(temperaturePayload);
+		HTTPPool::POST(
+			"http://192.168.1.162:81/API/1.1/climate/data/temperature",
+			temperaturePayload);
 	}
 }
 
@@ -146,35 +149,40 @@ void temperatureUpdate()
 	Serial.printf("Temperature: %d.%02d\n", (int)temp, (int)(temp*100)%100);
 }
 
-// Heating control.
-void controlHeating()
+// Heating decision on @currentPower house consumption.
+void decideHeating(float currentPower)
 {
-	// Warning: uses global data.
-	ControllerData *gd = &GD;
+	heater.power = config.heaterPower;
+	heater.temperature = getTemperature();
 
-	float currentPower = getPowerConsumption();
+	heatingEngine.control(currentPower, config.targetTemp, config.active);
+}
 
-	uint8_t neededState = config.active && getTemperature() < config.targetTemp;
-	uint8_t currentState = digitalRead(AC_CONTROL_PIN);
+// Power meter has responded, base load is reconciled with it.
+void onPowerConsumption(int httpCode, const String& response, void* context)
+{
+	float meterPower = getPowerConsumption(httpCode);
+	if (meterPower >= 0)
+		heatingEngine.reconcile(meterPower);
 
-	float powerDelta = 0;
-	if (neededState > currentState) powerDelta = config.heaterPower;
-	if (neededState < currentState) powerDelta = -config.heaterPower;
+	decideHeating(heatingEngine.getEnergyModel().getPower());
+}
 
-	uint8_t canChangePower = !neededState || (neededState && currentPower + powerDelta < MAX_ALLOWED_POWER);
-	
-	if (canChangePower)
+// Heating control: house power is estimated by the energy model, the
+// meter is only checked when the model needs to be reconciled.
+void controlHeating()
+{
+	if (heatingEngine.needsReconcile())
 	{
-		gd->heatingOn = neededState;
-		digitalWrite(AC_CONTROL_PIN, gd->heatingOn);
-		Serial.printf("Heating state: %d\n", gd->heatingOn);
+		powerSumFilter.reset();
+		HTTPPool::GET(
+			"http://192.168.1.162:81/API/1.1/consumption/electricity/GetPowerMeterData",
+			onPowerConsumption, &powerSumFilter, JSONPathFilter::filter);
 	}
 	else
 	{
-		Serial.printf("Requred power (%f) is over limit, can't on.\n", currentPower + powerDelta);
+		decideHeating(heatingEngine.getEnergyModel().getPower());
 	}
-	
-	
 }
 
 // HTTP GET /status
@@ -191,7 +199,25 @@ void HandleHTTPGetStatus()
 	", " +
 	"\"Active\" : " + String(config.active) +
 	", " +
-	"\"Heating\" : " + String(gd->heatingOn) +
+	"\"Heating\" : " + String(heatingEngine.isOn(0)) +
+	", " +
+	"\"ControlMode\" : " + String(config.controlMode) +
+	", " +
+	"\"Duty\" : " + String(heatingEngine.getDuty(0), 2) +
+	", " +
+	"\"Energy\" : " + String(heatingEngine.getEnergyModel().getEnergy(0), 3) +
+	", " +
+	"\"OutboundHTTP\" : " + HTTPPool::getStatistics() +
+	", " +
+	"\"PowerBudget\" : " + PowerBudget::getStatistics() +
+	", " +
+	"\"Shadow\" : " + DeviceShadow::getStatistics() +
+	", " +
+	"\"Jobs\" : " + JobQueue::getStatistics() +
+	", " +
+	"\"Timers\" : " + gd->timer->getStatistics() +
+	", " +
+	"\"WiFiConnectTime\" : " + String(WiFiManager::getConnectionTime()) +
 	", " +
 	"\"Build\" : " + String(FW_VERSION) +
 	" }\r\n";
@@ -258,6 +284,57 @@ int getFWCurrentVersion()
 	return spiffsVersion;
  }
 
+// Desired state properties, see DeviceShadow.h
+const char* const shadowProperties[] = { "Active", "TargetTemperature", "ControlMode" };
+
+float readForShadow(uint8_t property)
+{
+	if (0 == property) return config.active;
+	if (1 == property) return config.targetTemp;
+	return config.controlMode;
+}
+
+// Takes valid values only, as /Active and /TargetTemperature do
+bool writeForShadow(uint8_t property, float value)
+{
+	if (0 == property && (0 == value || 1 == value))
+		config.active = value;
+	else if (1 == property && value > 0.0 && value < 100.0)
+		config.targetTemp = value;
+	else if (2 == property && (CONTROL_ON_OFF == value || CONTROL_PID == value))
+		config.controlMode = value;
+	else
+		return false;
+	return true;
+}
+
+// HTTP PUT /shadow, reconciles to desired state document in the body and
+// replies with the version applied and what is not as desired. HTTP GET
+// /shadow gives the reported state.
+// to test:
+//	$ curl -X PUT -d '{ "Version" : 1, "Desired" : { "Active" : 1 } }' <IP address>/shadow
+void HandleHTTPShadow()
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	if (HTTPMethod::HTTP_GET == gd->thermostatServer->method())
+	{
+		gd->thermostatServer->send(200, APPLICATION_JSON, DeviceShadow::getReported() + "\r\n");
+		return;
+	}
+
+	String reply;
+	bool changed;
+	int code = DeviceShadow::apply(gd->thermostatServer->arg("plain"), &reply, &changed);
+	if (changed)
+	{
+		saveConfiguration(&config, sizeof(ConfigurationData));
+		controlHeating();
+	}
+	gd->thermostatServer->send(code, APPLICATION_JSON, reply + "\r\n");
+}
+
 // Maps config.html parameters to configuration values.
 String mapConfigParameters(const String& key)
 {
@@ -270,12 +347,16 @@ String mapConfigParameters(const String& key)
 	if (key == "IP") return WiFi.localIP().toString(); else
 	if (key == "BUILD") return String(FW_VERSION); else
 	if (key == "DS1820ID") return String(gd->sensorAddress); else
-	if (key == "HEATING_STATUS") return (gd->heatingOn) ? "On" :  "Off"; else
+	if (key == "HEATING_STATUS") return heatingEngine.isOn(0) ? "On" :  "Off"; else
 	if (key == "VERSION") return (String(getFWCurrentVersion())); else
 	if (key == "T_TEMP") return String(config.targetTemp); else
 	if (key == "T_POWER") return String(config.heaterPower); else
 	if (key == "CHECKED") return config.active ? "checked" : ""; else
+	if (key == "PID_CHECKED") return CONTROL_PID == config.controlMode ? "checked" : ""; else
 	if (key == "OTA_URL") return String(config.OTA_URL); else
+	if (key == "POWER_FULL") return config.powerPolicy == WiFiManager::POWER_FULL ? "selected" : ""; else
+	if (key == "POWER_BALANCED") return config.powerPolicy == WiFiManager::POWER_BALANCED ? "selected" : ""; else
+	if (key == "POWER_SAVING") return config.powerPolicy == WiFiManager::POWER_SAVING ? "selected" : ""; else
 	return "Mapping value undefined.";
 }
 
@@ -311,13 +392,9 @@ void HandleConfig()
 
 		saveConfiguration(&config, sizeof(config));
 
-		// redirect to the same page without arguments
-		gd->thermostatServer->sendHeader("Location", String("/config"), true);
-		gd->thermostatServer->send(302, TEXT_PLAIN, "");
-
-		// Try connecting with new credentials
-		WiFi.disconnect();
-		WiFiManager::handleWiFiConnectivity();
+		// Try connecting with new credentials once the reply is out
+		DeviceJobs::accept("reconnectWiFi", DeviceJobs::reconnectWiFi);
+		return;
 	}
 
 	// Reboot
@@ -344,6 +421,10 @@ void HandleConfig()
 		gd->thermostatServer->arg("OTA_URL").toCharArray(
 			config.OTA_URL, OTA_URL_LEN);
 
+		config.powerPolicy = gd->thermostatServer->arg("POWER_POLICY").toInt();
+		WiFiManager::setPowerPolicy(config.powerPolicy);
+		config.controlMode = gd->thermostatServer->hasArg("PID_MODE") ? CONTROL_PID : CONTROL_ON_OFF;
+		heatingEngine.setMode(config.controlMode);
 		saveConfiguration(&config, sizeof(ConfigurationData));
 	}
 
@@ -351,7 +432,8 @@ void HandleConfig()
 	if (gd->thermostatServer->hasArg("CHECK_UPDATE_NOW"))
 	{
 		Serial.println("Checking software updates available.");
-		checkSoftwareUpdates();
+		DeviceJobs::acceptUpdateCheck(FW_VERSION, config.OTA_URL);
+		return;
 	}
 
 	ESPTemplateProcessor(*gd->thermostatServer).send(
@@ -371,9 +453,20 @@ void setup()
 	Serial.println("Initialisation.");
 	Serial.printf("ShHarbor thermostat build %d.\n", FW_VERSION);
 
+	// Heating is back right after a warm reboot (OTA, crash), not at the
+	// next control cycle
+	uint32_t outputs = 0;
+	if (loadOutputState(&outputs))
+		Serial.printf("Heating state restored: %d\n", outputs);
+	heatingEngine.init(outputs);
+
 	Serial.println("Configuration loading.");
 	loadConfiguration(&config, sizeof(ConfigurationData));
 
+	// Heaters restored on are counted with their power from config
+	heater.power = config.heaterPower;
+	heatingEngine.init(heatingEngine.getStates());
+
 	// Warning: uses global data
 	ControllerData *gd = &GD;
 
@@ -386,6 +479,17 @@ void setup()
 	// Initialise WiFi entity that will handle connectivity. We don't
 	// care of WiFi anymore, all handled inside it
 	WiFiManager::init(&config);
+	PowerBudget::init(MAX_ALLOWED_POWER);
+
+	// Uninitialised in EEPROM after upgrade
+	if (config.powerPolicy > WiFiManager::POWER_SAVING)
+		config.powerPolicy = WiFiManager::POWER_FULL;
+	WiFiManager::setPowerPolicy(config.powerPolicy);
+	if (config.controlMode > CONTROL_PID)
+		config.controlMode = CONTROL_ON_OFF;
+	DeviceShadow::init(shadowProperties, sizeof(shadowProperties) / sizeof(shadowProperties[0]),
+		readForShadow, writeForShadow);
+	heatingEngine.setMode(config.controlMode);
 
 	gd->thermostatServer = new ESP8266WebServer(WEB_SERVER_PORT);
 	gd->timer = new Timer();
@@ -398,6 +502,7 @@ void setup()
 	gd->thermostatServer->on("/status", HTTPMethod::HTTP_GET, HandleHTTPGetStatus);
 	gd->thermostatServer->on("/TargetTemperature", HTTPMethod::HTTP_PUT, HandleHTTPTargetTemperature);
 	gd->thermostatServer->on("/Active", HTTPMethod::HTTP_PUT, HandleHTTPActive);
+	gd->thermostatServer->on("/shadow", HandleHTTPShadow);
 	gd->thermostatServer->on("/config", HandleConfig);
 
 	// captive pages
@@ -408,23 +513,34 @@ void setup()
 	gd->thermostatServer->serveStatic(
 		"/bootstrap.min.css", SPIFFS, "/bootstrap.min.css");
 
+	DeviceJobs::init(gd->thermostatServer);
+	gd->thermostatServer->onNotFound(DeviceJobs::handleNotFound);
+
 	gd->thermostatServer->begin();
 	Serial.println("HTTP server started.");
 
 	// Set up regulars
-	gd->timer->every(UPDATE_TEMP_EVERY, temperatureUpdate);
-	gd->timer->every(CHECK_HEATING_EVERY, controlHeating);
-	gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates);
-	gd->timer->every(POST_TEMPERATURE_EVERY, postTemperature);
-
-	pinMode(AC_CONTROL_PIN, OUTPUT);
+	gd->timer->setName(gd->timer->every(UPDATE_TEMP_EVERY, temperatureUpdate), "temperatureUpdate");
+	gd->timer->setName(gd->timer->every(CHECK_HEATING_EVERY, controlHeating), "controlHeating");
+	gd->timer->setName(gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates), "checkSoftwareUpdates");
+	setUpdateTimer(gd->timer);
+	gd->timer->setName(gd->timer->every(POST_TEMPERATURE_EVERY, postTemperature), "postTemperature");
 }
 
 void loop()
 {
 	ControllerData *gd = &GD;
 
+	saveOutputState(heatingEngine.getStates());
 	gd->thermostatServer->handleClient();
 	gd->timer->update();
 	WiFiManager::update();
+	JobQueue::update();
+	HTTPPool::update();
+	PowerBudget::update();
+
+	// Sleep until the next job as power policy allows, don't while
+	// waiting for outbound HTTP response, with queued jobs or power claims
+	WiFiManager::idle(HTTPPool::busy() || JobQueue::busy() || PowerBudget::busy() ?
+		millis() : gd->timer->nextDeadline());
 }
@@ -10,4 +10,7 @@ PUBLISH_DIR=192.168.1.162:/home/den/Shden/shweb/ota/floorheating/floor-2ch
 scp $BUILD_DIR/firmware.bin $PUBLISH_DIR/FW.bin
 scp $BUILD_DIR/spiffs.bin $PUBLISH_DIR/SPIFFS.bin
 scp $BUILD_DIR/../../../data/version.info $PUBLISH_DIR/version.info
+# manifest goes last, when the images it's about are there
+../../../shared/OTA/manifest.sh $BUILD_DIR/firmware.bin $BUILD_DIR/spiffs.bin $BUILD_DIR/../../../data/version.info > $BUILD_DIR/manifest.json
+scp $BUILD_DIR/manifest.json $PUBLISH_DIR/manifest.json
 echo Done.
@@ -32,10 +32,15 @@
 #include <DS1820.h>
 #include <OTA.h>
 #include <ConnectedESPConfiguration.h>
+#include <DeviceShadow.h>
 #include <WiFiManager.h>
 #include <ESPTemplateProcessor.h>
-#include <ArduinoJson.h>
-#include <ESP8266HttpClient.h>
+#include <JSONPathFilter.h>
+#include <HTTPPool.h>
+#include <JobQueue.h>
+#include <DeviceJobs.h>
+#include <PowerBudget.h>
+#include <HeatingEngine.h>
 
 #define ONE_WIRE_PIN            5
 
@@ -53,11 +58,13 @@
 #define CHECK_SW_UPDATES_EVERY	(60000L*5)	// every 5 min
 #define CHECK_1WIRE_SENSORS	(30000L)	// every 30 sec
 #define POST_TEMPERATURE_EVERY	(60000L)	// every minute
+#define SAVE_THERMAL_EVERY	(60000L*60*6)	// every 6 hours
 #define DEFAULT_TARGET_TEMP	28.0
 #define DEFAULT_ACTIVE		0
 #define OTA_URL_LEN		80
 #define ONE_WIRE_ADDR_LEN	16
 #define MAX_ALLOWED_POWER	16500		// max power
+#define HEATING_CHANNELS	2
 
 #define TEXT_HTML		"text/html"
 #define TEXT_PLAIN		"text/plain"
@@ -88,36 +95,43 @@ struct HeatingChannel
 /* will have ssid, secret, initialised, MDNSHost plus:
  *	- target temperature,
  *	- active flag,
- *	- OTA URL.
+ *	- OTA URL,
+ *	- power policy,
+ *	- control mode,
+ *	- learned thermal response of channels.
  */
 struct ConfigurationData : ConnectedESPConfiguration
 {
 	float                   targetTemp;
 	int8_t			active;
 	char			OTA_URL[OTA_URL_LEN + 1];
-	HeatingChannel		heatingChannel[2];
+	HeatingChannel		heatingChannel[HEATING_CHANNELS];
+	uint8_t			powerPolicy;
+	uint8_t			controlMode;
+	ThermalParameters	thermal[HEATING_CHANNELS];
 } config;
 
-// Check current power consumption via API
-float getPowerConsumption()
-{
-	if (WiFi.status() == WL_CONNECTED)
-	{
-		HTTPClient httpRequest;
-		httpRequest.begin("http://192.168.1.162:81/API/1.1/consumption/electricity/GetPowerMeterData");
-		int httpCode = httpRequest.GET();
+// Power meter response is streamed through it, only P.sum is kept
+JSONPathFilter powerSumFilter("P.sum");
 
-		if (httpCode > 0)
-		{
-			StaticJsonDocument<2048> jsonResponce;
-			deserializeJson(jsonResponce, httpRequest.getString());
+// Heating channels: relay pin, power and temperature are taken from config
+// and sensors, priority.
+Heater heaters[HEATING_CHANNELS] =
+{
+	{ AC_CONTROL_PIN_1,	0,	1,	0 },
+	{ AC_CONTROL_PIN_2,	0,	1,	0 }
+};
+HeatingEngine heatingEngine(heaters, HEATING_CHANNELS, MAX_ALLOWED_POWER);
 
-			float power = jsonResponce["P"]["sum"];
-			Serial.print("getPowerConsumption: ");
-			Serial.println(power);
-			return power;
-		}
-		httpRequest.end();
+// Power consumption from the power meter API response, -1 if failed
+float getPowerConsumption(int httpCode)
+{
+	if (httpCode > 0 && powerSumFilter.found())
+	{
+		float power = powerSumFilter.toFloat();
+		Serial.print("getPowerConsumption: ");
+		Serial.println(power);
+		return power;
 	}
 	return -1;
 }
@@ -130,36 +144,25 @@ void postTemperature()
 
 	if (WL_CONNECTED == WiFi.status())
 	{
-		HTTPClient httpRequest;
-		httpRequest.begin("http://192.168.1.162:81/API/1.1/climate/data/temperature");
-		httpRequest.addHeader("Content-Type", APPLICATION_JSON);
-
-		// Convert 1-wire addresses to char strings
-		DeviceAddress sensor1Address, sensor2Address;
-
-		memset(sensor1Address, 0, sizeof(DeviceAddress));
-		memset(sensor2Address, 0, sizeof(DeviceAddress));
-
-		gd->temperatureSensors->getAddress(0, sensor1Address);
-		gd->temperatureSensors->getAddress(1, sensor2Address);
-
-		DeviceAddressChar sensor1CharAddress, sensor2CharAddress;
-
-		gd->temperatureSensors->deviceAddresToString(sensor1Address, sensor1CharAddress);
-		gd->temperatureSensors->deviceAddresToString(sensor2Address, sensor2CharAddress);
-
 		// Prepare payload by the template: [{ "temperature" : 21.5, "sensorId": "28FF72BF47160342" }]
-		String temperaturePayload =
-			String("[") +
-			"{ \"temperature\" : " + String(getTemperature(config.heatingChannel[0].sensorAddress), 2) +
-			", \"sensorId\" : \"" + String(sensor1CharAddress) + "\" }" +
-			", " +
-			"{ \"temperature\" : " + String(getTemperature(config.heatingChannel[1].sensorAddress), 2) +
-			", \"sensorId\" : \"" + String(sensor2CharAddress) + "\" }" +
-			"]";
-		
+		String temperaturePayload = "[";
+		for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
+		{
+			DeviceAddressChar sensorCharAddress;
+			gd->temperatureSensors->deviceAddresToString(config.heatingChannel[i].sensorAddress, sensorCharAddress);
+
+			if (i)
+				temperaturePayload += ", ";
+			temperaturePayload +=
+				String("{ \"temperature\" : ") + String(getTemperature(config.heatingChannel[i].sensorAddress), 2) +
+				", \"sensorId\" : \"" + String(sensorCharAddress) + "\" }";
+		}
+		temperaturePayload += "]";
+
 		// Just fire and forget
-		httpRequest.POST(temperaturePayload);
+		HTTPPool::POST(
+			"http://192.168.1.162:81/API/1.1/climate/data/temperature",
+			temperaturePayload);
 	}
 }
 
@@ -175,7 +178,7 @@ float getTemperature(DeviceAddress sensorAddress)
 // Update temperatureSensor internal data
 void temperatureUpdate()
 {
-	for (uint8_t sensorIndex = 0; sensorIndex < 2; sensorIndex++)
+	for (uint8_t sensorIndex = 0; sensorIndex < HEATING_CHANNELS; sensorIndex++)
 	{
 		float temp = getTemperature(config.heatingChannel[sensorIndex].sensorAddress);
 
@@ -184,66 +187,95 @@ void temperatureUpdate()
 	}
 }
 
-// Heating control.
-void controlHeating()
+// Heating decision on @currentPower house consumption.
+void decideHeating(float currentPower)
 {
-	float currentPower = getPowerConsumption();
+	for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
+	{
+		heaters[i].power = config.heatingChannel[i].heatingPower;
+		heaters[i].temperature = getTemperature(config.heatingChannel[i].sensorAddress);
+	}
 
-	float tempDelta[2];
-	tempDelta[0] = config.targetTemp - getTemperature(config.heatingChannel[0].sensorAddress);  
-	tempDelta[1] = config.targetTemp - getTemperature(config.heatingChannel[1].sensorAddress);
+	heatingEngine.control(currentPower, config.targetTemp, config.active);
+}
 
-	uint8_t neededState[2];
-	neededState[0] = config.active && tempDelta[0] > 0;
-	neededState[1] = config.active && tempDelta[1] > 0;
+// Power meter has responded, base load is reconciled with it.
+void onPowerConsumption(int httpCode, const String& response, void* context)
+{
+	float meterPower = getPowerConsumption(httpCode);
+	if (meterPower >= 0)
+		heatingEngine.reconcile(meterPower);
 
-	uint8_t currentState[2];
-	currentState[0] = digitalRead(AC_CONTROL_PIN_1);
-	currentState[1] = digitalRead(AC_CONTROL_PIN_2);
+	decideHeating(heatingEngine.getEnergyModel().getPower());
+}
 
-	// Start from most cold segment
-	uint8_t channelTraverseVector[2];
-	if (tempDelta[0] > tempDelta[1])
+// Heating control: house power is estimated by the energy model, the
+// meter is only checked when the model needs to be reconciled.
+void controlHeating()
+{
+	if (heatingEngine.needsReconcile())
 	{
-		channelTraverseVector[0] = 0;
-		channelTraverseVector[1] = 1;
+		powerSumFilter.reset();
+		HTTPPool::GET(
+			"http://192.168.1.162:81/API/1.1/consumption/electricity/GetPowerMeterData",
+			onPowerConsumption, &powerSumFilter, JSONPathFilter::filter);
 	}
 	else
 	{
-		channelTraverseVector[0] = 1;
-		channelTraverseVector[1] = 0;
+		decideHeating(heatingEngine.getEnergyModel().getPower());
 	}
+}
 
-	// Traverse segments
-	for (uint8_t i = 0; i < 2; i++)
+// Learned thermal response goes to EEPROM when it has changed, not on
+// every sample to spare flash.
+void saveThermalParameters()
+{
+	bool changed = false;
+	for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
 	{
-		uint8_t segemetIndex = channelTraverseVector[i];
-
-		float powerDelta = 0;
-		if (neededState[segemetIndex] > currentState[segemetIndex]) 
-			powerDelta = config.heatingChannel[segemetIndex].heatingPower;
-		if (neededState[segemetIndex] < currentState[segemetIndex]) 
-			powerDelta = -config.heatingChannel[segemetIndex].heatingPower;
-
-		uint8_t canChangePower = 
-			!neededState[segemetIndex] || 
-			(neededState[segemetIndex] && currentPower + powerDelta < MAX_ALLOWED_POWER);
-		
-		if (canChangePower)
+		ThermalParameters parameters = heatingEngine.getThermalModel(i).getParameters();
+		if (memcmp(&parameters, &config.thermal[i], sizeof(ThermalParameters)))
 		{
-			uint8_t controlPins[2];
-			controlPins[0] = AC_CONTROL_PIN_1;
-			controlPins[1] = AC_CONTROL_PIN_2;
-
-			digitalWrite(controlPins[segemetIndex], neededState[segemetIndex]);
-			Serial.printf("Heating channel %d state: %d\n", segemetIndex, neededState[segemetIndex]);
-			currentPower += powerDelta;
+			config.thermal[i] = parameters;
+			changed = true;
 		}
-		else
-		{
-			Serial.printf("Requred power (%fW) for channel %d is over limit, can't on.\n", currentPower + powerDelta, segemetIndex);
-		}	
 	}
+
+	if (changed)
+		saveConfiguration(&config, sizeof(ConfigurationData));
+}
+
+// HTTP GET /thermal, learned response of channels and the time heating
+// of each has to start (StartIn) to be at the target when it's needed.
+void HandleHTTPGetThermal()
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	String json = "{ \"Channels\" : [ ";
+	for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
+	{
+		ThermalModel& model = heatingEngine.getThermalModel(i);
+		ThermalParameters parameters = model.getParameters();
+		float temperature = getTemperature(config.heatingChannel[i].sensorAddress);
+
+		if (i)
+			json += ", ";
+		json +=
+		String("{ ") +
+			"\"HeatingRate\" : " + String(parameters.heatingRate, 2) + ", " +
+			"\"CoolingTime\" : " + String(parameters.coolingTime, 2) + ", " +
+			"\"Ambient\" : " + String(parameters.ambient, 2) + ", " +
+			"\"Samples\" : " + String(parameters.samples) + ", " +
+			"\"Learned\" : " + String(model.isLearned()) + ", " +
+			"\"RunTime\" : " + String(model.getRunTime(temperature, config.targetTemp), 2) + ", " +
+			"\"StartIn\" : " + String(model.getIdleTime(temperature, config.targetTemp), 2) +
+		" }";
+	}
+	json += " ] }\r\n";
+
+	gd->thermostatServer->sendHeader("Access-Control-Allow-Origin", "*");
+	gd->thermostatServer->send(200, APPLICATION_JSON, json);
 }
 
 // HTTP GET /status
@@ -252,14 +284,28 @@ void HandleHTTPGetStatus()
 	// Warning: uses global data
 	ControllerData *gd = &GD;
 
-	String json =
-	String("{ ") +
-		"\"CurrentTemperature_ch0\" : " + String(getTemperature(config.heatingChannel[0].sensorAddress), 2) + ", " +
-		"\"CurrentTemperature_ch1\" : " + String(getTemperature(config.heatingChannel[1].sensorAddress), 2) + ", " +
-		"\"TargetTemperature\" : " + String(config.targetTemp, 2) + ", " +
+	String json = "{ ";
+	for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
+	{
+		String channel = String("_ch") + String(i) + "\" : ";
+		json +=
+			String("\"CurrentTemperature") + channel + String(getTemperature(config.heatingChannel[i].sensorAddress), 2) + ", " +
+			"\"Heating" + channel + String(heatingEngine.isOn(i)) + ", " +
+			"\"Duty" + channel + String(heatingEngine.getDuty(i), 2) + ", " +
+			"\"Energy" + channel + String(heatingEngine.getEnergyModel().getEnergy(i), 3) + ", ";
+	}
+	json +=
+		String("\"TargetTemperature\" : ") + String(config.targetTemp, 2) + ", " +
 		"\"Active\" : " + String(config.active) + ", " +
-		"\"Heating_ch0\" : " + String(digitalRead(AC_CONTROL_PIN_1)) + ", " +
-		"\"Heating_ch1\" : " + String(digitalRead(AC_CONTROL_PIN_2)) + ", " +
+		"\"ControlMode\" : " + String(config.controlMode) + ", " +
+		"\"HeatingLoad\" : " + String(heatingEngine.getEnergyModel().getHeatingLoad(), 0) + ", " +
+		"\"BaseLoad\" : " + String(heatingEngine.getEnergyModel().getBaseLoad(), 0) + ", " +
+		"\"OutboundHTTP\" : " + HTTPPool::getStatistics() + ", " +
+		"\"PowerBudget\" : " + PowerBudget::getStatistics() + ", " +
+		"\"Shadow\" : " + DeviceShadow::getStatistics() + ", " +
+		"\"Jobs\" : " + JobQueue::getStatistics() + ", " +
+		"\"Timers\" : " + gd->timer->getStatistics() + ", " +
+		"\"WiFiConnectTime\" : " + String(WiFiManager::getConnectionTime()) + ", " +
 		"\"Build\" : " + String(FW_VERSION) +
 	" }\r\n";
 
@@ -328,6 +374,57 @@ int getFWCurrentVersion()
 	return spiffsVersion;
 }
 
+// Desired state properties, see DeviceShadow.h
+const char* const shadowProperties[] = { "Active", "TargetTemperature", "ControlMode" };
+
+float readForShadow(uint8_t property)
+{
+	if (0 == property) return config.active;
+	if (1 == property) return config.targetTemp;
+	return config.controlMode;
+}
+
+// Takes valid values only, as /Active and /TargetTemperature do
+bool writeForShadow(uint8_t property, float value)
+{
+	if (0 == property && (0 == value || 1 == value))
+		config.active = value;
+	else if (1 == property && value > 0.0 && value < 100.0)
+		config.targetTemp = value;
+	else if (2 == property && (CONTROL_ON_OFF == value || CONTROL_PID == value))
+		config.controlMode = value;
+	else
+		return false;
+	return true;
+}
+
+// HTTP PUT /shadow, reconciles to desired state document in the body and
+// replies with the version applied and what is not as desired. HTTP GET
+// /shadow gives the reported state.
+// to test:
+//	$ curl -X PUT -d '{ "Version" : 1, "Desired" : { "Active" : 1 } }' 192.168.1.120/shadow
+void HandleHTTPShadow()
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	if (HTTPMethod::HTTP_GET == gd->thermostatServer->method())
+	{
+		gd->thermostatServer->send(200, APPLICATION_JSON, DeviceShadow::getReported() + "\r\n");
+		return;
+	}
+
+	String reply;
+	bool changed;
+	int code = DeviceShadow::apply(gd->thermostatServer->arg("plain"), &reply, &changed);
+	if (changed)
+	{
+		saveConfiguration(&config, sizeof(ConfigurationData));
+		controlHeating();
+	}
+	gd->thermostatServer->send(code, APPLICATION_JSON, reply + "\r\n");
+}
+
 // Maps config.html parameters to configuration values.
 String mapConfigParameters(const String& key)
 {
@@ -341,41 +438,45 @@ String mapConfigParameters(const String& key)
 	if (key == "BUILD") return String(FW_VERSION); else
 	if (key == "DS1820IDS") 
 	{
-		DeviceAddress sensor1Address, sensor2Address;
-
-		memset(sensor1Address, 0, sizeof(DeviceAddress));
-		memset(sensor2Address, 0, sizeof(DeviceAddress));
-
-		gd->temperatureSensors->getAddress(0, sensor1Address);
-		gd->temperatureSensors->getAddress(1, sensor2Address);
-
-		DeviceAddressChar sensor1CharAddress, sensor2CharAddress;
+		// Sensors as found on the bus, with heating of the channel in order
+		String ids;
+		for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
+		{
+			DeviceAddress sensorAddress;
+			memset(sensorAddress, 0, sizeof(DeviceAddress));
+			gd->temperatureSensors->getAddress(i, sensorAddress);
 
-		gd->temperatureSensors->deviceAddresToString(sensor1Address, sensor1CharAddress);
-		gd->temperatureSensors->deviceAddresToString(sensor2Address, sensor2CharAddress);
+			DeviceAddressChar sensorCharAddress;
+			gd->temperatureSensors->deviceAddresToString(sensorAddress, sensorCharAddress);
 
-		return 
-			String(sensor1CharAddress) + ", heating is " + (digitalRead(AC_CONTROL_PIN_1) ? "on" : "off") + "\r\n" + 
-			String(sensor2CharAddress) + ", heating is " + (digitalRead(AC_CONTROL_PIN_2) ? "on" : "off");
+			if (i)
+				ids += "\r\n";
+			ids += String(sensorCharAddress) + ", heating is " + (heatingEngine.isOn(i) ? "on" : "off");
+		}
+		return ids;
 	} else
 	if (key == "VERSION") return (String(getFWCurrentVersion())); else
 	if (key == "T_TEMP") return String(config.targetTemp); else
-	if (key == "DS1820_CH1_ADDR") 
-	{
-		DeviceAddressChar addressString;
-		gd->temperatureSensors->deviceAddresToString(config.heatingChannel[0].sensorAddress, addressString);
-		return String(addressString);
-	} else
-	if (key == "DS1820_CH2_ADDR") 
-	{
-		DeviceAddressChar addressString;
-		gd->temperatureSensors->deviceAddresToString(config.heatingChannel[1].sensorAddress, addressString);
-		return String(addressString);
-	} else
-	if (key == "CH1_POWER") return String(config.heatingChannel[0].heatingPower); else
-	if (key == "CH2_POWER") return String(config.heatingChannel[1].heatingPower); else
 	if (key == "CHECKED") return config.active ? "checked" : ""; else
+	if (key == "PID_CHECKED") return CONTROL_PID == config.controlMode ? "checked" : ""; else
 	if (key == "OTA_URL") return String(config.OTA_URL); else
+	if (key == "POWER_FULL") return config.powerPolicy == WiFiManager::POWER_FULL ? "selected" : ""; else
+	if (key == "POWER_BALANCED") return config.powerPolicy == WiFiManager::POWER_BALANCED ? "selected" : ""; else
+	if (key == "POWER_SAVING") return config.powerPolicy == WiFiManager::POWER_SAVING ? "selected" : "";
+
+	// Channels are numbered from 1 on the page
+	for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
+	{
+		String channel = String(i + 1);
+		if (key == String("DS1820_CH") + channel + "_ADDR")
+		{
+			DeviceAddressChar addressString;
+			gd->temperatureSensors->deviceAddresToString(config.heatingChannel[i].sensorAddress, addressString);
+			return String(addressString);
+		}
+		if (key == String("CH") + channel + "_POWER")
+			return String(config.heatingChannel[i].heatingPower);
+	}
 	return "Mapping value undefined.";
 }
 
@@ -411,13 +512,9 @@ void HandleConfig()
 
 		saveConfiguration(&config, sizeof(config));
 
-		// redirect to the same page without arguments
-		gd->thermostatServer->sendHeader("Location", String("/config"), true);
-		gd->thermostatServer->send(302, TEXT_PLAIN, "");
-
-		// Try connecting with new credentials
-		WiFi.disconnect();
-		WiFiManager::handleWiFiConnectivity();
+		// Try connecting with new credentials once the reply is out
+		DeviceJobs::accept("reconnectWiFi", DeviceJobs::reconnectWiFi);
+		return;
 	}
 
 	// Reboot
@@ -435,29 +532,26 @@ void HandleConfig()
 		if (temperature > 0.0 && temperature < 100.0)
 			config.targetTemp = temperature;
 
-		// Channel 1
-		DeviceAddressChar sensorAddress;
-		gd->thermostatServer->arg("DS1820_CH1_ADDR").toCharArray(sensorAddress, ONE_WIRE_ADDR_LEN + 1);
-		gd->temperatureSensors->stringToDeviceAddress(sensorAddress, config.heatingChannel[0].sensorAddress);
-
-		param = gd->thermostatServer->arg("CH1_POWER");
-		int power = param.toInt();
-		if (power > 0 && power < 3000)
-			config.heatingChannel[0].heatingPower = power;
-
-		// Channel 2
-		gd->thermostatServer->arg("DS1820_CH2_ADDR").toCharArray(sensorAddress, ONE_WIRE_ADDR_LEN + 1);
-		gd->temperatureSensors->stringToDeviceAddress(sensorAddress, config.heatingChannel[1].sensorAddress);
-
-		param = gd->thermostatServer->arg("CH2_POWER");
-		power = param.toInt();
-		if (power > 0 && power < 3000)
-			config.heatingChannel[1].heatingPower = power;
+		for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
+		{
+			String channel = String(i + 1);
+			DeviceAddressChar sensorAddress;
+			gd->thermostatServer->arg(String("DS1820_CH") + channel + "_ADDR").toCharArray(sensorAddress, ONE_WIRE_ADDR_LEN + 1);
+			gd->temperatureSensors->stringToDeviceAddress(sensorAddress, config.heatingChannel[i].sensorAddress);
+
+			int power = gd->thermostatServer->arg(String("CH") + channel + "_POWER").toInt();
+			if (power > 0 && power < 3000)
+				config.heatingChannel[i].heatingPower = power;
+		}
 
 		config.active = gd->thermostatServer->hasArg("ACTIVE");
 		gd->thermostatServer->arg("OTA_URL").toCharArray(
 			config.OTA_URL, OTA_URL_LEN);
 
+		config.powerPolicy = gd->thermostatServer->arg("POWER_POLICY").toInt();
+		WiFiManager::setPowerPolicy(config.powerPolicy);
+		config.controlMode = gd->thermostatServer->hasArg("PID_MODE") ? CONTROL_PID : CONTROL_ON_OFF;
+		heatingEngine.setMode(config.controlMode);
 		saveConfiguration(&config, sizeof(ConfigurationData));
 	}
 
@@ -465,7 +559,8 @@ void HandleConfig()
 	if (gd->thermostatServer->hasArg("CHECK_UPDATE_NOW"))
 	{
 		Serial.println("Checking software updates available.");
-		checkSoftwareUpdates();
+		DeviceJobs::acceptUpdateCheck(FW_VERSION, config.OTA_URL);
+		return;
 	}
 
 	ESPTemplateProcessor(*gd->thermostatServer).send(
@@ -498,9 +593,21 @@ void setup()
 	Serial.println("Initialisation.");
 	Serial.printf("ShHarbor thermostat build %d.\n", FW_VERSION);
 
+	// Heating is back right after a warm reboot (OTA, crash), not at the
+	// next control cycle
+	uint32_t outputs = 0;
+	if (loadOutputState(&outputs))
+		Serial.printf("Heating state restored: %d\n", outputs);
+	heatingEngine.init(outputs);
+
 	Serial.println("Configuration loading.");
 	loadConfiguration(&config, sizeof(ConfigurationData));
 
+	// Heaters restored on are counted with their power from config
+	for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
+		heaters[i].power = config.heatingChannel[i].heatingPower;
+	heatingEngine.init(heatingEngine.getStates());
+
 	// Warning: uses global data
 	ControllerData *gd = &GD;
 
@@ -512,6 +619,19 @@ void setup()
 	// Initialise WiFi entity that will handle connectivity. We don't
 	// care of WiFi anymore, all handled inside it
 	WiFiManager::init(&config);
+	PowerBudget::init(MAX_ALLOWED_POWER);
+
+	// Uninitialised in EEPROM after upgrade
+	if (config.powerPolicy > WiFiManager::POWER_SAVING)
+		config.powerPolicy = WiFiManager::POWER_FULL;
+	WiFiManager::setPowerPolicy(config.powerPolicy);
+	if (config.controlMode > CONTROL_PID)
+		config.controlMode = CONTROL_ON_OFF;
+	DeviceShadow::init(shadowProperties, sizeof(shadowProperties) / sizeof(shadowProperties[0]),
+		readForShadow, writeForShadow);
+	heatingEngine.setMode(config.controlMode);
+	for (uint8_t i = 0; i < HEATING_CHANNELS; i++)
+		heatingEngine.getThermalModel(i).setParameters(config.thermal[i]);
 
 	gd->thermostatServer = new ESP8266WebServer(WEB_SERVER_PORT);
 	gd->timer = new Timer();
@@ -522,8 +642,10 @@ void setup()
 		Serial.println("SPIFFS mount failed.");
 
 	gd->thermostatServer->on("/status", HTTPMethod::HTTP_GET, HandleHTTPGetStatus);
+	gd->thermostatServer->on("/thermal", HTTPMethod::HTTP_GET, HandleHTTPGetThermal);
 	gd->thermostatServer->on("/TargetTemperature", HTTPMethod::HTTP_PUT, HandleHTTPTargetTemperature);
 	gd->thermostatServer->on("/Active", HTTPMethod::HTTP_PUT, HandleHTTPActive);
+	gd->thermostatServer->on("/shadow", HandleHTTPShadow);
 	gd->thermostatServer->on("/config", HandleConfig);
 
 	// captive pages
@@ -534,26 +656,35 @@ void setup()
 	gd->thermostatServer->serveStatic(
 		"/bootstrap.min.css", SPIFFS, "/bootstrap.min.css");
 
+	DeviceJobs::init(gd->thermostatServer);
+	gd->thermostatServer->onNotFound(DeviceJobs::handleNotFound);
+
 	gd->thermostatServer->begin();
 	Serial.println("HTTP server started.");
 
 	// Set up regulars
-	gd->timer->every(UPDATE_TEMP_EVERY, temperatureUpdate);
-	gd->timer->every(CHECK_HEATING_EVERY, controlHeating);
-	gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates);
-	gd->timer->every(POST_TEMPERATURE_EVERY, postTemperature);
-
-	pinMode(AC_CONTROL_PIN_1, OUTPUT);
-	pinMode(AC_CONTROL_PIN_2, OUTPUT);
-	digitalWrite(AC_CONTROL_PIN_1, LOW);
-	digitalWrite(AC_CONTROL_PIN_2, LOW);
+	gd->timer->setName(gd->timer->every(UPDATE_TEMP_EVERY, temperatureUpdate), "temperatureUpdate");
+	gd->timer->setName(gd->timer->every(CHECK_HEATING_EVERY, controlHeating), "controlHeating");
+	gd->timer->setName(gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates), "checkSoftwareUpdates");
+	setUpdateTimer(gd->timer);
+	gd->timer->setName(gd->timer->every(POST_TEMPERATURE_EVERY, postTemperature), "postTemperature");
+	gd->timer->setName(gd->timer->every(SAVE_THERMAL_EVERY, saveThermalParameters), "saveThermalParameters");
 }
 
 void loop()
 {
 	ControllerData *gd = &GD;
 
+	saveOutputState(heatingEngine.getStates());
 	gd->thermostatServer->handleClient();
 	gd->timer->update();
 	WiFiManager::update();
+	JobQueue::update();
+	HTTPPool::update();
+	PowerBudget::update();
+
+	// Sleep until the next job as power policy allows, don't while
+	// waiting for outbound HTTP response, with queued jobs or power claims
+	WiFiManager::idle(HTTPPool::busy() || JobQueue::busy() || PowerBudget::busy() ?
+		millis() : gd->timer->nextDeadline());
 }
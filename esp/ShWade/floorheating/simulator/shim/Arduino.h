@@ -0,0 +1,130 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+/*
+	Host stand-in of the Arduino core, just enough for the shared heating
+	code to run in the simulator. Clock and pins are virtual, see
+	simulator.cpp. Linked switches simulator and rules benchmark of ShHarbor
+	use it too.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+enum StringBase
+{
+	DEC = 10,
+	HEX = 16
+};
+
+#define LOW		0
+#define HIGH		1
+#define INPUT		0
+#define OUTPUT		1
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+class String
+{
+public:
+	String(const char* s = "") : s(s) {}
+	String(const std::string& s) : s(s) {}
+	String(int v) : s(std::to_string(v)) {}
+	String(unsigned int v) : s(std::to_string(v)) {}
+	String(long v) : s(std::to_string(v)) {}
+	String(unsigned long v) : s(std::to_string(v)) {}
+	String(unsigned int v, StringBase base)
+	{
+		char buffer[16];
+		snprintf(buffer, sizeof(buffer), HEX == base ? "%x" : "%u", v);
+		s = buffer;
+	}
+	String(double v, int decimals = 2)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.*f", decimals, v);
+		s = buffer;
+	}
+
+	String operator+(const String& other) const { return String(s + other.s); }
+	String& operator+=(const String& other) { s += other.s; return *this; }
+	String& operator+=(char c) { s += c; return *this; }
+	bool operator==(const String& other) const { return s == other.s; }
+	const char* c_str() const { return s.c_str(); }
+	unsigned int length() const { return s.length(); }
+	bool startsWith(const String& prefix) const { return !s.compare(0, prefix.s.length(), prefix.s); }
+	String substring(unsigned int from) const { return from < s.length() ? String(s.substr(from)) : String(); }
+	String substring(unsigned int from, unsigned int to) const
+	{
+		return from < to && from < s.length() ? String(s.substr(from, to - from)) : String();
+	}
+	int indexOf(char c, unsigned int from = 0) const { return found(s.find(c, from)); }
+	int indexOf(const String& other, unsigned int from = 0) const { return found(s.find(other.s, from)); }
+	char charAt(unsigned int i) const { return i < s.length() ? s[i] : 0; }
+	bool equalsIgnoreCase(const String& other) const { return !strcasecmp(s.c_str(), other.s.c_str()); }
+	long toInt() const { return atol(s.c_str()); }
+	void toUpperCase() { for (size_t i = 0; i < s.length(); i++) s[i] = toupper(s[i]); }
+	void toLowerCase() { for (size_t i = 0; i < s.length(); i++) s[i] = tolower(s[i]); }
+	void toCharArray(char* buffer, unsigned int size) const
+	{
+		if (size)
+			buffer[s.copy(buffer, size - 1)] = 0;
+	}
+
+private:
+	std::string s;
+
+	static int found(size_t position) { return std::string::npos == position ? -1 : position; }
+};
+
+inline String operator+(const char* left, const String& right) { return String(left) + right; }
+
+class HardwareSerial
+{
+public:
+	bool enabled = false;
+
+	void printf(const char* format, ...)
+	{
+		if (!enabled)
+			return;
+		va_list args;
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+	}
+	void print(const String& s) { printf("%s", s.c_str()); }
+	void println(const String& s) { printf("%s\n", s.c_str()); }
+	void print(double v) { printf("%.2f", v); }
+	void println(double v) { printf("%.2f\n", v); }
+};
+extern HardwareSerial Serial;
+
+class EspClass
+{
+public:
+	uint32_t chipId = 0x5151;		// simulator sets it per node
+
+	uint32_t getChipId() { return chipId; }
+};
+extern EspClass ESP;
+
+#endif
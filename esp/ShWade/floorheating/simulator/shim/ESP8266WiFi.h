@@ -0,0 +1,82 @@
+#ifndef ESP8266_WIFI_H
+#define ESP8266_WIFI_H
+
+/*
+	Host stand-in: simulated node is off the network by default, so
+	PowerBudget decides claims alone. Simulator connects the nodes it runs
+	on the virtual multicast of WiFiUdp.h, setting the address of each.
+	Connecting, access point and sleep modes are no-ops for WiFiManager
+	tests, they connect it by setting the address too. Any host name
+	resolves after dnsTime ms of the virtual clock, unless that is over
+	the timeout.
+*/
+
+#include <Arduino.h>
+
+#define WL_CONNECTED		3
+#define WL_DISCONNECTED		6
+
+#define WIFI_STA		1
+#define WIFI_AP_STA		3
+
+enum WiFiSleepType
+{
+	WIFI_NONE_SLEEP,
+	WIFI_LIGHT_SLEEP,
+	WIFI_MODEM_SLEEP
+};
+
+class IPAddress
+{
+public:
+	IPAddress(uint32_t address = 0) : address(address) {}
+	IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) :
+		address(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+	operator uint32_t() const { return address; }
+	bool isSet() const { return address != 0; }
+	String toString() const
+	{
+		char buffer[16];
+		snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", address & 0xFF,
+			(address >> 8) & 0xFF, (address >> 16) & 0xFF, address >> 24);
+		return String(buffer);
+	}
+
+private:
+	uint32_t address;
+};
+
+class WiFiClass
+{
+public:
+	IPAddress ip;				// not connected while unset
+	unsigned long dnsTime = 0;		// ms a lookup takes
+
+	int status() { return ip.isSet() ? WL_CONNECTED : WL_DISCONNECTED; }
+	IPAddress localIP() { return ip; }
+
+	void mode(int) {}
+	void begin(const char*, const char*, int32_t = 0, const uint8_t* = NULL) {}
+	void config(IPAddress, IPAddress, IPAddress, IPAddress = IPAddress()) {}
+	uint8_t* BSSID() { static uint8_t bssid[6]; return bssid; }
+	int32_t channel() { return 1; }
+	IPAddress gatewayIP() { return IPAddress(); }
+	IPAddress subnetMask() { return IPAddress(); }
+	IPAddress dnsIP() { return IPAddress(); }
+	void setSleepMode(WiFiSleepType) {}
+	void softAP(const char*) {}
+	IPAddress softAPIP() { return IPAddress(192, 168, 4, 1); }
+	void softAPdisconnect(bool) {}
+
+	int hostByName(const char*, IPAddress& result, uint32_t timeout = 10000)
+	{
+		delay(min((unsigned long)timeout, dnsTime));
+		if (dnsTime > timeout)
+			return 0;
+		result = IPAddress(10, 0, 0, 1);
+		return 1;
+	}
+};
+extern WiFiClass WiFi;
+
+#endif
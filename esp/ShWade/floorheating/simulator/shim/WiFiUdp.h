@@ -0,0 +1,146 @@
+#ifndef WIFI_UDP_H
+#define WIFI_UDP_H
+
+/*
+	Host stand-in: WiFiUDP objects that have joined a group share one
+	virtual multicast, there is just one group. Every receiver loses a
+	datagram with VirtualMulticast::loss probability, the others get it
+	latency ms of the virtual clock later. Sender doesn't get its own.
+	Unicast reaches all the other members too, they share the one port.
+*/
+
+#include <ESP8266WiFi.h>
+#include <deque>
+#include <vector>
+
+class WiFiUDP;
+
+struct VirtualMulticast
+{
+	float			loss;			// 0..1
+	unsigned long		latency;		// ms
+	unsigned long		randomState;
+	unsigned long		sent;			// datagram copies
+	unsigned long		lost;
+	std::vector<WiFiUDP*>	members;
+
+	// Never destroyed, sockets of static nodes leave it at exit
+	static VirtualMulticast& get()
+	{
+		static VirtualMulticast* bus = new VirtualMulticast { 0, 1, 1, 0, 0, std::vector<WiFiUDP*>() };
+		return *bus;
+	}
+
+	// Deterministic, apart from the simulation random
+	bool isLost()
+	{
+		randomState = randomState * 1103515245 + 12345;
+		return ((randomState >> 16) & 0x7FFF) / 32768.0 < loss;
+	}
+
+	// True while some datagram is on the way, not due yet
+	static bool inFlight();
+};
+
+class WiFiUDP
+{
+public:
+	~WiFiUDP() { stop(); }
+
+	uint8_t beginMulticast(IPAddress, IPAddress, uint16_t)
+	{
+		stop();
+		VirtualMulticast::get().members.push_back(this);
+		return 1;
+	}
+
+	int beginPacketMulticast(IPAddress, uint16_t, IPAddress)
+	{
+		packet.clear();
+		return 1;
+	}
+
+	int beginPacket(IPAddress, uint16_t)
+	{
+		packet.clear();
+		return 1;
+	}
+
+	IPAddress remoteIP() { return IPAddress(); }
+
+	size_t print(const char* s)
+	{
+		packet += s;
+		return strlen(s);
+	}
+
+	int endPacket()
+	{
+		VirtualMulticast& bus = VirtualMulticast::get();
+		for (size_t i = 0; i < bus.members.size(); i++)
+		{
+			if (bus.members[i] == this)
+				continue;
+			bus.sent++;
+			if (bus.isLost())
+			{
+				bus.lost++;
+				continue;
+			}
+			Datagram datagram = { millis() + bus.latency, packet };
+			bus.members[i]->inbox.push_back(datagram);
+		}
+		packet.clear();
+		return 1;
+	}
+
+	int parsePacket()
+	{
+		if (inbox.empty() || (long)(millis() - inbox.front().at) < 0)
+			return 0;
+		current = inbox.front().data;
+		position = 0;
+		inbox.pop_front();
+		return current.length();
+	}
+
+	int read(char* buffer, size_t size)
+	{
+		size_t length = std::min(size, current.length() - position);
+		memcpy(buffer, current.data() + position, length);
+		position += length;
+		return length;
+	}
+
+	void stop()
+	{
+		std::vector<WiFiUDP*>& members = VirtualMulticast::get().members;
+		members.erase(std::remove(members.begin(), members.end(), this), members.end());
+		inbox.clear();
+	}
+
+private:
+	struct Datagram
+	{
+		unsigned long	at;
+		std::string	data;
+	};
+
+	friend struct VirtualMulticast;
+
+	std::string		packet;
+	std::deque<Datagram>	inbox;
+	std::string		current;
+	size_t			position = 0;
+};
+
+inline bool VirtualMulticast::inFlight()
+{
+	std::vector<WiFiUDP*>& members = get().members;
+	for (size_t i = 0; i < members.size(); i++)
+		if (!members[i]->inbox.empty() && (long)(millis() - members[i]->inbox.back().at) < 0)
+			return true;
+	return false;
+}
+
+#endif
@@ -0,0 +1,603 @@
+/*
+	Home: ShWade.
+
+	Floor heating simulator.
+
+	Runs the shared heating control code (HeatingEngine, EnergyModel,
+	PIDController, ThermalModel, PowerBudget, JSONPathFilter) on Linux against a model of
+	floor slabs, a virtual DS1820 bus and a virtual power meter, under a
+	virtual clock. Heating control is run by Timer on VirtualClock as the
+	firmware timer runs it. Two days of heating take well under a second.
+
+	Several nodes can share the house and its power cap: each one has its
+	own channels, timer and PowerBudget state, and they claim power on the
+	virtual multicast of shim/WiFiUdp.h, which loses datagrams with the
+	given probability. Clock steps 10 ms while claims or datagrams are
+	pending, 1 s otherwise. One node can be killed with its heaters on to
+	see its claims and leases expire.
+
+	Each channel is a slab heated by its heater, giving heat to the room,
+	the room loses it to the outside:
+
+		slab:	Cs * dTs/dt = P - Ksr * (Ts - Tr)
+		room:	Cr * dTr/dt = Ksr * (Ts - Tr) - Kro * (Tr - Tout)
+
+	With setback=<degrees> the target is that much lower from 22:00 till
+	06:00. At each change the thermal model predicts how long heating up
+	(till HEAT_UP_MARGIN below the target) or cooling down takes, the slab
+	shows how long it does. check=1 fails the run if the last ones differ
+	by more than THERMAL_TOLERANCE. The room drifts as above, ThermalModel
+	learns what the slab cools down to. Channels the cap holds near a
+	steady duty don't show the heater, so the check is for runs with
+	heaters under the cap. Overshoot and error are to the day target.
+
+	DS1820 sits in the slab with its own lag, readings are 1/16 degree with
+	a bit of noise. The house has a base load with appliances going on and
+	off, the meter serves it with the heaters in the GetPowerMeterData JSON
+	format and is checked the same way firmware does.
+
+	Build:
+	  g++ -std=gnu++11 -O2 -DARDUINO=100 -Ishim -I../../../shared/heating \
+	    -I../../../shared/power -I../../../shared/json \
+	    -I../../../shared/timer \
+	    simulator.cpp ../../../shared/heating/HeatingEngine.cpp \
+	    ../../../shared/heating/EnergyModel.cpp \
+	    ../../../shared/heating/PIDController.cpp \
+	    ../../../shared/heating/ThermalModel.cpp \
+	    ../../../shared/power/PowerBudget.cpp \
+	    ../../../shared/json/JSONPathFilter.cpp \
+	    ../../../shared/timer/Timer.cpp ../../../shared/timer/Event.cpp \
+	    ../../../shared/timer/Clock.cpp -o simulator
+
+	Run:
+	  ./simulator [channels=2] [hours=48] [mode=onoff|pid] [target=28]
+	    [power=2000] [seed=1] [csv=series.csv] [log=1] [nodes=1]
+	    [loss=0] [lag=0] [load=daily|steady] [kill=hours] [setback=0]
+	    [check=1]
+
+	Summary metrics are printed as JSON, time series of every minute go to
+	the csv file. Heaters are never switched off for the cap, so time over
+	the cap also comes from appliances going on while heaters are on,
+	OverCapSwitchOns counts the control decisions that went over it. With
+	load=steady the base load doesn't change, then any time over the cap
+	is the budget's fault and check=1 fails the run on it. PID switches
+	heaters more often, that's more claims, esp/shared/test runs:
+
+	  ./simulator nodes=24 loss=0.1 lag=5 kill=6 mode=pid target=21 \
+	    load=steady hours=12 check=1
+
+	Lag is the meter delay in seconds, the meter serves what it saw then.
+*/
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <HeatingEngine.h>
+#include <PowerBudget.h>
+#include <JSONPathFilter.h>
+#include <Timer.h>
+#include <WiFiUdp.h>
+
+#define MAX_ALLOWED_POWER	16500		// same as floor heating nodes
+#define CHECK_HEATING_EVERY	15000L		// ms, same as floor heating nodes
+#define STEP			1000		// simulation step, ms
+#define BUSY_STEP		10		// ms, while claims are on the way
+#define SERIES_EVERY		60		// csv row, s
+#define WARM_UP			(6 * 3600L)	// s, not counted in error
+
+#define SLAB_CAPACITY		2.5e6		// J/K
+#define SLAB_TO_ROOM		150.0		// W/K
+#define ROOM_CAPACITY		5.0e5		// J/K
+#define ROOM_LOSS		60.0		// W/K
+#define SENSOR_LAG		600.0		// s
+#define DS1820_STEP		0.0625		// degree
+#define THERMAL_TOLERANCE	0.2		// predicted setback times off the slab, relative
+#define HEAT_UP_MARGIN		0.5		// heating up is done this close to the target
+#define STEADY_LOAD		1500		// W, base load for load=steady
+#define MAX_NODES		32		// PowerBudget peers
+#define MAX_LAG			600		// s, meter delay
+
+// Virtual Arduino core
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+uint8_t pins[256];
+
+unsigned long millis() { return VirtualClock::clock.millis(); }
+unsigned long micros() { return VirtualClock::clock.micros(); }
+void delay(unsigned long ms) { VirtualClock::clock.delay(ms); }
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) { pins[pin] = value; }
+int digitalRead(uint8_t pin) { return pins[pin]; }
+
+// Simulation parameters
+struct Parameters
+{
+	uint8_t		channels;
+	float		hours;
+	uint8_t		mode;
+	float		target;
+	float		power;
+	unsigned long	seed;
+	const char*	csv;
+	uint8_t		nodes;
+	float		loss;			// datagram loss, 0..1
+	unsigned int	lag;			// meter delay, s
+	bool		steady;			// base load doesn't change
+	float		setback;		// degree lower at night
+	float		kill;			// hours, node goes silent, 0 never
+	bool		check;			// fail on time over the cap
+};
+
+// Channel physics and metrics
+struct Slab
+{
+	double		slab;
+	double		room;
+	double		sensor;
+	bool		on;
+	bool		reached;		// target has been reached once
+	double		overshoot;
+	unsigned long	switches;
+	double		energy;			// kWh
+	double		squaredError;
+	unsigned long	errorTime;		// ms
+
+	// Setback transition in progress and the last ones done, hours the
+	// thermal model predicted and the slab took
+	bool		inTransition;
+	bool		heatingUp;
+	unsigned long	transitionStart;	// s
+	float		transitionEnd;		// sensor temperature
+	double		predicted;
+	double		heatUp[2];
+	double		coolDown[2];
+};
+
+unsigned long randomState;
+
+// Deterministic random 0..1
+double randomValue()
+{
+	randomState = randomState * 1103515245 + 12345;
+	return ((randomState >> 16) & 0x7FFF) / 32768.0;
+}
+
+// Base house load over @step ms from @t: evening peak and appliances
+// going on and off.
+double getBaseLoad(unsigned long t, unsigned long step, bool steady)
+{
+	static unsigned long applianceUntil = 0;
+	static double appliancePower = 0;
+
+	if (steady)
+		return STEADY_LOAD;
+
+	if (t >= applianceUntil)
+	{
+		appliancePower = 0;
+		if (randomValue() < 0.02 * step / 60000)
+		{
+			appliancePower = 2000 + randomValue() * 7000;
+			applianceUntil = t + 300 + randomValue() * 3300;
+		}
+	}
+
+	double day = fmod(t, 86400.0) / 86400.0;
+	return 1500 + 1000 * sin(2 * M_PI * (day - 0.5)) + appliancePower;
+}
+
+double getOutdoorTemperature(unsigned long t)
+{
+	return -5 + 5 * sin(2 * M_PI * (fmod(t, 86400.0) / 86400.0 - 0.375));
+}
+
+// Target with the night setback, from 22:00 till 06:00
+float getTarget(Parameters* p, unsigned long t)
+{
+	unsigned long hour = t % 86400 / 3600;
+	return (hour >= 22 || hour < 6) ? p->target - p->setback : p->target;
+}
+
+// DS1820 reading of the slab sensor
+float readSensor(Slab* slab)
+{
+	double noise = (randomValue() - 0.5) * 2 * DS1820_STEP;
+	return floor((slab->sensor + noise) / DS1820_STEP) * DS1820_STEP;
+}
+
+// What firmware of a node works with
+struct Firmware
+{
+	Heater		heaters[HEATING_MAX_CHANNELS];
+	Slab		slabs[HEATING_MAX_CHANNELS];
+	uint8_t		channels;
+	float		target;
+	HeatingEngine*	engine;
+	JSONPathFilter*	powerSumFilter;
+	PowerBudget::State* budget;
+	uint32_t	chipId;
+	IPAddress	ip;			// unset, off the network
+	Timer		timer;
+	unsigned long	startAt;		// ms, heating control phase
+	bool		started;
+	bool		alive;
+	double		total;			// power the meter serves, W
+	unsigned long	meterRequests;
+};
+
+// Global ESP and WiFi are what @f sees, budget calls work on its state
+void enter(Firmware* f)
+{
+	ESP.chipId = f->chipId;
+	WiFi.ip = f->ip;
+	PowerBudget::select(f->budget);
+}
+
+// Target of @f changes to @target at @t: how long the thermal model says
+// heating up or cooling down to it takes, the slab shows how long it does
+void startTransitions(Firmware* f, float target, unsigned long t)
+{
+	for (uint8_t i = 0; i < f->channels; i++)
+	{
+		Slab* s = &f->slabs[i];
+		ThermalModel& model = f->engine->getThermalModel(i);
+		s->inTransition = true;
+		s->heatingUp = target > f->target;
+		s->transitionStart = t;
+		s->transitionEnd = s->heatingUp ? target - HEAT_UP_MARGIN : target;
+		s->predicted = s->heatingUp
+			? model.getRunTime(s->sensor, s->transitionEnd)
+			: model.getIdleTime(s->sensor, s->transitionEnd);
+	}
+}
+
+String getMeterResponse(double power);
+
+// Regular heating control, meter when the model needs it
+void controlHeating(void* context)
+{
+	Firmware* f = (Firmware*)context;
+
+	for (uint8_t i = 0; i < f->channels; i++)
+		f->heaters[i].temperature = readSensor(&f->slabs[i]);
+
+	EnergyModel& model = f->engine->getEnergyModel();
+	if (f->engine->needsReconcile())
+	{
+		f->meterRequests++;
+		String response = getMeterResponse(f->total);
+		f->powerSumFilter->reset();
+		for (const char* c = response.c_str(); *c; c++)
+			if (f->powerSumFilter->feed(*c))
+				break;
+		if (f->powerSumFilter->found())
+			f->engine->reconcile(f->powerSumFilter->toFloat());
+	}
+	f->engine->control(model.getPower(), f->target, true);
+}
+
+// Meter response in GetPowerMeterData format
+String getMeterResponse(double power)
+{
+	return
+		String("{ \"P\" : { ") +
+			"\"L1\" : " + String(power / 3, 1) + ", " +
+			"\"L2\" : " + String(power / 3, 1) + ", " +
+			"\"L3\" : " + String(power / 3, 1) + ", " +
+			"\"sum\" : " + String(power, 1) +
+		" }, \"U\" : { \"L1\" : 230.1, \"L2\" : 229.8, \"L3\" : 231.0 } }";
+}
+
+void parseParameters(int argc, char** argv, Parameters* p)
+{
+	p->channels = 2;
+	p->hours = 48;
+	p->mode = CONTROL_ON_OFF;
+	p->target = 28;
+	p->power = 2000;
+	p->seed = 1;
+	p->csv = NULL;
+	p->nodes = 1;
+	p->loss = 0;
+	p->lag = 0;
+	p->steady = false;
+	p->setback = 0;
+	p->kill = 0;
+	p->check = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		char* value = strchr(argv[i], '=');
+		if (!value)
+			continue;
+		*value++ = '\0';
+
+		if (!strcmp(argv[i], "channels")) p->channels = constrain(atoi(value), 1, HEATING_MAX_CHANNELS); else
+		if (!strcmp(argv[i], "hours")) p->hours = atof(value); else
+		if (!strcmp(argv[i], "mode")) p->mode = strcmp(value, "pid") ? CONTROL_ON_OFF : CONTROL_PID; else
+		if (!strcmp(argv[i], "target")) p->target = atof(value); else
+		if (!strcmp(argv[i], "power")) p->power = atof(value); else
+		if (!strcmp(argv[i], "seed")) p->seed = atol(value); else
+		if (!strcmp(argv[i], "csv")) p->csv = value; else
+		if (!strcmp(argv[i], "nodes")) p->nodes = constrain(atoi(value), 1, MAX_NODES); else
+		if (!strcmp(argv[i], "loss")) p->loss = atof(value); else
+		if (!strcmp(argv[i], "lag")) p->lag = constrain(atoi(value), 0, MAX_LAG); else
+		if (!strcmp(argv[i], "load")) p->steady = !strcmp(value, "steady"); else
+		if (!strcmp(argv[i], "setback")) p->setback = atof(value); else
+		if (!strcmp(argv[i], "kill")) p->kill = atof(value); else
+		if (!strcmp(argv[i], "check")) p->check = atoi(value); else
+		if (!strcmp(argv[i], "log")) Serial.enabled = atoi(value);
+	}
+}
+
+Firmware* newNode(Parameters* p, uint8_t n)
+{
+	Firmware* f = new Firmware();
+	f->channels = p->channels;
+	f->target = p->target;
+	for (uint8_t i = 0; i < p->channels; i++)
+	{
+		f->heaters[i].pin = 10 + n * HEATING_MAX_CHANNELS + i;
+		f->heaters[i].power = p->power;
+		f->heaters[i].priority = 1;
+		f->heaters[i].temperature = 0;
+
+		Slab* s = &f->slabs[i];
+		s->slab = s->room = s->sensor = 18 + i * 0.5 + (n % 8) * 0.25;
+	}
+
+	// Single node stays off the network as before
+	f->chipId = 1 == p->nodes ? 0x5151 : 0x1000 + n;
+	if (p->nodes > 1)
+		f->ip = IPAddress(10, 0, 0, 1 + n);
+	f->budget = PowerBudget::newState();
+	enter(f);
+
+	f->engine = new HeatingEngine(f->heaters, p->channels, MAX_ALLOWED_POWER);
+	f->engine->init();
+	f->engine->setMode(p->mode);
+	PowerBudget::init(MAX_ALLOWED_POWER);
+	f->powerSumFilter = new JSONPathFilter("P.sum");
+
+	// Nodes check heating at different times, some in the same second
+	f->timer.setClock(&VirtualClock::clock);
+	f->startAt = n * CHECK_HEATING_EVERY / p->nodes / 1000 * 1000;
+	f->alive = true;
+	return f;
+}
+
+// Slabs of @f over @step ms, returns the heating power
+double simulateNode(Firmware* f, Parameters* p, unsigned long t, unsigned long step,
+	double outdoor, bool* switchedOn)
+{
+	double dt = step / 1000.0;
+	double power = 0;
+	for (uint8_t i = 0; i < f->channels; i++)
+	{
+		Slab* s = &f->slabs[i];
+		bool on = digitalRead(f->heaters[i].pin);
+		if (on != s->on)
+			s->switches++;
+		*switchedOn |= on && !s->on;
+		s->on = on;
+
+		double heat = on ? f->heaters[i].power : 0;
+		double toRoom = SLAB_TO_ROOM * (s->slab - s->room);
+		s->slab += dt * (heat - toRoom) / SLAB_CAPACITY;
+		s->room += dt * (toRoom - ROOM_LOSS * (s->room - outdoor)) / ROOM_CAPACITY;
+		s->sensor += dt * (s->slab - s->sensor) / SENSOR_LAG;
+		s->energy += heat * dt / 3600000.0;
+		power += heat;
+
+		if (s->inTransition &&
+			(s->heatingUp ? s->sensor >= s->transitionEnd : s->sensor <= s->transitionEnd))
+		{
+			double* result = s->heatingUp ? s->heatUp : s->coolDown;
+			result[0] = s->predicted;
+			result[1] = (t - s->transitionStart) / 3600.0;
+			s->inTransition = false;
+		}
+
+		if (s->sensor >= p->target)
+			s->reached = true;
+		if (s->reached)
+			s->overshoot = max(s->overshoot, s->sensor - p->target);
+		if (t >= WARM_UP)
+		{
+			s->squaredError += dt * (s->sensor - p->target) * (s->sensor - p->target);
+			s->errorTime += step;
+		}
+	}
+	return power;
+}
+
+// Node goes silent with heaters as they are, the one with most of them on
+void killNode(Firmware** nodes, uint8_t count)
+{
+	Firmware* victim = nodes[0];
+	uint8_t victimOn = 0;
+	for (uint8_t n = 0; n < count; n++)
+	{
+		uint8_t on = 0;
+		for (uint8_t i = 0; i < nodes[n]->channels; i++)
+			on += nodes[n]->slabs[i].on;
+		if (on > victimOn)
+		{
+			victim = nodes[n];
+			victimOn = on;
+		}
+	}
+
+	// Leaves the group, then never runs again
+	enter(victim);
+	WiFi.ip = IPAddress();
+	PowerBudget::update();
+	victim->alive = false;
+	fprintf(stderr, "Node %x killed with %d heaters on.\n", victim->chipId, victimOn);
+}
+
+int main(int argc, char** argv)
+{
+	Parameters p;
+	parseParameters(argc, argv, &p);
+	randomState = p.seed;
+	VirtualMulticast::get().loss = p.loss;
+	VirtualMulticast::get().randomState = p.seed;
+
+	Firmware* nodes[MAX_NODES];
+	for (uint8_t n = 0; n < p.nodes; n++)
+		nodes[n] = newNode(&p, n);
+
+	FILE* csv = p.csv ? fopen(p.csv, "w") : NULL;
+	if (csv)
+	{
+		fprintf(csv, "time,outdoor,base,total,estimated");
+		for (uint8_t i = 0; i < p.channels; i++)
+			fprintf(csv, ",sensor%d,room%d,on%d", i, i, i);
+		fprintf(csv, "\n");
+	}
+
+	unsigned long duration = p.hours * 3600000;
+	unsigned long killAt = p.kill * 3600000;
+	unsigned long msOverCap = 0;
+	unsigned long overCapSwitchOns = 0;	// heater switched on over the cap
+	double peakPower = 0;
+	double meter[MAX_LAG + 1];		// total of every second
+	unsigned long step = STEP;		// since the last one
+
+	for (unsigned long now = 0; now < duration; now += step)
+	{
+		VirtualClock::set(now);
+		unsigned long t = now / 1000;
+
+		// Physics
+		double outdoor = getOutdoorTemperature(t);
+		double base = getBaseLoad(t, step, p.steady);
+		double total = base;
+		bool switchedOn = false;
+		for (uint8_t n = 0; n < p.nodes; n++)
+			total += simulateNode(nodes[n], &p, t, step, outdoor, &switchedOn);
+
+		peakPower = max(peakPower, total);
+		if (total > MAX_ALLOWED_POWER)
+		{
+			msOverCap += step;
+			if (switchedOn)
+				overCapSwitchOns++;
+		}
+		meter[t % (MAX_LAG + 1)] = total;
+
+		if (killAt && now >= killAt)
+		{
+			killNode(nodes, p.nodes);
+			killAt = 0;
+		}
+
+		// Firmware
+		bool busy = false;
+		for (uint8_t n = 0; n < p.nodes; n++)
+		{
+			Firmware* f = nodes[n];
+			if (!f->alive)
+				continue;
+
+			enter(f);
+			float target = getTarget(&p, t);
+			if (target != f->target)
+				startTransitions(f, target, t);
+			f->target = target;
+			f->total = meter[(t >= p.lag ? t - p.lag : 0) % (MAX_LAG + 1)];
+			PowerBudget::update();
+			if (!f->started && now >= f->startAt)
+			{
+				f->timer.every(CHECK_HEATING_EVERY, controlHeating, f);
+				f->started = true;
+			}
+			f->timer.update();
+			busy |= PowerBudget::busy();
+		}
+		busy = p.nodes > 1 && (busy || VirtualMulticast::inFlight());
+		// Next step
+		step = busy ? BUSY_STEP : STEP - now % STEP;
+
+		if (csv && 0 == now % (SERIES_EVERY * 1000L))
+		{
+			Firmware* f = nodes[0];
+			fprintf(csv, "%lu,%.2f,%.0f,%.0f,%.0f", t, outdoor, base, total,
+				f->engine->getEnergyModel().getPower());
+			for (uint8_t i = 0; i < p.channels; i++)
+				fprintf(csv, ",%.3f,%.3f,%d", f->slabs[i].sensor, f->slabs[i].room, f->slabs[i].on);
+			fprintf(csv, "\n");
+		}
+	}
+	if (csv)
+		fclose(csv);
+
+	// Any part of a second over the cap counts as one
+	unsigned long secondsOverCap = (msOverCap + 999) / 1000;
+	unsigned long meterRequests = 0;
+	for (uint8_t n = 0; n < p.nodes; n++)
+		meterRequests += nodes[n]->meterRequests;
+
+	printf("{ \"Mode\" : \"%s\", \"Channels\" : %d, \"Hours\" : %.1f, ",
+		CONTROL_PID == p.mode ? "pid" : "onoff", p.channels, p.hours);
+	printf("\"MeterRequests\" : %lu, \"PeakPower\" : %.0f, \"SecondsOverCap\" : %lu, "
+		"\"OverCapSwitchOns\" : %lu,\n",
+		meterRequests, peakPower, secondsOverCap, overCapSwitchOns);
+	if (p.nodes > 1)
+	{
+		VirtualMulticast& bus = VirtualMulticast::get();
+		printf("  \"Nodes\" : %d, \"Loss\" : %.2f, \"Datagrams\" : %lu, \"Lost\" : %lu,\n",
+			p.nodes, p.loss, bus.sent, bus.lost);
+	}
+
+	printf("  \"PowerBudget\" : [\n");
+	for (uint8_t n = 0; n < p.nodes; n++)
+	{
+		PowerBudget::select(nodes[n]->budget);
+		printf("    %s%s\n", PowerBudget::getStatistics().c_str(), n + 1 < p.nodes ? "," : "");
+	}
+	printf("  ],\n");
+
+	uint8_t thermalMisses = 0;
+
+	printf("  \"Channel\" : [\n");
+	for (uint8_t n = 0; n < p.nodes; n++)
+	{
+		Firmware* f = nodes[n];
+		for (uint8_t i = 0; i < p.channels; i++)
+		{
+			Slab* s = &f->slabs[i];
+			ThermalParameters thermal = f->engine->getThermalModel(i).getParameters();
+			if (p.setback && (thermal.samples < THERMAL_MIN_SAMPLES ||
+				!s->heatUp[1] || fabs(s->heatUp[0] / s->heatUp[1] - 1) > THERMAL_TOLERANCE ||
+				!s->coolDown[1] || fabs(s->coolDown[0] / s->coolDown[1] - 1) > THERMAL_TOLERANCE))
+				thermalMisses++;
+			printf("    { \"Overshoot\" : %.2f, \"RMSError\" : %.2f, \"Switches\" : %lu, "
+				"\"Energy\" : %.2f, \"ModelEnergy\" : %.2f, "
+				"\"HeatingRate\" : %.2f, \"CoolingTime\" : %.2f, \"Ambient\" : %.2f, "
+				"\"ThermalSamples\" : %d", s->overshoot,
+				s->errorTime ? sqrt(s->squaredError * 1000 / s->errorTime) : 0.0,
+				s->switches, s->energy, f->engine->getEnergyModel().getEnergy(i),
+				thermal.heatingRate, thermal.coolingTime, thermal.ambient, thermal.samples);
+			if (p.setback)
+				printf(", \"HeatUp\" : [ %.2f, %.2f ], \"CoolDown\" : [ %.2f, %.2f ]",
+					s->heatUp[0], s->heatUp[1], s->coolDown[0], s->coolDown[1]);
+			printf(" }%s\n", n + 1 < p.nodes || i + 1 < p.channels ? "," : "");
+		}
+	}
+	printf("  ]\n}\n");
+
+	if (p.check && (secondsOverCap || overCapSwitchOns))
+	{
+		fprintf(stderr, "Power cap overshot: %lu s, %lu switch-ons.\n", secondsOverCap, overCapSwitchOns);
+		return 1;
+	}
+	if (p.check && thermalMisses)
+	{
+		fprintf(stderr, "Thermal model of %d channels mispredicts the setback.\n", thermalMisses);
+		return 1;
+	}
+	return 0;
+}
@@ -8,4 +8,7 @@ PUBLISH_DIR=~/Shden/shweb/firmware/ShWade/switch-2ch
 cp $BUILD_DIR/firmware.bin $PUBLISH_DIR/FW.bin
 cp $BUILD_DIR/spiffs.bin $PUBLISH_DIR/SPIFFS.bin
 cp $BUILD_DIR/../../data/version.info $PUBLISH_DIR/version.info
+# manifest goes last, when the images it's about are there
+../../shared/OTA/manifest.sh $BUILD_DIR/firmware.bin $BUILD_DIR/spiffs.bin $BUILD_DIR/../../data/version.info > $BUILD_DIR/manifest.json
+cp $BUILD_DIR/manifest.json $PUBLISH_DIR/manifest.json
 echo Done.
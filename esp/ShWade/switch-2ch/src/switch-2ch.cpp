@@ -25,12 +25,17 @@
 #include <ESP8266WiFi.h>
 #include <WiFiClient.h>
 #include <ESP8266WebServer.h>
+#include <HTTPPool.h>
+#include <JobQueue.h>
+#include <DeviceJobs.h>
 #include <ESP8266HTTPClient.h>
 #include <Timer.h>
 #include <OTA.h>
 #include <ConnectedESPConfiguration.h>
 #include <WiFiManager.h>
 #include <ESPTemplateProcessor.h>
+#include <SwitchGroups.h>
+#include <DeviceShadow.h>
 
 #define WEB_SERVER_PORT         80
 #define CHECK_SW_UPDATES_EVERY	(60000L*5)	// every 5 min
@@ -53,10 +58,13 @@ struct ControllerData
 	Timer*                  timer;
 } GD;
 
-// will have ssid, secret, initialised, MDNS host name.
+// will have ssid, secret, initialised, MDNS host name plus OTA URL, power
+// policy and group memberships.
 struct ConfigurationData : ConnectedESPConfiguration
 {
 	char			OTA_URL[OTA_URL_LEN + 1];
+	uint8_t			powerPolicy;
+	SwitchGroup		groups[SWITCH_GROUPS_MAX];
 } config;
 
 // Returns line state by number
@@ -96,6 +104,11 @@ void HandleHTTPGetStatus()
 		String("{ ") +
 			"\"LineA\" : " + String(getLine(LINE_A)) + ", " +
 			"\"LineB\" : " + String(getLine(LINE_B)) + ", " +
+			"\"Groups\" : " + SwitchGroups::getStatistics() + ", " +
+			"\"Shadow\" : " + DeviceShadow::getStatistics() + ", " +
+			"\"Jobs\" : " + JobQueue::getStatistics() + ", " +
+			"\"Timers\" : " + gd->timer->getStatistics() + ", " +
+			"\"WiFiConnectTime\" : " + String(WiFiManager::getConnectionTime()) + ", " +
 			"\"Build\" : " + String(FW_VERSION) +
 		" }\r\n";
 
@@ -144,6 +157,108 @@ void HandleLine(int lineNo)
 	}
 }
 
+// Group command sets @line to @state
+void onGroupCommand(uint8_t line, int state)
+{
+	if (LINE_A == line || LINE_B == line)
+		setLine(line, state);
+}
+
+// Desired state properties by line number, see DeviceShadow.h
+const char* const shadowProperties[] = { "LineA", "LineB" };
+
+float readForShadow(uint8_t property)
+{
+	return getLine(property);
+}
+
+bool writeForShadow(uint8_t property, float value)
+{
+	if (0 != value && 1 != value)
+		return false;
+	setLine(property, value);
+	return true;
+}
+
+// HTTP PUT /shadow, reconciles lines to desired state document in the body
+// and replies with the version applied and what is not as desired. HTTP
+// GET /shadow gives the reported state.
+// to test:
+//	$ curl -X PUT -d '{ "Version" : 1, "Desired" : { "LineA" : 1, "LineB" : 0 } }' 192.168.1.130/shadow
+void HandleHTTPShadow()
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	if (HTTPMethod::HTTP_GET == gd->switchServer->method())
+	{
+		gd->switchServer->send(200, APPLICATION_JSON, DeviceShadow::getReported() + "\r\n");
+		return;
+	}
+
+	// Line states are not in config, nothing to save
+	String reply;
+	bool changed;
+	int code = DeviceShadow::apply(gd->switchServer->arg("plain"), &reply, &changed);
+	gd->switchServer->send(code, APPLICATION_JSON, reply + "\r\n");
+}
+
+// HTTP PUT /Group, joins group @name with @lines (bit per line) and their
+// scene @states, empty name leaves the group in @slot
+// to test:
+//	$ curl -X PUT -d 'slot=0&name=all&lines=3&states=0' 192.168.1.130/Group
+void HandleHTTPGroup()
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	String slot = gd->switchServer->arg("slot");
+	String name = gd->switchServer->arg("name");
+	int lines = gd->switchServer->arg("lines").toInt();
+	int states = gd->switchServer->arg("states").toInt();
+
+	if (SwitchGroups::setGroup(slot.toInt(), name, lines, states))
+	{
+		saveConfiguration(&config, sizeof(ConfigurationData));
+		gd->switchServer->send(200, APPLICATION_JSON,
+			"Updated to: " + name + " in slot: " + slot + "\r\n");
+	}
+	else
+	{
+		gd->switchServer->send(401, TEXT_PLAIN,
+			"Wrong group: " + slot + " " + name + "\r\n");
+	}
+}
+
+// HTTP PUT /GroupCommand, multicasts ON, OFF or SCENE @command to group
+// @name members
+// to test:
+//	$ curl -X PUT -d 'name=all&command=off&ack=1' 192.168.1.130/GroupCommand
+void HandleHTTPGroupCommand()
+{
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	String name = gd->switchServer->arg("name");
+	String command = gd->switchServer->arg("command");
+	command.toUpperCase();
+	bool ack = gd->switchServer->arg("ack").toInt();
+
+	if (command != "ON" && command != "OFF" && command != "SCENE")
+	{
+		gd->switchServer->send(401, TEXT_PLAIN,
+			"Wrong command: " + command + "\r\n");
+		return;
+	}
+
+	uint32_t seq = SwitchGroups::send(name.c_str(), command.c_str(), ack);
+	if (seq)
+		gd->switchServer->send(200, APPLICATION_JSON,
+			"Sent: " + String(seq) + "\r\n");
+	else
+		gd->switchServer->send(503, TEXT_PLAIN, "Not connected.\r\n");
+}
+
 // Handles GET & POST Line A requests
 void HandleLineA()
 {
@@ -165,6 +280,9 @@ String mapConfigParameters(const String& key)
 	if (key == "IP") return WiFi.localIP().toString(); else
 	if (key == "BUILD") return String(FW_VERSION); else
 	if (key == "OTA_URL") return String(config.OTA_URL); else
+	if (key == "POWER_FULL") return config.powerPolicy == WiFiManager::POWER_FULL ? "selected" : ""; else
+	if (key == "POWER_BALANCED") return config.powerPolicy == WiFiManager::POWER_BALANCED ? "selected" : ""; else
+	if (key == "POWER_SAVING") return config.powerPolicy == WiFiManager::POWER_SAVING ? "selected" : ""; else
 	return "Mapping value undefined.";
 }
 
@@ -183,13 +301,9 @@ void HandleConfig()
 
 		saveConfiguration(&config, sizeof(ConfigurationData));
 
-		// redirect to the same page without arguments
-		gd->switchServer->sendHeader("Location", String("/config"), true);
-		gd->switchServer->send(302, TEXT_PLAIN, "");
-
-		// Try connecting with new credentials
-		WiFi.disconnect();
-		WiFiManager::handleWiFiConnectivity();
+		// Try connecting with new credentials once the reply is out
+		DeviceJobs::accept("reconnectWiFi", DeviceJobs::reconnectWiFi);
+		return;
 	}
 
 	// Reboot
@@ -203,6 +317,8 @@ void HandleConfig()
 	if (gd->switchServer->hasArg("GENERAL_UPDATE"))
 	{
 		gd->switchServer->arg("OTA_URL").toCharArray(config.OTA_URL, OTA_URL_LEN);
+		config.powerPolicy = gd->switchServer->arg("POWER_POLICY").toInt();
+		WiFiManager::setPowerPolicy(config.powerPolicy);
 		saveConfiguration(&config, sizeof(ConfigurationData));
 	}
 
@@ -210,7 +326,8 @@ void HandleConfig()
 	if (gd->switchServer->hasArg("CHECK_UPDATE_NOW"))
 	{
 		Serial.println("Checking software updates available.");
-		checkSoftwareUpdates();
+		DeviceJobs::acceptUpdateCheck(FW_VERSION, config.OTA_URL);
+		return;
 	}
 
 	ESPTemplateProcessor(*gd->switchServer).send(
@@ -259,15 +376,7 @@ void HandleControl()
 // Go check if there is a new firmware or SPIFFS got available.
 void checkSoftwareUpdates()
 {
-	int spiffsVersion = 0;
-	File versionInfo = SPIFFS.open("/version.info", "r");
-	if (versionInfo)
-	{
-		spiffsVersion = versionInfo.parseInt();
-		versionInfo.close();
-	}
-
-	updateAll(FW_VERSION, spiffsVersion, config.OTA_URL);
+	updateAll(FW_VERSION, getSPIFFSVersion(), config.OTA_URL);
 }
 
 void setup()
@@ -276,6 +385,15 @@ void setup()
 	Serial.println("Initialisation.");
 	Serial.printf("2-channel switch build %d.\n", FW_VERSION);
 
+	// Lines are back right after a warm reboot (OTA, crash), bit per line
+	uint32_t outputs = 0;
+	if (loadOutputState(&outputs))
+		Serial.printf("Lines state restored: %d\n", outputs);
+	pinMode(LINE_A_PIN, OUTPUT);
+	pinMode(LINE_B_PIN, OUTPUT);
+	setLine(LINE_A, outputs & (1 << LINE_A) ? HIGH : LOW);
+	setLine(LINE_B, outputs & (1 << LINE_B) ? HIGH : LOW);
+
 	Serial.println("Configuration loading.");
 	loadConfiguration(&config, sizeof(ConfigurationData));
 
@@ -289,6 +407,14 @@ void setup()
 	// care of WiFi anymore, all handled inside it
 	WiFiManager::init(&config);
 
+	// Uninitialised in EEPROM after upgrade
+	if (config.powerPolicy > WiFiManager::POWER_SAVING)
+		config.powerPolicy = WiFiManager::POWER_FULL;
+	WiFiManager::setPowerPolicy(config.powerPolicy);
+	// Boot id is random on every boot, members take the restarted sequence
+	SwitchGroups::init(config.groups, onGroupCommand, ESP.random());
+	DeviceShadow::init(shadowProperties, 2, readForShadow, writeForShadow);
+
 	if (SPIFFS.begin())
 		Serial.println("SPIFFS mount succesfull.");
 	else
@@ -299,6 +425,9 @@ void setup()
 	gd->switchServer->on("/control", HandleControl);
 	gd->switchServer->on("/LineA", HandleLineA);
 	gd->switchServer->on("/LineB", HandleLineB);
+	gd->switchServer->on("/Group", HTTPMethod::HTTP_PUT, HandleHTTPGroup);
+	gd->switchServer->on("/GroupCommand", HTTPMethod::HTTP_PUT, HandleHTTPGroupCommand);
+	gd->switchServer->on("/shadow", HandleHTTPShadow);
 
 	// captive pages
 	gd->switchServer->on("", HandleConfig);
@@ -309,21 +438,30 @@ void setup()
 		"/bootstrap/4.0.0/css/bootstrap.min.css", SPIFFS,
 		"/bootstrap.min.css");
 
+	DeviceJobs::init(gd->switchServer);
+	gd->switchServer->onNotFound(DeviceJobs::handleNotFound);
+
 	gd->switchServer->begin();
 	Serial.println("HTTP server started.");
 
 	// Set up regulars
-	gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates);
-
-	pinMode(LINE_A_PIN, OUTPUT);
-	pinMode(LINE_B_PIN, OUTPUT);
+	gd->timer->setName(gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates), "checkSoftwareUpdates");
+	setUpdateTimer(gd->timer);
 }
 
 void loop()
 {
 	ControllerData *gd = &GD;
 
+	saveOutputState(getLine(LINE_A) << LINE_A | getLine(LINE_B) << LINE_B);
 	gd->switchServer->handleClient();
 	gd->timer->update();
 	WiFiManager::update();
+	JobQueue::update();
+	HTTPPool::update();
+	SwitchGroups::update();
+
+	// Sleep until the next job as power policy allows, don't while
+	// waiting for outbound HTTP response or with queued jobs
+	WiFiManager::idle(HTTPPool::busy() || JobQueue::busy() ? millis() : gd->timer->nextDeadline());
 }
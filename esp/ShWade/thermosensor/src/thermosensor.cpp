@@ -11,6 +11,14 @@
 	- Post temperature update to configured upstream API endpoint.
 	- Built in configuration web UI at /config.
 	- WiFi access point to configure and troubleshoot.
+	- Optional deep sleep (battery) mode.
+
+	Deep sleep mode: after power on or reset the module stays awake for
+	CONFIG_WINDOW so that config UI is reachable, then goes to deep sleep.
+	Each wake up it samples DS1820, posts the reading (with any unsent ones
+	from the previous cycles) and sleeps again till the next period. If no
+	WiFi within DUTY_CYCLE_CONNECT_TIMEOUT, the reading is queued in RTC
+	memory. Requires GPIO16 wired to RST.
 
 	Toolchain: PlatformIO.
 
@@ -25,7 +33,9 @@
 #include <ESP8266WiFi.h>
 #include <WiFiClient.h>
 #include <ESP8266WebServer.h>
-#include <ESP8266HTTPClient.h>
+#include <HTTPPool.h>
+#include <JobQueue.h>
+#include <DeviceJobs.h>
 #include <ESP8266mDNS.h>
 #include <Timer.h>
 #include <DS1820.h>
@@ -34,6 +44,10 @@
 #include <WiFiManager.h>
 #include <ESPTemplateProcessor.h>
 
+extern "C" {
+#include <user_interface.h>
+}
+
 #define WEB_SERVER_PORT         80
 #define CHECK_SW_UPDATES_EVERY	(5 * 60 * 1000L)	// every 5 min
 #define DEFAULT_POST_TEMP_EVERY	(60 * 1000L)		// default: every minute
@@ -41,12 +55,27 @@
 #define ENDPOINT_URL_LENGTH	80
 #define OTA_URL_LEN		80
 #define ONE_WIRE_ADDR_LEN	16
+#define CONFIG_WINDOW		(3 * 60 * 1000L)	// awake after reset in deep sleep mode
+#define DUTY_CYCLE_CONNECT_TIMEOUT	(10 * 1000L)	// give up WiFi and queue the sample
+#define MAX_QUEUED_SAMPLES	16
+#define MIN_DEEP_SLEEP		1000L			// ms, deepSleep(0) never wakes up
 
 #define TEXT_HTML		"text/html"
 #define TEXT_PLAIN		"text/plain"
 #define APPLICATION_JSON	"application/json"
 
 void checkSoftwareUpdates();
+void sleepTillNextCycle();
+
+// Deep sleep mode state, kept in RTC memory between cycles.
+struct DutyCycleState
+{
+	uint32_t		sequence;			// cycle counter
+	uint32_t		lastAwakeTime;			// previous cycle awake time, ms
+	uint16_t		queued;				// unsent samples count
+	uint16_t		reserved;
+	int16_t			samples[MAX_QUEUED_SAMPLES];	// unsent samples, 1/100 degree
+};
 
 struct ControllerData
 {
@@ -54,20 +83,35 @@ struct ControllerData
 	char			sensorAddress[ONE_WIRE_ADDR_LEN + 1];
 	ESP8266WebServer*       thermosensorServer;
 	Timer*                  timer;
+	DutyCycleState		dutyCycle;
+	uint8_t			dutyCycleWake;		// woken up from deep sleep
+	uint8_t			samplesPosting;		// queued samples post is in flight
 } GD;
 
 /* Will have ssid, secret, initialised, MDNSHost plus:
  *	- API endpoit to post temperature updates,
  *	- Period of temperature updates posting (in seconds),
- *	- OTA URL.
+ *	- OTA URL,
+ *	- power policy,
+ *	- deep sleep mode flag.
  */
 struct ConfigurationData : ConnectedESPConfiguration
 {
 	char			postDataAPIEndpoint[ENDPOINT_URL_LENGTH + 1];
 	uint16_t		postTemperatureEvery;
 	char			OTA_URL[OTA_URL_LEN + 1];
+	uint8_t			powerPolicy;
+	uint8_t			deepSleep;
 } config;
 
+// Temperature posting period, ms
+unsigned long getPostTemperatureEvery()
+{
+	return (config.postTemperatureEvery)
+		? 1000L * config.postTemperatureEvery
+		: DEFAULT_POST_TEMP_EVERY;
+}
+
 // Go to sensor and get current temperature.
 float getTemperature()
 {
@@ -103,11 +147,114 @@ void postTemperatureUpdate()
 		Serial.print("JSON payload: ");
 		Serial.println(jsonPayload);
 
-		HTTPClient httpClient;
-		httpClient.begin(config.postDataAPIEndpoint);
-		int httpCode = httpClient.POST(jsonPayload);
-		Serial.printf("Responce code: %d\n", httpCode);
-		httpClient.end();
+		HTTPPool::POST(config.postDataAPIEndpoint, jsonPayload);
+	}
+}
+
+// Keep sample in RTC queue, drop the oldest one if full.
+void queueSample(float temp)
+{
+	// Warning: uses global data.
+	DutyCycleState *dc = &GD.dutyCycle;
+
+	if (dc->queued == MAX_QUEUED_SAMPLES)
+	{
+		memmove(&dc->samples[0], &dc->samples[1],
+			(MAX_QUEUED_SAMPLES - 1) * sizeof(dc->samples[0]));
+		dc->queued--;
+	}
+	dc->samples[dc->queued++] = (int16_t)(temp * 100);
+}
+
+// Queued samples post is done, go to sleep. Samples are kept for the next
+// cycle if it failed.
+void onSamplesPosted(int httpCode, const String& response, void* context)
+{
+	if (httpCode >= 200 && httpCode < 300)
+		GD.dutyCycle.queued = 0;
+	sleepTillNextCycle();
+}
+
+// Post all queued samples, oldest first. Each has "age" in seconds as it
+// could be taken several cycles ago. onSamplesPosted() is called when done.
+void postQueuedSamples()
+{
+	// Warning: uses global data.
+	ControllerData *gd = &GD;
+	DutyCycleState *dc = &gd->dutyCycle;
+
+	if (!strlen(config.postDataAPIEndpoint))
+	{
+		onSamplesPosted(200, String(), NULL);
+		return;
+	}
+
+	String jsonPayload = String("[");
+	for (uint16_t i = 0; i < dc->queued; i++)
+	{
+		unsigned long age = (dc->queued - 1 - i) * getPostTemperatureEvery() / 1000;
+		jsonPayload +=
+			String("{ \"sensorId\" : \"") +
+			String(gd->sensorAddress) +
+			String("\", \"temperature\" : ") +
+			String(dc->samples[i] / 100.0, 2) +
+			String(", \"sequence\" : ") +
+			String(dc->sequence - (dc->queued - 1 - i)) +
+			String(", \"age\" : ") +
+			String(age) +
+			String(" }");
+		if (i < dc->queued - 1)
+			jsonPayload += String(", ");
+	}
+	jsonPayload += String("]");
+	Serial.print("JSON payload: ");
+	Serial.println(jsonPayload);
+
+	if (!HTTPPool::POST(config.postDataAPIEndpoint, jsonPayload, onSamplesPosted))
+		sleepTillNextCycle();
+}
+
+// Save state to RTC memory and deep sleep till the next cycle.
+void sleepTillNextCycle()
+{
+	// Warning: uses global data.
+	DutyCycleState *dc = &GD.dutyCycle;
+
+	dc->lastAwakeTime = millis();
+	saveRTCData(RTC_DUTY_CYCLE_OFFSET, dc, sizeof(DutyCycleState));
+
+	// Till the next period boundary, awake time can be longer than the
+	// period after the config window
+	unsigned long period = getPostTemperatureEvery();
+	unsigned long sleepTime = period - dc->lastAwakeTime % period;
+	if (sleepTime < MIN_DEEP_SLEEP)
+		sleepTime += period;
+	sleepTime = max(sleepTime, (unsigned long)MIN_DEEP_SLEEP);
+
+	Serial.printf("Cycle %u awake for %u ms, sleeping %lu ms.\n",
+		dc->sequence, dc->lastAwakeTime, sleepTime);
+	ESP.deepSleep(sleepTime * 1000);
+}
+
+// One deep sleep cycle step, called from loop() after deep sleep wake up
+// until we go to sleep again.
+void dutyCycle()
+{
+	// Warning: uses global data.
+	ControllerData *gd = &GD;
+
+	if (gd->samplesPosting)
+		return;
+
+	if (WL_CONNECTED == WiFi.status())
+	{
+		gd->samplesPosting = 1;
+		postQueuedSamples();
+	}
+	else if (millis() > DUTY_CYCLE_CONNECT_TIMEOUT)
+	{
+		Serial.println("No WiFi, sample is queued.");
+		sleepTillNextCycle();
 	}
 }
 
@@ -120,6 +267,12 @@ void HandleHTTPGetStatus()
 	String json =
 	String("{ ") +
 		"\"CurrentTemperature\" : " + String(getTemperature(), 2) + ", " +
+		"\"DeepSleep\" : " + String(config.deepSleep) + ", " +
+		"\"CycleAwakeTime\" : " + String(gd->dutyCycle.lastAwakeTime) + ", " +
+		"\"QueuedSamples\" : " + String(gd->dutyCycle.queued) + ", " +
+		"\"OutboundHTTP\" : " + HTTPPool::getStatistics() + ", " +
+		"\"Jobs\" : " + JobQueue::getStatistics() + ", " +
+		"\"WiFiConnectTime\" : " + String(WiFiManager::getConnectionTime()) + ", " +
 		"\"Build\" : " + String(FW_VERSION) +
 	" }\r\n";
 
@@ -140,7 +293,11 @@ String mapConfigParameters(const String& key)
 	if (key == "DS1820ID") return String(gd->sensorAddress); else
 	if (key == "API") return String(config.postDataAPIEndpoint); else
 	if (key == "POST_TEMP_EVERY") return String(config.postTemperatureEvery); else
+	if (key == "DEEP_SLEEP_CHECKED") return config.deepSleep ? "checked" : ""; else
 	if (key == "OTA_URL") return String(config.OTA_URL); else
+	if (key == "POWER_FULL") return config.powerPolicy == WiFiManager::POWER_FULL ? "selected" : ""; else
+	if (key == "POWER_BALANCED") return config.powerPolicy == WiFiManager::POWER_BALANCED ? "selected" : ""; else
+	if (key == "POWER_SAVING") return config.powerPolicy == WiFiManager::POWER_SAVING ? "selected" : ""; else
 	return "Mapping value undefined.";
 }
 
@@ -161,13 +318,9 @@ void HandleConfig()
 
 		saveConfiguration(&config, sizeof(ConfigurationData));
 
-		// redirect to the same page without arguments
-		gd->thermosensorServer->sendHeader("Location", String("/config"), true);
-		gd->thermosensorServer->send(302, TEXT_PLAIN, "");
-
-		// Try connecting with new credentials
-		WiFi.disconnect();
-		WiFiManager::handleWiFiConnectivity();
+		// Try connecting with new credentials once the reply is out
+		DeviceJobs::accept("reconnectWiFi", DeviceJobs::reconnectWiFi);
+		return;
 	}
 
 	// Reboot
@@ -186,6 +339,9 @@ void HandleConfig()
 			gd->thermosensorServer->arg("POST_TEMP_EVERY").toInt();
 		gd->thermosensorServer->arg("OTA_URL").toCharArray(
 			config.OTA_URL, OTA_URL_LEN);
+		config.deepSleep = gd->thermosensorServer->hasArg("DEEP_SLEEP");
+		config.powerPolicy = gd->thermosensorServer->arg("POWER_POLICY").toInt();
+		WiFiManager::setPowerPolicy(config.powerPolicy);
 		saveConfiguration(&config, sizeof(ConfigurationData));
 	}
 
@@ -193,7 +349,8 @@ void HandleConfig()
 	if (gd->thermosensorServer->hasArg("CHECK_UPDATE_NOW"))
 	{
 		Serial.println("Checking software updates available.");
-		checkSoftwareUpdates();
+		DeviceJobs::acceptUpdateCheck(FW_VERSION, config.OTA_URL);
+		return;
 	}
 
 	ESPTemplateProcessor(*gd->thermosensorServer).send(
@@ -204,15 +361,7 @@ void HandleConfig()
 // Go check if there is a new firmware or SPIFFS got available.
 void checkSoftwareUpdates()
 {
-	int spiffsVersion = 0;
-	File versionInfo = SPIFFS.open("/version.info", "r");
-	if (versionInfo)
-	{
-		spiffsVersion = versionInfo.parseInt();
-		versionInfo.close();
-	}
-
-	updateAll(FW_VERSION, spiffsVersion, config.OTA_URL);
+	updateAll(FW_VERSION, getSPIFFSVersion(), config.OTA_URL);
 }
 
 void setup()
@@ -225,11 +374,24 @@ void setup()
 	Serial.println("Initialisation.");
 	Serial.printf("ShWade temperature sensor build %d.\n", FW_VERSION);
 
+	// Warning: uses global data
+	ControllerData *gd = &GD;
+
+	// Don't wait for configuration key press each deep sleep cycle
+	int resetReason = ESP.getResetInfoPtr()->reason;
+	if (REASON_DEEP_SLEEP_AWAKE == resetReason)
+		Serial.setTimeout(10);
+
 	Serial.println("Configuration loading.");
 	loadConfiguration(&config, sizeof(ConfigurationData));
 
-	// Warning: uses global data
-	ControllerData *gd = &GD;
+	// Uninitialised in EEPROM after upgrade
+	if (config.deepSleep > 1)
+		config.deepSleep = 0;
+
+	gd->dutyCycleWake = config.deepSleep && REASON_DEEP_SLEEP_AWAKE == resetReason;
+	if (!loadRTCData(RTC_DUTY_CYCLE_OFFSET, &gd->dutyCycle, sizeof(DutyCycleState)))
+		memset(&gd->dutyCycle, 0, sizeof(DutyCycleState));
 
 	// Initialise DS1820 temperature sensor
 	gd->temperatureSensor = new TemperatureSensor(ONE_WIRE_PIN);
@@ -241,6 +403,19 @@ void setup()
 	// Initialise WiFi entity that will handle connectivity.
 	WiFiManager::init(&config);
 
+	// Deep sleep cycle: sample now, the rest is done by dutyCycle()
+	if (gd->dutyCycleWake)
+	{
+		gd->dutyCycle.sequence++;
+		queueSample(getTemperature());
+		return;
+	}
+
+	// Uninitialised in EEPROM after upgrade
+	if (config.powerPolicy > WiFiManager::POWER_SAVING)
+		config.powerPolicy = WiFiManager::POWER_FULL;
+	WiFiManager::setPowerPolicy(config.powerPolicy);
+
 	gd->thermosensorServer = new ESP8266WebServer(WEB_SERVER_PORT);
 	gd->timer = new Timer();
 
@@ -260,22 +435,41 @@ void setup()
 	gd->thermosensorServer->serveStatic(
 		"/bootstrap.min.css", SPIFFS, "/bootstrap.min.css");
 
+	DeviceJobs::init(gd->thermosensorServer);
+	gd->thermosensorServer->onNotFound(DeviceJobs::handleNotFound);
+
 	gd->thermosensorServer->begin();
 	Serial.println("HTTP server started.");
 
 	// Set up regulars
-	long postTemperatureEvery = (config.postTemperatureEvery)
-		? 1000L * config.postTemperatureEvery
-		: DEFAULT_POST_TEMP_EVERY;
-	gd->timer->every(postTemperatureEvery, postTemperatureUpdate);
+	gd->timer->every(getPostTemperatureEvery(), postTemperatureUpdate);
 	gd->timer->every(CHECK_SW_UPDATES_EVERY, checkSoftwareUpdates);
+	setUpdateTimer(gd->timer);
+
+	// Config window, then deep sleep cycles
+	if (config.deepSleep)
+		gd->timer->after(CONFIG_WINDOW, sleepTillNextCycle);
 }
 
 void loop()
 {
 	ControllerData *gd = &GD;
 
+	if (gd->dutyCycleWake)
+	{
+		WiFiManager::update();
+		HTTPPool::update();
+		dutyCycle();
+		return;
+	}
+
 	gd->thermosensorServer->handleClient();
 	gd->timer->update();
 	WiFiManager::update();
+	JobQueue::update();
+	HTTPPool::update();
+
+	// Sleep until the next job as power policy allows, don't while
+	// waiting for outbound HTTP response or with queued jobs
+	WiFiManager::idle(HTTPPool::busy() || JobQueue::busy() ? millis() : gd->timer->nextDeadline());
 }
@@ -1,104 +1,242 @@
 /*
 	ESP OTA update.
 	based on https://www.bakke.online/index.php/2017/06/02/self-updating-ota-firmware-for-esp8266/
+
+How it works:
+
+Repository has FW.bin and SPIFFS.bin images and manifest.json with version
+and MD5 of both, made by buildpublish.sh:
+
+	{ "Firmware" : { "Version" : 12, "MD5" : "..." },
+	  "SPIFFS" : { "Version" : 12, "MD5" : "..." } }
+
+updateAll() fetches the manifest once per check via HTTPPool with
+If-None-Match of the manifest seen last, so while nothing is published the
+check costs a 304 with no body. ETag is only kept once there is nothing to
+install in the manifest, a failed install gets the whole manifest again.
+An image is flashed only if its MD5 matches the manifest.
+
+Devices that power up together would check together every cycle, so the
+check waits a delay of its own first, taken from the chip id. After a
+failed check the next 1, 3, 7, 15 cycles are skipped, up to OTA_MAX_BACKOFF,
+a good one brings it back to every cycle. The callback given to updateAll()
+gets the result once the check is over, so a job can report it.
 */
 
 #include <Arduino.h>
 #include <OTA.h>
+#include <WiFiClient.h>
 #include <ESP8266HTTPClient.h>
-#include <ESP8266httpUpdate.h>
+#include <Updater.h>
+#include <FS.h>
+#include <HTTPPool.h>
+#include <JSONPathFilter.h>
+#include <Task.h>
+
+#define OTA_MANIFEST		"manifest.json"
+#define OTA_JITTER		60000UL		// ms, check delays spread over devices
+#define OTA_MAX_BACKOFF		16		// cycles skipped at most after failures
 
-// Checks updates repository for the version available
-int getAvailableVersion(int currentVersion, const char* repositoryBaseUrl)
+#ifndef U_FS
+#define U_FS			U_SPIFFS	// cores before 2.6
+#endif
+
+// State of the updateAll() check, task locals don't live across waits
+struct UpdateCheck
 {
-	int newVersion = currentVersion;
+	int		firmwareVersion;
+	int		spiffsVersion;
+	String		repositoryBaseUrl;
+	unsigned long	jitter;			// ms, this device waits before the check
+	int		httpCode;		// manifest response
+	String		body;
+	String		responseETag;
+	String		etag;			// manifest with nothing to install
+	uint8_t		failures;		// checks failed in a row
+	uint8_t		skip;			// cycles left to skip
+	UpdateCallback	callback;		// of the check going on
+	void*		context;
+} check;
 
-	String versionInfoURL = String(repositoryBaseUrl);
-	versionInfoURL.concat("version.info");
+void updateCheck(Task* task);
+Task updateTask(updateCheck, &check);
 
-	Serial.print("version.info URL: ");
-	Serial.println(versionInfoURL);
+// True if @md5 is 32 hex digits
+bool isMD5(const String& md5)
+{
+	if (md5.length() != 32)
+		return false;
+	for (uint8_t i = 0; i < 32; i++)
+		if (!isxdigit(md5.charAt(i)))
+			return false;
+	return true;
+}
 
-	HTTPClient httpClient;
-	httpClient.begin(versionInfoURL);
-	int httpCode = httpClient.GET();
-	if (200 == httpCode)
+// Downloads image @url and flashes it by Updater @command, checked against
+// @md5. Restarts when done, returns only if it failed or was refused, the
+// caller backs off then.
+void installImage(const String& url, int command, const String& md5)
+{
+	// Updater skips the check without MD5, so no MD5 no install
+	if (!isMD5(md5))
 	{
-		String newFWVersion = httpClient.getString();
+		Serial.println("Image MD5 in the manifest is missing or malformed, not installed.");
+		return;
+	}
 
-		Serial.print("Current version: ");
-		Serial.println(currentVersion);
-		Serial.print("Available version: ");
-		Serial.println(newFWVersion);
+	Serial.print("Updating using image from the URL: ");
+	Serial.println(url);
 
-		newVersion = newFWVersion.toInt();
+	WiFiClient client;
+	HTTPClient httpClient;
+	httpClient.begin(client, url);
+	int httpCode = httpClient.GET();
+	int size = httpClient.getSize();
 
-		if (newVersion > currentVersion)
-			Serial.println("New version available.");
-		else
-			Serial.println("Already on latest version.");
+	bool installed = false;
+	if (200 != httpCode || size <= 0)
+	{
+		Serial.printf("Image download failed, HTTP code: %d, size: %d\n", httpCode, size);
+	}
+	else if (!Update.begin(size, command))
+	{
+		Update.printError(Serial);
+	}
+	else if (!Update.setMD5(md5.c_str()))
+	{
+		// begin() clears MD5, so it is set after, nothing is written yet
+		Serial.println("Image MD5 refused by Updater, not installed.");
+		Update.end();
 	}
 	else
 	{
-		Serial.print("Version check failed, got HTTP response code: ");
-		Serial.println( httpCode );
+		// end() checks MD5, nothing is flashed if it doesn't match
+		size_t written = Update.writeStream(*httpClient.getStreamPtr());
+		installed = Update.end() && written == (size_t)size;
+		if (!installed)
+			Update.printError(Serial);
 	}
 	httpClient.end();
-	return newVersion;
+
+	if (installed)
+		ESP.restart();
 }
 
-void handeUpdateResult(t_httpUpdate_return updateReturnCode)
+// Value at @path in the manifest, empty if there is none
+String getManifestValue(const String& json, const char* path)
 {
-	switch(updateReturnCode)
-	{
-		case HTTP_UPDATE_FAILED:
-			Serial.printf("HTTP_UPDATE_FAILD Error (%d): %s",
-				ESPhttpUpdate.getLastError(),
-				ESPhttpUpdate.getLastErrorString().c_str());
-			break;
-
-		case HTTP_UPDATE_NO_UPDATES:
-			Serial.println("HTTP_UPDATE_NO_UPDATES");
-			break;
-
-		default:
-			break;
-	}
+	JSONPathFilter filter(path);
+	const char* c = json.c_str();
+	while (*c && !filter.feed(*c))
+		c++;
+	return filter.found() ? String(filter.value()) : String();
 }
 
-void updateFirmware(int currentVersion, const char* repositoryBaseUrl)
+// Skip more cycles after each failure in a row
+void backOff(UpdateCheck* c)
 {
-	Serial.println("Firmware update check.");
-	if (currentVersion < getAvailableVersion(currentVersion, repositoryBaseUrl))
-	{
-		// New firmware URL
-		String newFirmwareURL = repositoryBaseUrl;
-		newFirmwareURL.concat("FW.bin");
-		Serial.print("Updating firmware using image from the URL: ");
-		Serial.println(newFirmwareURL);
+	if (c->failures < 5)
+		c->failures++;
+	c->skip = min((1 << c->failures) - 1, OTA_MAX_BACKOFF);
+	Serial.printf("Update check failed, %d cycles skipped.\n", c->skip);
+}
 
-		handeUpdateResult(ESPhttpUpdate.update(newFirmwareURL));
-		ESP.restart();
-	}
+// Check is over with @ok result, the task exits right after
+void finishCheck(UpdateCheck* c, bool ok)
+{
+	UpdateCallback callback = c->callback;
+	c->callback = NULL;
+	if (callback)
+		callback(ok, c->context);
+}
+
+// Manifest has come, updateCheck() goes on
+void onManifest(int httpCode, const String& body, void* context)
+{
+	check.httpCode = httpCode;
+	check.body = body;
+	check.responseETag = HTTPPool::getETag();
+	((Task*)context)->resume();
 }
 
-void updateSpiffs(int currentVersion, const char* repositoryBaseUrl)
+// updateAll() task body: fetch the manifest, then install what is behind.
+void updateCheck(Task* task)
 {
-	Serial.println("SPIFFS update check.");
-	if (currentVersion < getAvailableVersion(currentVersion, repositoryBaseUrl))
+	UpdateCheck* c = (UpdateCheck*)task->context;
+
+	TASK_BEGIN(task);
+
+	if (c->jitter)
+		TASK_WAIT(task, c->jitter);
+
+	if (!HTTPPool::GET(c->repositoryBaseUrl + OTA_MANIFEST, c->etag, onManifest, task))
 	{
-		// New SPIFFS URL
-		String newSpiffsURL = repositoryBaseUrl;
-		newSpiffsURL.concat("SPIFFS.bin");
-		Serial.print("Updating SPIFFS using image from the URL: ");
-		Serial.println(newSpiffsURL);
+		backOff(c);
+		finishCheck(c, false);
+		TASK_EXIT(task);
+	}
+	TASK_SUSPEND(task);
 
-		handeUpdateResult(ESPhttpUpdate.updateSpiffs(newSpiffsURL));
-		ESP.restart();
+	if (304 == c->httpCode)
+	{
+		Serial.println("Manifest not modified.");
+		c->failures = 0;
+		finishCheck(c, true);
+		TASK_EXIT(task);
 	}
+
+	{
+		int firmwareVersion = getManifestValue(c->body, "Firmware.Version").toInt();
+		int spiffsVersion = getManifestValue(c->body, "SPIFFS.Version").toInt();
+		if (200 != c->httpCode || !firmwareVersion || !spiffsVersion)
+		{
+			Serial.printf("Manifest check failed, got HTTP response code: %d\n", c->httpCode);
+			backOff(c);
+			finishCheck(c, false);
+			TASK_EXIT(task);
+		}
+
+		Serial.printf("Available firmware: %d, SPIFFS: %d, installed firmware: %d, SPIFFS: %d\n",
+			firmwareVersion, spiffsVersion, c->firmwareVersion, c->spiffsVersion);
+
+		// SPIFFS first, firmware goes next cycle after reboot
+		if (c->spiffsVersion < spiffsVersion)
+		{
+			installImage(c->repositoryBaseUrl + "SPIFFS.bin", U_FS,
+				getManifestValue(c->body, "SPIFFS.MD5"));
+			backOff(c);
+			c->body = String();
+			finishCheck(c, false);
+		}
+		else if (c->firmwareVersion < firmwareVersion)
+		{
+			installImage(c->repositoryBaseUrl + "FW.bin", U_FLASH,
+				getManifestValue(c->body, "Firmware.MD5"));
+			backOff(c);
+			c->body = String();
+			finishCheck(c, false);
+		}
+		else
+		{
+			Serial.println("Already on latest version.");
+			c->etag = c->responseETag;
+			c->failures = 0;
+			c->body = String();
+			finishCheck(c, true);
+		}
+	}
+
+	TASK_END(task);
 }
 
-// Go check if there is a new firmware or SPIFFS got available.
+void setUpdateTimer(TimerBase* timer)
+{
+	updateTask.setTimer(timer);
+	check.jitter = ESP.getChipId() % OTA_JITTER;
+}
+
+// Go check if there is a new firmware or SPIFFS got available. Called every
+// cycle, skips the cycles backing off.
 //
 // Note: ESP doesnt seem to handle one stop update of FW + SPIFFS, at least
 // it didn't work for me. I assume the update process includes upload of the
@@ -106,8 +244,57 @@ void updateSpiffs(int currentVersion, const char* repositoryBaseUrl)
 // SPIFFS. This effectively means that updating of both FW and SPIFFS would
 // take 2 cycles including rebooting. Thus 2 independent versions should be
 // supported, one for FW and one for SPIFFS.
-void updateAll(int firmwareVersion, int spiffsVersion, const char* repositoryBaseUrl)
+//
+// The check is updateTask, so it doesn't block loop(). Only the image
+// download does when there is an update. A check still going on is not
+// started again, @callback gets its result if it has none yet.
+void updateAll(int firmwareVersion, int spiffsVersion, const char* repositoryBaseUrl,
+	UpdateCallback callback, void* context)
+{
+	if (updateTask.running())
+	{
+		Serial.println("Update check is in progress.");
+		if (!check.callback)
+		{
+			check.callback = callback;
+			check.context = context;
+		}
+		else if (callback)
+		{
+			callback(false, context);
+		}
+		return;
+	}
+
+	if (check.skip)
+	{
+		check.skip--;
+		if (callback)
+			callback(false, context);
+		return;
+	}
+
+	// Other repository, the manifest seen is not about it
+	if (check.repositoryBaseUrl != repositoryBaseUrl)
+		check.etag = String();
+
+	check.firmwareVersion = firmwareVersion;
+	check.spiffsVersion = spiffsVersion;
+	check.repositoryBaseUrl = repositoryBaseUrl;
+	finishCheck(&check, false);		// left by a check that couldn't wait
+	check.callback = callback;
+	check.context = context;
+	updateTask.start();
+}
+
+int getSPIFFSVersion()
 {
-	updateSpiffs(spiffsVersion, repositoryBaseUrl);
-	updateFirmware(firmwareVersion, repositoryBaseUrl);
+	int spiffsVersion = 0;
+	File versionInfo = SPIFFS.open("/version.info", "r");
+	if (versionInfo)
+	{
+		spiffsVersion = versionInfo.parseInt();
+		versionInfo.close();
+	}
+	return spiffsVersion;
 }
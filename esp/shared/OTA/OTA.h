@@ -1,8 +1,21 @@
 #ifndef OTA_H
 #define OTA_H
 
-void updateAll(int firmwareVersion, int spiffsVersion, const char* repositoryBaseUrl);
-void updateFirmware(int currentVersion, const char* repositoryBaseUrl);
-void updateSpiffs(int currentVersion, const char* repositoryBaseUrl);
+#include <stddef.h>
+
+class TimerBase;
+
+// Update check is over, @ok is false if it has failed or was skipped. Not
+// called when an image is installed, the device restarts then.
+typedef void (*UpdateCallback)(bool ok, void* context);
+
+void updateAll(int firmwareVersion, int spiffsVersion, const char* repositoryBaseUrl,
+	UpdateCallback callback = NULL, void* context = NULL);
+
+// Version of the SPIFFS image installed, from its /version.info, 0 if none.
+int getSPIFFSVersion();
+
+// Timer the update check waits on, checks start without jitter till it's set.
+void setUpdateTimer(TimerBase* timer);
 
 #endif
@@ -0,0 +1,12 @@
+#!/bin/bash
+# OTA manifest of the images published, see OTA.cpp
+# usage: manifest.sh <firmware.bin> <spiffs.bin> <version.info> > manifest.json
+
+md5of() {
+	md5 -q "$1" 2>/dev/null || md5sum "$1" | cut -d ' ' -f 1
+}
+
+VERSION=$(cat "$3")
+
+echo "{ \"Firmware\" : { \"Version\" : $VERSION, \"MD5\" : \"$(md5of "$1")\" },"
+echo "  \"SPIFFS\" : { \"Version\" : $VERSION, \"MD5\" : \"$(md5of "$2")\" } }"
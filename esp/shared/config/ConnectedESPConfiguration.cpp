@@ -1,6 +1,7 @@
 #include <ConnectedESPConfiguration.h>
 #include <Arduino.h>
 #include <EEPROM.h>
+#include <user_interface.h>
 
 // Get character sting from terminal.
 int readString(char* buff, size_t buffSize)
@@ -109,3 +110,91 @@ void saveConfiguration(ConnectedESPConfiguration* configuration, size_t configSi
 {
 	storeStruct(configuration, configSize);
 }
+
+uint32_t crc32(const uint8_t* data, size_t size)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	while (size--)
+	{
+		crc ^= *data++;
+		for (uint8_t bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & (-(crc & 1)));
+	}
+	return ~crc;
+}
+
+// Read RTC record at offset, true if CRC matches.
+bool loadRTCData(uint32_t offset, void* data, size_t size)
+{
+	uint32_t crc;
+	if (!ESP.rtcUserMemoryRead(offset, &crc, sizeof(crc)) ||
+		!ESP.rtcUserMemoryRead(offset + 1, (uint32_t*)data, size))
+		return false;
+
+	return crc == crc32((uint8_t*)data, size);
+}
+
+// Write RTC record with CRC at offset.
+void saveRTCData(uint32_t offset, void* data, size_t size)
+{
+	uint32_t crc = crc32((uint8_t*)data, size);
+	ESP.rtcUserMemoryWrite(offset + 1, (uint32_t*)data, size);
+	ESP.rtcUserMemoryWrite(offset, &crc, sizeof(crc));
+}
+
+// Invalidate RTC record at offset.
+void clearRTCData(uint32_t offset)
+{
+	uint32_t crc = 0;
+	ESP.rtcUserMemoryWrite(offset, &crc, sizeof(crc));
+}
+
+// Outputs state record, time is RTC clock ticks which keep counting over
+// a warm reboot, unlike millis().
+struct OutputState
+{
+	uint32_t	outputs;
+	uint32_t	savedAt;
+};
+
+void saveOutputState(uint32_t outputs)
+{
+	static bool saved = false;
+	static uint32_t lastOutputs;
+	static unsigned long lastSaved;
+
+	unsigned long now = millis();
+	if (saved && outputs == lastOutputs && now - lastSaved < OUTPUT_STATE_REFRESH)
+		return;
+
+	OutputState state = { outputs, system_get_rtc_time() };
+	saveRTCData(RTC_OUTPUT_STATE_OFFSET, &state, sizeof(state));
+	saved = true;
+	lastOutputs = outputs;
+	lastSaved = now;
+}
+
+bool loadOutputState(uint32_t* outputs, uint32_t maxAge)
+{
+	// Power on and reset button clear outputs as always
+	uint32_t reason = ESP.getResetInfoPtr()->reason;
+	if (REASON_SOFT_RESTART != reason && REASON_EXCEPTION_RST != reason &&
+		REASON_SOFT_WDT_RST != reason && REASON_WDT_RST != reason)
+		return false;
+
+	OutputState state;
+	if (!loadRTCData(RTC_OUTPUT_STATE_OFFSET, &state, sizeof(state)))
+		return false;
+
+	// Calibration is microseconds per tick, fixed point with 12 bits fraction
+	uint64_t age = ((uint64_t)(system_get_rtc_time() - state.savedAt) *
+		system_rtc_clock_cali_proc()) >> 12;
+	if (age / 1000 > maxAge)
+	{
+		Serial.printf("Outputs state is stale (%d ms), not restored.\n", (int)(age / 1000));
+		return false;
+	}
+
+	*outputs = state.outputs;
+	return true;
+}
@@ -20,4 +20,29 @@ struct ConnectedESPConfiguration
 void loadConfiguration(ConnectedESPConfiguration*, size_t);
 void saveConfiguration(ConnectedESPConfiguration*, size_t);
 
+// RTC user memory layout, offsets are in 4 byte blocks (128 blocks total).
+// Each record takes one extra block for CRC. OTA update restart writes the
+// eboot command over the first 32 blocks, so records start after them.
+#define RTC_WIFI_CACHE_OFFSET	32	// 8 blocks
+#define RTC_DUTY_CYCLE_OFFSET	40	// 12 blocks
+#define RTC_OUTPUT_STATE_OFFSET	52	// 3 blocks
+
+// RTC user memory survives reboot and deep sleep, but not power loss.
+bool loadRTCData(uint32_t offset, void* data, size_t size);
+void saveRTCData(uint32_t offset, void* data, size_t size);
+void clearRTCData(uint32_t offset);
+
+#define OUTPUT_STATE_REFRESH	1000		// ms, timestamp refresh
+#define OUTPUT_STATE_MAX_AGE	60000		// ms, older state is stale
+
+// Outputs (relays) state, a bit per output, kept in RTC memory with a
+// timestamp. Call from loop(), written when changed or to refresh the
+// timestamp.
+void saveOutputState(uint32_t outputs);
+
+// Outputs state to restore, true only after a warm reboot (restart, crash,
+// watchdog) and if it was saved within @maxAge ms. Otherwise outputs keep
+// their safe default.
+bool loadOutputState(uint32_t* outputs, uint32_t maxAge = OUTPUT_STATE_MAX_AGE);
+
 #endif
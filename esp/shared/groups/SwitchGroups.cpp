@@ -0,0 +1,290 @@
+/*
+How it works:
+
+Switches listen on SWITCH_GROUPS_GROUP multicast address. A group command
+is a single datagram, so every member gets it at the same time however many
+of them there are:
+
+	SG2 <ON|OFF|SCENE> <group> <origin> <boot> <seq> [ACK]
+	SG2 ACK <group> <origin> <seq> <node>
+
+Origin and node are chip ids, boot is random on every boot of the origin. A
+member applies the command to the lines it
+has in the group: ON and OFF set them all, SCENE sets each one to the state
+the membership keeps for it. States are set, not toggled, so applying the
+same command twice changes nothing. The last sequence seen from each origin
+is kept and repeated commands are not applied again. Sequence starts from 1
+after reboot, so a new boot id of the origin restarts it.
+
+Datagrams can get lost. With ACK asked, the sender sends the command
+GROUP_RESENDS more times GROUP_RESEND_EVERY apart, and members reply with a
+unicast ACK to each copy, repeated ones too. Acks of the last command are
+counted once per member.
+*/
+#include <SwitchGroups.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+
+#define MESSAGE_LEN		64
+#define GROUP_ORIGINS		8		// origins remembered
+#define GROUP_RESENDS		2
+#define GROUP_RESEND_EVERY	50		// ms
+#define MAX_ACKS		32		// members counted
+
+namespace SwitchGroups
+{
+	WiFiUDP udp;
+	IPAddress joinedIP;
+	uint32_t nodeId;
+	uint32_t bootId;
+	uint32_t seq = 0;
+	SwitchGroup* groups = NULL;
+	ApplyCallback callback = NULL;
+
+	uint32_t origins[GROUP_ORIGINS];
+	uint32_t originBoots[GROUP_ORIGINS];
+	uint32_t originSeqs[GROUP_ORIGINS];
+	uint8_t nextOrigin = 0;
+
+	// Last command sent, for resends and acks
+	char lastCommand[MESSAGE_LEN + 1];
+	uint8_t resends = 0;
+	unsigned long resendAt;
+	uint32_t ackedBy[MAX_ACKS];
+	uint8_t acks = 0;
+
+	// Statistics
+	unsigned long received = 0;
+	unsigned long applied = 0;
+	unsigned long repeated = 0;
+	unsigned long restarted = 0;
+	unsigned long sent = 0;
+
+	void init(SwitchGroup* groups, ApplyCallback callback, uint32_t boot)
+	{
+		SwitchGroups::groups = groups;
+		SwitchGroups::callback = callback;
+		nodeId = ESP.getChipId();
+		bootId = boot;
+		memset(origins, 0, sizeof(origins));
+
+		// Uninitialised in EEPROM after upgrade
+		for (uint8_t i = 0; i < SWITCH_GROUPS_MAX; i++)
+			if (!memchr(groups[i].name, '\0', GROUP_NAME_LEN + 1))
+				memset(&groups[i], 0, sizeof(SwitchGroup));
+	}
+
+	bool setGroup(uint8_t slot, const String& name, uint8_t lines, uint8_t states)
+	{
+		if (!groups || slot >= SWITCH_GROUPS_MAX || name.length() > GROUP_NAME_LEN ||
+			strchr(name.c_str(), ' '))
+			return false;
+
+		strncpy(groups[slot].name, name.c_str(), GROUP_NAME_LEN + 1);
+		groups[slot].lines = lines;
+		groups[slot].states = states;
+		return true;
+	}
+
+	void multicast(const char* message)
+	{
+		udp.beginPacketMulticast(SWITCH_GROUPS_GROUP, SWITCH_GROUPS_PORT, WiFi.localIP());
+		udp.print(message);
+		udp.endPacket();
+	}
+
+	// True if command @seq from @origin @boot has not been seen yet
+	bool isNew(uint32_t origin, uint32_t boot, uint32_t seq)
+	{
+		for (uint8_t i = 0; i < GROUP_ORIGINS; i++)
+		{
+			if (origins[i] != origin)
+				continue;
+
+			if (originBoots[i] != boot)
+			{
+				// Origin has restarted, its sequence too
+				restarted++;
+				originBoots[i] = boot;
+				originSeqs[i] = seq;
+				return true;
+			}
+
+			if ((int32_t)(seq - originSeqs[i]) <= 0)
+				return false;
+			originSeqs[i] = seq;
+			return true;
+		}
+
+		origins[nextOrigin] = origin;
+		originBoots[nextOrigin] = boot;
+		originSeqs[nextOrigin] = seq;
+		nextOrigin = (nextOrigin + 1) % GROUP_ORIGINS;
+		return true;
+	}
+
+	void apply(SwitchGroup* group, const char* command)
+	{
+		for (uint8_t line = 0; line < 8; line++)
+		{
+			if (!(group->lines & (1 << line)))
+				continue;
+
+			int state =
+				!strcmp(command, "ON") ? HIGH :
+				!strcmp(command, "OFF") ? LOW :
+				(group->states & (1 << line)) ? HIGH : LOW;
+			if (callback)
+				callback(line, state);
+		}
+	}
+
+	void countAck(uint32_t origin, uint32_t ackSeq, uint32_t node)
+	{
+		if (origin != nodeId || ackSeq != seq)
+			return;
+
+		for (uint8_t i = 0; i < acks; i++)
+			if (ackedBy[i] == node)
+				return;
+		if (acks < MAX_ACKS)
+			ackedBy[acks++] = node;
+	}
+
+	void receive()
+	{
+		while (udp.parsePacket())
+		{
+			char message[MESSAGE_LEN + 1];
+			int length = udp.read(message, MESSAGE_LEN);
+			if (length <= 0)
+				continue;
+			message[length] = '\0';
+
+			char name[GROUP_NAME_LEN + 1];
+			unsigned int origin;
+			unsigned int commandSeq;
+
+			unsigned int node;
+			if (4 == sscanf(message, "SG2 ACK %15s %x %u %x", name, &origin, &commandSeq, &node))
+			{
+				countAck(origin, commandSeq, node);
+				continue;
+			}
+
+			char command[8];
+			unsigned int boot;
+			char flag[8] = "";
+			int fields = sscanf(message, "SG2 %7s %15s %x %x %u %7s",
+				command, name, &origin, &boot, &commandSeq, flag);
+			if (fields < 5 || !strcmp(command, "ACK"))
+				continue;
+
+			// Own command looped back, applied when sent
+			if (origin == nodeId)
+				continue;
+
+			SwitchGroup* group = NULL;
+			for (uint8_t i = 0; i < SWITCH_GROUPS_MAX && !group; i++)
+				if (groups && groups[i].name[0] && !strcmp(groups[i].name, name))
+					group = &groups[i];
+			if (!group)
+				continue;
+
+			received++;
+			if (isNew(origin, boot, commandSeq))
+			{
+				applied++;
+				Serial.printf("Group %s command %s from %08x.\n", name, command, origin);
+				apply(group, command);
+			}
+			else
+			{
+				repeated++;
+			}
+
+			if (!strcmp(flag, "ACK"))
+			{
+				char ack[MESSAGE_LEN + 1];
+				snprintf(ack, sizeof(ack), "SG2 ACK %s %08x %u %08x",
+					name, origin, commandSeq, (unsigned int)nodeId);
+				udp.beginPacket(udp.remoteIP(), SWITCH_GROUPS_PORT);
+				udp.print(ack);
+				udp.endPacket();
+			}
+		}
+	}
+
+	void update()
+	{
+		// (Re)join the group when got connected or IP has changed
+		if (WL_CONNECTED == WiFi.status())
+		{
+			if (WiFi.localIP() != joinedIP)
+			{
+				udp.stop();
+				udp.beginMulticast(WiFi.localIP(), SWITCH_GROUPS_GROUP, SWITCH_GROUPS_PORT);
+				joinedIP = WiFi.localIP();
+			}
+			receive();
+
+			if (resends && (long)(millis() - resendAt) >= 0)
+			{
+				multicast(lastCommand);
+				resends--;
+				resendAt = millis() + GROUP_RESEND_EVERY;
+			}
+		}
+		else
+		{
+			joinedIP = IPAddress();
+		}
+	}
+
+	uint32_t send(const char* group, const char* command, bool ack)
+	{
+		if (!joinedIP.isSet())
+			return 0;
+
+		snprintf(lastCommand, sizeof(lastCommand), "SG2 %s %s %08x %08x %u%s",
+			command, group, (unsigned int)nodeId, (unsigned int)bootId, (unsigned int)++seq,
+			ack ? " ACK" : "");
+		multicast(lastCommand);
+		sent++;
+		acks = 0;
+		resends = ack ? GROUP_RESENDS : 0;
+		resendAt = millis() + GROUP_RESEND_EVERY;
+
+		// Own memberships are applied here, not from the multicast
+		for (uint8_t i = 0; i < SWITCH_GROUPS_MAX; i++)
+			if (groups && groups[i].name[0] && !strcmp(groups[i].name, group))
+				apply(&groups[i], command);
+
+		return seq;
+	}
+
+	String getStatistics()
+	{
+		String member;
+		for (uint8_t i = 0; i < SWITCH_GROUPS_MAX; i++)
+		{
+			if (!groups || !groups[i].name[0])
+				continue;
+			if (member.length())
+				member += ", ";
+			member += String("\"") + groups[i].name + "\"";
+		}
+
+		return
+			String("{ ") +
+				"\"Member\" : [ " + member + " ], " +
+				"\"Received\" : " + String(received) + ", " +
+				"\"Applied\" : " + String(applied) + ", " +
+				"\"Repeated\" : " + String(repeated) + ", " +
+				"\"Restarted\" : " + String(restarted) + ", " +
+				"\"Sent\" : " + String(sent) + ", " +
+				"\"LastSeq\" : " + String(seq) + ", " +
+				"\"LastAcks\" : " + String(acks) +
+			" }";
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef SWITCH_GROUPS_H
+#define SWITCH_GROUPS_H
+
+#include <Arduino.h>
+
+#define SWITCH_GROUPS_GROUP	IPAddress(239, 255, 42, 2)
+#define SWITCH_GROUPS_PORT	4211
+#define SWITCH_GROUPS_MAX	4		// memberships per switch
+#define GROUP_NAME_LEN		15
+
+// Membership of a switch in a named group, kept in config. @lines are the
+// lines (bit per line) the group controls, @states is the line states of
+// the group scene.
+struct SwitchGroup
+{
+	char		name[GROUP_NAME_LEN + 1];	// empty if not used
+	uint8_t		lines;
+	uint8_t		states;
+};
+
+namespace SwitchGroups
+{
+	// Called from update() to set @line to @state by a group command.
+	typedef void (*ApplyCallback)(uint8_t line, int state);
+
+	// @groups (SWITCH_GROUPS_MAX of them) are this switch memberships,
+	// they have to stay valid (e.g. config). @boot is different on every
+	// boot (random), so members don't take the restarted sequence as
+	// repeated.
+	void init(SwitchGroup* groups, ApplyCallback callback, uint32_t boot);
+
+	// Set membership @slot, empty @name leaves the group. False if @slot
+	// or @name is not valid.
+	bool setGroup(uint8_t slot, const String& name, uint8_t lines, uint8_t states);
+
+	// Joins the multicast group, receives and applies commands, counts
+	// acks. Call from loop().
+	void update();
+
+	// Multicast @command ("ON", "OFF" or "SCENE") to all members of
+	// @group, asking them to ack if @ack. Returns the command sequence, 0
+	// if not connected.
+	uint32_t send(const char* group, const char* command, bool ack);
+
+	// Memberships and group commands statistics as JSON object.
+	String getStatistics();
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+How it works:
+
+Heating load is the sum of powers of the channels which relays are on.
+Energy of each channel is integrated from its relay on time every time a
+relay is set or a counter is read.
+
+The meter shows whole house consumption, so base load is estimated as meter
+power minus heating load at the moment of reading. It is rechecked every
+METER_RECONCILE_EVERY or METER_SETTLE_TIME after a relay change, when the
+meter has caught up with it. In between house power is estimated locally.
+*/
+#include <EnergyModel.h>
+
+EnergyModel::EnergyModel(uint8_t channels)
+{
+	this->channels = min(channels, (uint8_t)HEATING_MAX_CHANNELS);
+	for (uint8_t i = 0; i < HEATING_MAX_CHANNELS; i++)
+	{
+		on[i] = false;
+		power[i] = 0;
+		energy[i] = 0;
+	}
+	integratedAt = millis();
+	baseLoad = 0;
+	reconciled = false;
+	reconciledAt = 0;
+	changed = false;
+	changedAt = 0;
+}
+
+void EnergyModel::integrate()
+{
+	unsigned long now = millis();
+	double hours = (now - integratedAt) / 3600000.0;
+
+	for (uint8_t i = 0; i < channels; i++)
+		if (on[i])
+			energy[i] += power[i] * hours / 1000;
+	integratedAt = now;
+}
+
+void EnergyModel::setChannel(uint8_t channel, bool on, float power)
+{
+	if (channel >= channels)
+		return;
+
+	integrate();
+	if (this->on[channel] != on)
+	{
+		changed = true;
+		changedAt = millis();
+	}
+	this->on[channel] = on;
+	this->power[channel] = power;
+}
+
+void EnergyModel::reconcile(float meterPower)
+{
+	baseLoad = max(meterPower - getHeatingLoad(), 0.0f);
+	reconciled = true;
+	reconciledAt = millis();
+	changed = false;
+}
+
+bool EnergyModel::needsReconcile()
+{
+	unsigned long now = millis();
+
+	return
+		!reconciled ||
+		now - reconciledAt >= METER_RECONCILE_EVERY ||
+		(changed && now - changedAt >= METER_SETTLE_TIME);
+}
+
+float EnergyModel::getHeatingLoad()
+{
+	float load = 0;
+	for (uint8_t i = 0; i < channels; i++)
+		if (on[i])
+			load += power[i];
+	return load;
+}
+
+float EnergyModel::getPower()
+{
+	return baseLoad + getHeatingLoad();
+}
+
+float EnergyModel::getBaseLoad()
+{
+	return baseLoad;
+}
+
+float EnergyModel::getEnergy(uint8_t channel)
+{
+	if (channel >= channels)
+		return 0;
+
+	integrate();
+	return energy[channel];
+}
@@ -0,0 +1,54 @@
+#ifndef ENERGY_MODEL_H
+#define ENERGY_MODEL_H
+
+#include <Arduino.h>
+
+#define HEATING_MAX_CHANNELS	8
+#define METER_RECONCILE_EVERY	(5 * 60000L)	// regular meter check, ms
+#define METER_SETTLE_TIME	(30000L)	// meter check after relay change, ms
+
+// Local model of heating power and energy. Heaters are of known power, so
+// heating load and per channel energy come from relay on time, the rest of
+// the house load is taken from the meter now and then.
+class EnergyModel
+{
+public:
+	EnergyModel(uint8_t channels);
+
+	// Relay of @channel is set to @on, @power is the heater power, W.
+	void setChannel(uint8_t channel, bool on, float power);
+
+	// Base (non heating) load from @meterPower measured, W.
+	void reconcile(float meterPower);
+
+	// True when the meter should be checked: it's been a while or relays
+	// have changed since.
+	bool needsReconcile();
+
+	// Heating load of the channels on, W.
+	float getHeatingLoad();
+
+	// Total house power estimated: base load plus heating load, W.
+	float getPower();
+
+	float getBaseLoad();
+
+	// Energy used by @channel heater since start, kWh.
+	float getEnergy(uint8_t channel);
+
+private:
+	void integrate();
+
+	uint8_t		channels;
+	bool		on[HEATING_MAX_CHANNELS];
+	float		power[HEATING_MAX_CHANNELS];
+	double		energy[HEATING_MAX_CHANNELS];	// kWh
+	unsigned long	integratedAt;
+	float		baseLoad;
+	bool		reconciled;		// meter has been checked at least once
+	unsigned long	reconciledAt;
+	bool		changed;		// relays changed since reconciled
+	unsigned long	changedAt;
+};
+
+#endif
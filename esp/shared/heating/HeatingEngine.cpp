@@ -0,0 +1,244 @@
+/*
+How it works:
+
+Each control() step:
+- channels that are on but not needed are switched off, their power is
+  taken off the current load. In CONTROL_ON_OFF mode a channel is needed
+  below the target. In CONTROL_PID mode each channel has its PID duty and
+  is needed for that part of the PID_WINDOW, windows of the channels are
+  shifted evenly not to start together. Duty is limited to the part of the
+  total heaters power the cap allows, PID doesn't wind up while a channel
+  is held off by the cap;
+- channels needed that are off are candidates, each scored by temperature
+  deficit (or PID duty) times its priority. Once ThermalModel of every
+  channel has learned its response, on/off score is the predicted run time
+  to the target instead, so slow channels start first and fast ones fill
+  the headroom left. Scores of all candidates are in the same unit, a
+  channel still learning keeps the others on deficit;
+- out of the candidates the set with the best total score that fits the
+  headroom left under the power cap is picked. There are no more than
+  HEATING_MAX_CHANNELS candidates, so all combinations are checked;
+- picked channels reserve their power in PowerBudget, best score first, and
+  are switched on once reserved. Budget counts a channel reserved for the
+  next ones, so they don't overshoot the cap together either.
+*/
+#include <HeatingEngine.h>
+#include <PowerBudget.h>
+
+HeatingEngine::HeatingEngine(Heater* heaters, uint8_t count, float maxPower) :
+	energyModel(count)
+{
+	this->heaters = heaters;
+	this->count = min(count, (uint8_t)HEATING_MAX_CHANNELS);
+	this->maxPower = maxPower;
+	mode = CONTROL_ON_OFF;
+	on = 0;
+	pending = 0;
+	denied = 0;
+}
+
+void HeatingEngine::init(uint8_t states)
+{
+	for (uint8_t i = 0; i < count; i++)
+	{
+		pinMode(heaters[i].pin, OUTPUT);
+		setChannel(i, states & (1 << i));
+	}
+}
+
+void HeatingEngine::setChannel(uint8_t channel, bool state)
+{
+	if (state)
+		on |= 1 << channel;
+	else
+		on &= ~(1 << channel);
+
+	digitalWrite(heaters[channel].pin, state);
+	energyModel.setChannel(channel, state, heaters[channel].power);
+}
+
+void HeatingEngine::setMode(uint8_t mode)
+{
+	if (this->mode != mode)
+		for (uint8_t i = 0; i < count; i++)
+			pids[i].reset();
+	this->mode = mode;
+}
+
+bool HeatingEngine::isOn(uint8_t channel)
+{
+	return on & (1 << channel);
+}
+
+uint8_t HeatingEngine::getStates()
+{
+	return on;
+}
+
+float HeatingEngine::getDuty(uint8_t channel)
+{
+	return pids[channel].getDuty();
+}
+
+bool HeatingEngine::needsReconcile()
+{
+	return energyModel.needsReconcile() || PowerBudget::needsMeterReading();
+}
+
+void HeatingEngine::reconcile(float meterPower)
+{
+	energyModel.reconcile(meterPower);
+	PowerBudget::meterRead();
+}
+
+EnergyModel& HeatingEngine::getEnergyModel()
+{
+	return energyModel;
+}
+
+ThermalModel& HeatingEngine::getThermalModel(uint8_t channel)
+{
+	return thermalModels[channel];
+}
+
+void HeatingEngine::onReserved(bool granted, void* context)
+{
+	Reservation* reservation = (Reservation*)context;
+	HeatingEngine* engine = reservation->engine;
+	uint8_t channel = reservation->channel;
+
+	engine->pending &= ~(1 << channel);
+	if (granted)
+	{
+		engine->denied &= ~(1 << channel);
+		engine->setChannel(channel, true);
+		Serial.printf("Heating channel %d state: 1\n", channel);
+	}
+	else
+	{
+		engine->denied |= 1 << channel;
+		Serial.printf("Requred power (%dW) for channel %d is over budget, can't on.\n",
+			(int)engine->heaters[channel].power, channel);
+	}
+}
+
+// Best scored set of @candidates that fits @headroom, as bits of candidates.
+uint8_t HeatingEngine::pickChannels(uint8_t* candidates, uint8_t count, float* scores, float headroom)
+{
+	uint8_t best = 0;
+	float bestScore = 0;
+	float bestPower = 0;
+
+	for (uint16_t set = 1; set < (1 << count); set++)
+	{
+		float score = 0;
+		float power = 0;
+		for (uint8_t i = 0; i < count; i++)
+		{
+			if (set & (1 << i))
+			{
+				score += scores[i];
+				power += heaters[candidates[i]].power;
+			}
+		}
+
+		if (power < headroom && (score > bestScore || (score == bestScore && power < bestPower)))
+		{
+			best = set;
+			bestScore = score;
+			bestPower = power;
+		}
+	}
+	return best;
+}
+
+void HeatingEngine::control(float currentPower, float target, bool active)
+{
+	uint8_t candidates[HEATING_MAX_CHANNELS];
+	float scores[HEATING_MAX_CHANNELS];
+	uint8_t candidateCount = 0;
+
+	float totalPower = 0;
+	for (uint8_t i = 0; i < count; i++)
+		totalPower += heaters[i].power;
+	float maxDuty = totalPower > maxPower ? maxPower / totalPower : 1.0;
+	unsigned long now = millis();
+
+	bool learned = true;
+	for (uint8_t i = 0; i < count; i++)
+		learned = learned && thermalModels[i].isLearned();
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		bool needed;
+		float score;
+
+		thermalModels[i].sample(heaters[i].temperature, isOn(i));
+
+		if (CONTROL_PID == mode)
+		{
+			if (active)
+			{
+				pids[i].setOutputLimit(maxDuty);
+				pids[i].compute(target, heaters[i].temperature, denied & (1 << i));
+			}
+			else
+			{
+				pids[i].reset();
+			}
+			needed = active && pids[i].getState(now, i * PID_WINDOW / count);
+			score = pids[i].getDuty() * heaters[i].priority;
+		}
+		else
+		{
+			float deficit = target - heaters[i].temperature;
+			needed = active && deficit > 0;
+			if (learned)
+				score = thermalModels[i].getRunTime(heaters[i].temperature, target) * heaters[i].priority;
+			else
+				score = deficit * heaters[i].priority;
+		}
+
+		if (!needed)
+			denied &= ~(1 << i);
+
+		if (isOn(i) && !needed)
+		{
+			setChannel(i, false);
+			currentPower -= heaters[i].power;
+			Serial.printf("Heating channel %d state: 0\n", i);
+		}
+		else if (!isOn(i) && needed && !(pending & (1 << i)))
+		{
+			// Keep candidates ordered by score, best first
+			uint8_t position = candidateCount++;
+			while (position > 0 && scores[position - 1] < score)
+			{
+				candidates[position] = candidates[position - 1];
+				scores[position] = scores[position - 1];
+				position--;
+			}
+			candidates[position] = i;
+			scores[position] = score;
+		}
+	}
+
+	uint8_t picked = pickChannels(candidates, candidateCount, scores, maxPower - currentPower);
+
+	for (uint8_t i = 0; i < candidateCount; i++)
+	{
+		uint8_t channel = candidates[i];
+		if (!(picked & (1 << i)))
+		{
+			denied |= 1 << channel;
+			Serial.printf("Requred power (%dW) for channel %d is over limit, can't on.\n",
+				(int)heaters[channel].power, channel);
+			continue;
+		}
+
+		reservations[channel].engine = this;
+		reservations[channel].channel = channel;
+		if (PowerBudget::reserve(heaters[channel].power, currentPower, onReserved, &reservations[channel]))
+			pending |= 1 << channel;
+	}
+}
@@ -0,0 +1,81 @@
+#ifndef HEATING_ENGINE_H
+#define HEATING_ENGINE_H
+
+#include <Arduino.h>
+#include <EnergyModel.h>
+#include <PIDController.h>
+#include <ThermalModel.h>
+
+// Heating channel: relay, heater and its sensor reading.
+struct Heater
+{
+	uint8_t		pin;			// relay pin
+	float		power;			// heater power, W
+	uint8_t		priority;		// deficit weight, 1 is normal
+	float		temperature;		// current, updated by the caller
+};
+
+// Heating control of any number of channels (up to HEATING_MAX_CHANNELS)
+// under a power cap shared with other nodes through PowerBudget.
+class HeatingEngine
+{
+public:
+	HeatingEngine(Heater* heaters, uint8_t count, float maxPower);
+
+	// Relays to outputs, switched to @states (bit per channel), all off by
+	// default.
+	void init(uint8_t states = 0);
+
+	// CONTROL_ON_OFF or CONTROL_PID.
+	void setMode(uint8_t mode);
+
+	// Switch off channels that are warm enough and pick the channels to
+	// switch on for @target temperature on top of @currentPower house load.
+	void control(float currentPower, float target, bool active);
+
+	bool isOn(uint8_t channel);
+
+	// Channels on, bit per channel.
+	uint8_t getStates();
+
+	// PID duty of @channel, 0..1.
+	float getDuty(uint8_t channel);
+
+	// True when the meter should be read: energy model is to be reconciled
+	// or peers have switched heaters on that the meter shows by now.
+	bool needsReconcile();
+
+	// Meter reads @meterPower, energy model and power budget follow it.
+	void reconcile(float meterPower);
+
+	// Heating load and energy of the channels.
+	EnergyModel& getEnergyModel();
+
+	// Learned heating and cooling of @channel.
+	ThermalModel& getThermalModel(uint8_t channel);
+
+private:
+	struct Reservation
+	{
+		HeatingEngine*	engine;
+		uint8_t		channel;
+	};
+
+	static void onReserved(bool granted, void* context);
+	void setChannel(uint8_t channel, bool on);
+	uint8_t pickChannels(uint8_t* candidates, uint8_t count, float* scores, float headroom);
+
+	Heater*		heaters;
+	uint8_t		count;
+	float		maxPower;
+	uint8_t		mode;
+	uint8_t		on;			// bit per channel
+	uint8_t		pending;		// power reservation in progress
+	uint8_t		denied;			// needed but got no power
+	PIDController	pids[HEATING_MAX_CHANNELS];
+	ThermalModel	thermalModels[HEATING_MAX_CHANNELS];
+	Reservation	reservations[HEATING_MAX_CHANNELS];
+	EnergyModel	energyModel;
+};
+
+#endif
@@ -0,0 +1,87 @@
+/*
+How it works:
+
+Duty is computed as
+
+	Kp * error + integral - Kd * temperature change rate
+
+with error being target minus temperature. Derivative is taken on the
+temperature, not on the error, so a target change doesn't kick it.
+
+Anti-windup: integral only grows if the output isn't saturated in the same
+direction and the heater was really able to run (not held by power cap),
+it's also kept within output limits. Output is limited to 0..maxDuty.
+
+The relay is driven by time proportioning: within every PID_WINDOW it is on
+for the first duty part of the window. Slab floors are slow, so a 10 minutes
+window gives smooth heat with a few relay switches per window at most.
+*/
+#include <PIDController.h>
+
+PIDController::PIDController()
+{
+	maxDuty = 1.0;
+	reset();
+}
+
+void PIDController::reset()
+{
+	integral = 0;
+	lastTemperature = 0;
+	lastTime = 0;
+	started = false;
+	duty = 0;
+}
+
+void PIDController::setOutputLimit(float maxDuty)
+{
+	this->maxDuty = constrain(maxDuty, 0.0f, 1.0f);
+}
+
+float PIDController::compute(float target, float temperature, bool held)
+{
+	unsigned long now = millis();
+	float error = target - temperature;
+
+	if (!started)
+	{
+		started = true;
+		lastTime = now;
+		lastTemperature = temperature;
+	}
+
+	float dt = (now - lastTime) / 1000.0;
+	float derivative = dt > 0 ? (temperature - lastTemperature) / dt : 0;
+	lastTime = now;
+	lastTemperature = temperature;
+
+	float proportional = PID_KP * error;
+	float output = proportional + integral - PID_KD * derivative;
+
+	bool saturated = (output >= maxDuty && error > 0) || (output <= 0 && error < 0);
+	if (!saturated && !(held && error > 0))
+	{
+		integral += PID_KI * error * dt;
+		integral = constrain(integral, 0.0f, maxDuty);
+		output = proportional + integral - PID_KD * derivative;
+	}
+
+	duty = constrain(output, 0.0f, maxDuty);
+	if (duty < PID_MIN_DUTY)
+		duty = 0;
+	if (duty > maxDuty - PID_MIN_DUTY)
+		duty = maxDuty;
+
+	return duty;
+}
+
+float PIDController::getDuty()
+{
+	return duty;
+}
+
+bool PIDController::getState(unsigned long now, unsigned long offset)
+{
+	unsigned long position = (now + offset) % PID_WINDOW;
+	return position < duty * PID_WINDOW;
+}
@@ -0,0 +1,47 @@
+#ifndef PID_CONTROLLER_H
+#define PID_CONTROLLER_H
+
+#include <Arduino.h>
+
+// Heating control modes
+#define CONTROL_ON_OFF		0		// on below target, off above
+#define CONTROL_PID		1		// time proportional PID
+
+#define PID_WINDOW		(10 * 60000L)	// time proportioning window, ms
+#define PID_KP			0.5		// duty per degree
+#define PID_KI			(0.5 / 3600)	// duty per degree per second
+#define PID_KD			0.0		// duty per degree per second of change
+#define PID_MIN_DUTY		0.02		// shorter on/off isn't worth the relay
+
+// PID controller driving a relay by time proportioning: heater is on for
+// duty part of every PID_WINDOW.
+class PIDController
+{
+public:
+	PIDController();
+
+	// Top duty, 0..1, e.g. what the power cap allows.
+	void setOutputLimit(float maxDuty);
+
+	// Next duty for @temperature to get to @target. @held means the last
+	// duty couldn't be applied (no power), integral is not growing then.
+	float compute(float target, float temperature, bool held = false);
+
+	float getDuty();
+
+	// Relay state for the current duty at @now. Windows of channels can be
+	// shifted by @offset not to start together.
+	bool getState(unsigned long now, unsigned long offset = 0);
+
+	void reset();
+
+private:
+	float		integral;
+	float		lastTemperature;
+	unsigned long	lastTime;
+	bool		started;
+	float		duty;
+	float		maxDuty;
+};
+
+#endif
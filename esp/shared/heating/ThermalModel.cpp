@@ -0,0 +1,197 @@
+/*
+How it works:
+
+Channel is modeled as
+
+	dT/dt = a * duty - b * (T - ambient) = a * duty - b * T + c
+
+where a is the heating rate of the heater (degree/hour), 1/b is the
+cooling time constant (hours) and ambient = c / b is what the slab cools
+down to. The room is not at a fixed temperature: it follows the slab and
+the outdoor, so the ambient is learned too. Temperature is taken relative
+to THERMAL_AMBIENT, the start value, to keep b and c apart in float.
+
+Every THERMAL_SAMPLE_EVERY the temperature slope over the interval, the
+part of the interval heater was on and the average temperature make one
+sample. Samples are fitted by recursive least squares with forgetting, so
+the model follows season changes. Interval is longer than the lag of the
+sensor in the slab and the PID window, shorter ones see duty and slope out
+of step and learn a heater much too weak.
+
+Only intervals with the heater on or off all along, after another such one,
+are learned from: heating up and cooling down after the target changes.
+Holding the target the duty follows the outdoor, not anything the model
+knows, and the fit takes that for a weak heater. The first interval after
+a switch still has the sensor lagging.
+
+Within the few degrees a slab moves b and ambient trade for each other,
+only the slope at the temperature is seen. So b starts with little
+uncertainty and is mostly kept, a and ambient are learned; forgetting is
+not let to wind up the uncertainty over the start. What the run and idle
+times need is the slope over that range, the simulator checks them against
+the slab with its room drifting.
+
+With a, b and ambient known, temperature heating from T0 goes exponentially
+to the equilibrium Teq = ambient + a / b:
+
+	T(t) = Teq + (T0 - Teq) * exp(-b * t)
+
+this gives the run time to the target, cooling with a = 0 gives the time
+till heating is needed again.
+*/
+#include <ThermalModel.h>
+
+// Of rate, loss and drift: heater is seen well, loss hardly, see above
+static const float START_COVARIANCE[3] = { 100, 0.01, 1 };
+
+ThermalModel::ThermalModel()
+{
+	ThermalParameters parameters = { 1.0, 10.0, 0, THERMAL_AMBIENT };
+	setParameters(parameters);
+}
+
+void ThermalModel::setParameters(const ThermalParameters& parameters)
+{
+	// Uninitialised or broken values
+	bool valid =
+		parameters.heatingRate > 0 && parameters.heatingRate < 100 &&
+		parameters.coolingTime > 0 && parameters.coolingTime < 1000 &&
+		parameters.ambient >= THERMAL_MIN_AMBIENT && parameters.ambient <= THERMAL_MAX_AMBIENT;
+
+	rate = valid ? parameters.heatingRate : 1.0;
+	loss = valid ? 1 / parameters.coolingTime : 0.1;
+	drift = valid ? loss * (parameters.ambient - THERMAL_AMBIENT) : 0;
+	samples = valid ? parameters.samples : 0;
+
+	// Less trust in what's learned before, more in the start values
+	memset(covariance, 0, sizeof(covariance));
+	for (uint8_t i = 0; i < 3; i++)
+		covariance[i][i] = START_COVARIANCE[i] * (samples ? 0.01 : 1.0);
+
+	started = false;
+}
+
+ThermalParameters ThermalModel::getParameters()
+{
+	ThermalParameters parameters = { rate, 1 / loss, samples, getAmbient() };
+	return parameters;
+}
+
+float ThermalModel::getAmbient()
+{
+	return THERMAL_AMBIENT + drift / loss;
+}
+
+bool ThermalModel::isLearned()
+{
+	return samples >= THERMAL_MIN_SAMPLES;
+}
+
+void ThermalModel::sample(float temperature, bool on)
+{
+	unsigned long now = millis();
+
+	if (!started)
+	{
+		started = true;
+		intervalStart = lastTime = now;
+		lastOn = on;
+		startTemperature = temperature;
+		temperatureSum = 0;
+		temperatureCount = 0;
+		onTime = 0;
+		lastSaturated = -1;
+		return;
+	}
+
+	if (lastOn)
+		onTime += now - lastTime;
+	lastOn = on;
+	lastTime = now;
+	temperatureSum += temperature;
+	temperatureCount++;
+
+	unsigned long interval = now - intervalStart;
+	if (interval < THERMAL_SAMPLE_EVERY)
+		return;
+
+	float hours = interval / 3600000.0;
+	float duty = (float)onTime / interval;
+	int8_t saturated = duty <= THERMAL_SATURATION ? 0 : duty >= 1 - THERMAL_SATURATION ? 1 : -1;
+	if (saturated >= 0 && saturated == lastSaturated)
+		learn((temperature - startTemperature) / hours, duty, temperatureSum / temperatureCount);
+	lastSaturated = saturated;
+
+	intervalStart = now;
+	startTemperature = temperature;
+	temperatureSum = 0;
+	temperatureCount = 0;
+	onTime = 0;
+}
+
+// Recursive least squares step for
+// slope = rate * duty - loss * (T - THERMAL_AMBIENT) + drift
+void ThermalModel::learn(float slope, float duty, float temperature)
+{
+	float x[3] = { duty, (float)(THERMAL_AMBIENT - temperature), 1 };
+
+	float px[3];
+	float denominator = THERMAL_FORGETTING;
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		px[i] = covariance[i][0] * x[0] + covariance[i][1] * x[1] + covariance[i][2] * x[2];
+		denominator += x[i] * px[i];
+	}
+	float error = slope - (rate * x[0] + loss * x[1] + drift);
+
+	rate = constrain(rate + px[0] / denominator * error, 0.01f, 50.0f);
+	loss = constrain(loss + px[1] / denominator * error, 0.002f, 2.0f);
+	drift = constrain(drift + px[2] / denominator * error,
+		(float)(loss * (THERMAL_MIN_AMBIENT - THERMAL_AMBIENT)),
+		(float)(loss * (THERMAL_MAX_AMBIENT - THERMAL_AMBIENT)));
+
+	for (uint8_t i = 0; i < 3; i++)
+		for (uint8_t j = 0; j < 3; j++)
+			covariance[i][j] = (covariance[i][j] - px[i] * px[j] / denominator) / THERMAL_FORGETTING;
+
+	// Forgetting winds up what the samples don't show, keep it to the start
+	for (uint8_t i = 0; i < 3; i++)
+		if (covariance[i][i] > START_COVARIANCE[i])
+		{
+			float scale = sqrt(START_COVARIANCE[i] / covariance[i][i]);
+			for (uint8_t j = 0; j < 3; j++)
+			{
+				covariance[i][j] *= scale;
+				covariance[j][i] *= scale;
+			}
+		}
+
+	if (samples < 0xFFFF)
+		samples++;
+}
+
+float ThermalModel::getRunTime(float temperature, float target)
+{
+	if (temperature >= target)
+		return 0;
+
+	float equilibrium = getAmbient() + rate / loss;
+	if (target >= equilibrium)
+		return THERMAL_MAX_RUN_TIME;
+
+	float time = -log((target - equilibrium) / (temperature - equilibrium)) / loss;
+	return min(time, (float)THERMAL_MAX_RUN_TIME);
+}
+
+float ThermalModel::getIdleTime(float temperature, float target)
+{
+	if (temperature <= target)
+		return 0;
+
+	float ambient = getAmbient();
+	if (target <= ambient)
+		return THERMAL_MAX_RUN_TIME;
+
+	float time = -log((target - ambient) / (temperature - ambient)) / loss;
+	return min(time, (float)THERMAL_MAX_RUN_TIME);
+}
@@ -0,0 +1,70 @@
+#ifndef THERMAL_MODEL_H
+#define THERMAL_MODEL_H
+
+#include <Arduino.h>
+
+#define THERMAL_AMBIENT		20.0		// ambient to start with, degree
+#define THERMAL_MIN_AMBIENT	(-30.0)		// degree
+#define THERMAL_MAX_AMBIENT	40.0		// degree
+#define THERMAL_SAMPLE_EVERY	(30 * 60000L)	// ms, longer than sensor lag and PID window
+#define THERMAL_FORGETTING	0.995		// ~200 samples memory, weeks of target changes
+#define THERMAL_SATURATION	0.05		// duty this close to off or on is learned from
+#define THERMAL_MIN_SAMPLES	12		// intervals learned, a couple of target changes
+#define THERMAL_MAX_RUN_TIME	24.0		// hours, when target is out of reach
+
+// Learned heating channel response, kept in config.
+struct ThermalParameters
+{
+	float		heatingRate;		// degree per hour the heater adds
+	float		coolingTime;		// cooling time constant, hours
+	uint16_t	samples;		// learned from, 0 if not learned yet
+	float		ambient;		// temperature it cools down to, degree
+};
+
+// Learns how fast a channel heats and cools from its own temperature
+// history and predicts how long it has to run.
+class ThermalModel
+{
+public:
+	ThermalModel();
+
+	// Restore learned parameters, e.g. from config.
+	void setParameters(const ThermalParameters& parameters);
+	ThermalParameters getParameters();
+
+	// Current @temperature and heater state, call regularly.
+	void sample(float temperature, bool on);
+
+	// Temperature it cools down to, degree.
+	float getAmbient();
+
+	// True when there are enough samples to trust it.
+	bool isLearned();
+
+	// Heating time from @temperature to @target, hours.
+	float getRunTime(float temperature, float target);
+
+	// Time till it cools from @temperature down to @target, hours.
+	float getIdleTime(float temperature, float target);
+
+private:
+	void learn(float slope, float duty, float temperature);
+
+	float		rate;			// a in dT/dt = a * duty - b * T + c
+	float		loss;			// b, 1/hours
+	float		drift;			// c - b * THERMAL_AMBIENT, degree/hour
+	float		covariance[3][3];
+	uint16_t	samples;
+
+	bool		started;
+	unsigned long	intervalStart;
+	unsigned long	lastTime;
+	bool		lastOn;
+	float		startTemperature;
+	float		temperatureSum;
+	uint16_t	temperatureCount;
+	unsigned long	onTime;			// ms within interval
+	int8_t		lastSaturated;		// last interval heater was: 0 off, 1 on, -1 both
+};
+
+#endif
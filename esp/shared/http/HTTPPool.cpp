@@ -0,0 +1,515 @@
+/*
+How it works:
+
+HTTPPool runs the outbound HTTP calls asynchronously so that a slow upstream
+doesn't stall loop(). GET()/POST() only put the request to the queue, all the
+work is done by update() called from loop(): it sends queued requests, reads
+whatever part of the response has arrived and fires the request callback once
+the response is complete, failed or timed out after HTTP_TIMEOUT ms.
+
+There is one persistent keep-alive connection per upstream host (host:port),
+so that regular calls to the same API don't pay TCP handshake each time.
+Requests to the same host are sent one by one in the queue order. There are
+HTTP_POOL_SIZE connections, when all are taken the least recently used idle
+one is closed and reused for the new host.
+
+If the server closed an idle connection we only find it out when sending or
+waiting for the response, so the request is repeated once over a fresh
+connection in this case.
+
+The only blocking part left is (re)opening a connection: the DNS lookup of
+the host, limited to HTTP_DNS_TIMEOUT ms, and the TCP connect, limited to
+HTTP_CONNECT_TIMEOUT ms. A request over a kept alive connection never
+blocks, a new one or the one replacing a stale kept alive connection stalls
+loop() for up to 500 ms. All the connections may be opened in one update(),
+so the worst case is HTTP_POOL_SIZE times that.
+
+Response is expected with Content-Length, chunked or till connection close.
+Body is kept in String unless the request has a filter: then it goes to the
+filter as it comes and the callback is fired as soon as the filter has got
+its part. The rest of the body is read and dropped to keep the connection.
+
+Conditional GET sends If-None-Match with the ETag the caller has got before,
+the ETag header of the response is given to the callback by getETag().
+
+Each request is timed from queueing to callback, getStatistics() returns
+request count, connection reuse ratio and latency for /status.
+*/
+#include <HTTPPool.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266HTTPClient.h>
+
+#define HTTP_POOL_SIZE		3
+#define HTTP_QUEUE_SIZE		6
+#define HTTP_TIMEOUT		3000		// response, ms
+#define HTTP_DNS_TIMEOUT	250		// host name lookup, ms
+#define HTTP_CONNECT_TIMEOUT	250		// TCP connect, ms
+#define HOST_LEN		40
+#define MAX_LINE_LEN		256		// status, header or chunk size line
+#define READ_BUFFER_LEN		128
+
+namespace HTTPPool
+{
+	enum ConnectionState
+	{
+		CONNECTION_IDLE,
+		CONNECTION_STATUS,		// waiting for status line
+		CONNECTION_HEADERS,
+		CONNECTION_BODY,
+		CONNECTION_CHUNK_SIZE,
+		CONNECTION_CHUNK_DATA,
+		CONNECTION_CHUNK_END,		// CRLF after chunk data
+		CONNECTION_TRAILER		// after the last chunk
+	};
+
+	struct Request
+	{
+		const char*		method;
+		String			url;
+		String			payload;
+		String			etag;		// If-None-Match
+		ResponseCallback	callback;
+		void*			context;
+		BodyFilter		filter;
+		unsigned long		queuedAt;
+	};
+
+	struct Connection
+	{
+		char			host[HOST_LEN + 1];	// host:port
+		WiFiClient		client;
+		unsigned long		lastUsed;
+		ConnectionState		state;
+		Request			request;
+		bool			keptAlive;	// request went over kept alive connection
+		unsigned long		sentAt;
+		int			httpCode;
+		long			remaining;	// body or chunk bytes left, -1 till close
+		bool			chunked;
+		bool			closeAfter;	// server asked to close connection
+		bool			completed;	// callback fired by filter
+		String			line;
+		String			body;
+		String			etag;		// response ETag
+	};
+
+	Connection pool[HTTP_POOL_SIZE];
+	Request queue[HTTP_QUEUE_SIZE];
+	uint8_t queueHead = 0;
+	uint8_t queueCount = 0;
+	String currentETag;		// of the response in the callback
+
+	// Statistics
+	unsigned long requests = 0;
+	unsigned long reused = 0;
+	unsigned long failed = 0;
+	unsigned long totalLatency = 0;
+	unsigned long maxLatency = 0;
+
+	// host:port part of the url
+	String getHost(const String& url)
+	{
+		int start = url.indexOf("://");
+		start = (start < 0) ? 0 : start + 3;
+		int end = url.indexOf('/', start);
+		return (end < 0) ? url.substring(start) : url.substring(start, end);
+	}
+
+	// path part of the url
+	String getPath(const String& url)
+	{
+		int start = url.indexOf("://");
+		start = (start < 0) ? 0 : start + 3;
+		int end = url.indexOf('/', start);
+		return (end < 0) ? String("/") : url.substring(end);
+	}
+
+	bool enqueue(const char* method, const String& url, const String& payload,
+		const String& etag, ResponseCallback callback, void* context, BodyFilter filter)
+	{
+		if (HTTP_QUEUE_SIZE == queueCount)
+		{
+			Serial.printf("HTTP queue is full, %s %s dropped.\n", method, url.c_str());
+			failed++;
+			return false;
+		}
+
+		Request* request = &queue[(queueHead + queueCount++) % HTTP_QUEUE_SIZE];
+		request->method = method;
+		request->url = url;
+		request->payload = payload;
+		request->etag = etag;
+		request->callback = callback;
+		request->context = context;
+		request->filter = filter;
+		request->queuedAt = millis();
+		return true;
+	}
+
+	bool GET(const String& url, ResponseCallback callback, void* context, BodyFilter filter)
+	{
+		return enqueue("GET", url, String(), String(), callback, context, filter);
+	}
+
+	bool GET(const String& url, const String& etag, ResponseCallback callback, void* context)
+	{
+		return enqueue("GET", url, String(), etag, callback, context, NULL);
+	}
+
+	const String& getETag()
+	{
+		return currentETag;
+	}
+
+	bool POST(const String& url, const String& payload, ResponseCallback callback, void* context)
+	{
+		return enqueue("POST", url, payload, String(), callback, context, NULL);
+	}
+
+	// Account request and let the caller know
+	void complete(Request* request, int httpCode, const String& body, const String& etag)
+	{
+		unsigned long latency = millis() - request->queuedAt;
+
+		requests++;
+		totalLatency += latency;
+		if (latency > maxLatency)
+			maxLatency = latency;
+		if (httpCode <= 0)
+			failed++;
+
+		Serial.printf("%s %s: %d in %lu ms\n", request->method, request->url.c_str(), httpCode, latency);
+
+		if (request->callback)
+		{
+			currentETag = etag;
+			request->callback(httpCode, body, request->context);
+			currentETag = String();
+		}
+	}
+
+	void finish(Connection* connection, int httpCode)
+	{
+		if (httpCode <= 0 || connection->closeAfter || connection->remaining < 0)
+			connection->client.stop();
+		else if (connection->keptAlive)
+			reused++;
+
+		connection->state = CONNECTION_IDLE;
+		connection->lastUsed = millis();
+
+		// Callback may queue new requests, so connection is released first
+		Request request = connection->request;
+		String body = connection->body;
+		String etag = connection->etag;
+		connection->request.url = String();
+		connection->request.payload = String();
+		connection->request.etag = String();
+		connection->body = String();
+		connection->line = String();
+		connection->etag = String();
+
+		if (!connection->completed)
+			complete(&request, httpCode, body, etag);
+	}
+
+	// Write request to the connection, opening it if needed
+	bool send(Connection* connection)
+	{
+		Request* request = &connection->request;
+
+		connection->keptAlive = connection->client.connected();
+		if (!connection->keptAlive)
+		{
+			String host = String(connection->host);
+			int colon = host.indexOf(':');
+			uint16_t port = (colon < 0) ? 80 : host.substring(colon + 1).toInt();
+			if (colon >= 0)
+				host = host.substring(0, colon);
+
+			// SDK lookup waits 10 s by default
+			IPAddress address;
+			if (!WiFi.hostByName(host.c_str(), address, HTTP_DNS_TIMEOUT))
+				return false;
+
+			connection->client.setTimeout(HTTP_CONNECT_TIMEOUT);
+			if (!connection->client.connect(address, port))
+				return false;
+			connection->client.setNoDelay(true);
+		}
+
+		String message =
+			String(request->method) + " " + getPath(request->url) + " HTTP/1.1\r\n" +
+			"Host: " + String(connection->host) + "\r\n" +
+			"Connection: keep-alive\r\n";
+		if (request->etag.length())
+			message += "If-None-Match: " + request->etag + "\r\n";
+		if (request->payload.length())
+			message +=
+				String("Content-Type: application/json\r\n") +
+				"Content-Length: " + String(request->payload.length()) + "\r\n";
+		message += "\r\n";
+		message += request->payload;
+
+		return connection->client.print(message) == message.length();
+	}
+
+	void start(Connection* connection)
+	{
+		connection->state = CONNECTION_STATUS;
+		connection->sentAt = millis();
+		connection->httpCode = 0;
+		connection->remaining = -1;
+		connection->chunked = false;
+		connection->closeAfter = false;
+		connection->completed = false;
+		connection->line = String();
+		connection->body = String();
+		connection->etag = String();
+
+		bool sent = send(connection);
+		if (!sent && connection->keptAlive)
+		{
+			// Server has closed idle connection, go with a new one
+			connection->client.stop();
+			sent = send(connection);
+		}
+
+		if (!sent)
+			finish(connection, HTTPC_ERROR_CONNECTION_REFUSED);
+	}
+
+	// Status, header or chunk size line is received
+	void handleLine(Connection* connection)
+	{
+		String& line = connection->line;
+
+		switch (connection->state)
+		{
+			case CONNECTION_STATUS:
+				// HTTP/1.1 200 OK
+				connection->httpCode = line.substring(9, 12).toInt();
+				connection->state = CONNECTION_HEADERS;
+				break;
+
+			case CONNECTION_HEADERS:
+				if (line.length())
+				{
+					// ETag value is case sensitive, taken before lowercasing
+					if (line.substring(0, 5).equalsIgnoreCase("etag:"))
+					{
+						int start = 5;
+						while (' ' == line.charAt(start))
+							start++;
+						connection->etag = line.substring(start);
+					}
+
+					line.toLowerCase();
+					if (line.startsWith("content-length:"))
+						connection->remaining = line.substring(15).toInt();
+					else if (line.startsWith("transfer-encoding:") && line.indexOf("chunked") > 0)
+						connection->chunked = true;
+					else if (line.startsWith("connection:") && line.indexOf("close") > 0)
+						connection->closeAfter = true;
+				}
+				else if (100 == connection->httpCode)
+				{
+					// 100 Continue, real status follows
+					connection->remaining = -1;
+					connection->state = CONNECTION_STATUS;
+				}
+				else if (connection->chunked)
+				{
+					connection->state = CONNECTION_CHUNK_SIZE;
+				}
+				else if (0 == connection->remaining ||
+					204 == connection->httpCode || 304 == connection->httpCode)
+				{
+					connection->remaining = 0;
+					finish(connection, connection->httpCode);
+				}
+				else
+				{
+					connection->state = CONNECTION_BODY;
+				}
+				break;
+
+			case CONNECTION_CHUNK_SIZE:
+				connection->remaining = strtol(line.c_str(), NULL, 16);
+				connection->state = connection->remaining
+					? CONNECTION_CHUNK_DATA
+					: CONNECTION_TRAILER;
+				break;
+
+			case CONNECTION_CHUNK_END:
+				connection->state = CONNECTION_CHUNK_SIZE;
+				break;
+
+			case CONNECTION_TRAILER:
+				if (!line.length())
+					finish(connection, connection->httpCode);
+				break;
+
+			default:
+				break;
+		}
+		line = String();
+	}
+
+	// Body char to filter or to the body string
+	void consume(Connection* connection, char c)
+	{
+		Request* request = &connection->request;
+
+		if (!request->filter)
+			connection->body += c;
+		else if (!connection->completed && request->filter(c, request->context))
+		{
+			connection->completed = true;
+			complete(request, connection->httpCode, String(), connection->etag);
+		}
+	}
+
+	// Take whatever has arrived, never wait
+	void receive(Connection* connection)
+	{
+		uint8_t buffer[READ_BUFFER_LEN];
+
+		while (CONNECTION_IDLE != connection->state && connection->client.available())
+		{
+			int count = connection->client.read(buffer,
+				min((size_t)connection->client.available(), sizeof(buffer)));
+
+			for (int i = 0; i < count && CONNECTION_IDLE != connection->state; i++)
+			{
+				char c = buffer[i];
+				switch (connection->state)
+				{
+					case CONNECTION_BODY:
+					case CONNECTION_CHUNK_DATA:
+						consume(connection, c);
+						if (connection->remaining > 0 && 0 == --connection->remaining)
+						{
+							if (CONNECTION_BODY == connection->state)
+								finish(connection, connection->httpCode);
+							else
+								connection->state = CONNECTION_CHUNK_END;
+						}
+						break;
+
+					default:
+						if ('\n' == c)
+							handleLine(connection);
+						else if ('\r' != c && connection->line.length() < MAX_LINE_LEN)
+							connection->line += c;
+						break;
+				}
+			}
+		}
+
+		if (CONNECTION_IDLE == connection->state)
+			return;
+
+		if (!connection->client.connected() && !connection->client.available())
+		{
+			if (CONNECTION_BODY == connection->state && connection->remaining < 0)
+			{
+				// Body till connection close
+				finish(connection, connection->httpCode);
+			}
+			else if (connection->keptAlive && CONNECTION_STATUS == connection->state &&
+				!connection->line.length())
+			{
+				// Closed by server before we sent, try again with a new one
+				connection->client.stop();
+				start(connection);
+			}
+			else
+			{
+				finish(connection, HTTPC_ERROR_CONNECTION_LOST);
+			}
+		}
+		else if (millis() - connection->sentAt > HTTP_TIMEOUT)
+		{
+			finish(connection, HTTPC_ERROR_READ_TIMEOUT);
+		}
+	}
+
+	// Connection to the host if idle, or the least recently used idle one to
+	// reconnect. NULL if the host connection is busy or no idle connections.
+	Connection* getConnection(const String& host)
+	{
+		Connection* lru = NULL;
+		for (uint8_t i = 0; i < HTTP_POOL_SIZE; i++)
+		{
+			if (host == pool[i].host)
+				return (CONNECTION_IDLE == pool[i].state) ? &pool[i] : NULL;
+			if (CONNECTION_IDLE == pool[i].state && (!lru || pool[i].lastUsed < lru->lastUsed))
+				lru = &pool[i];
+		}
+
+		if (lru)
+		{
+			lru->client.stop();
+			host.toCharArray(lru->host, HOST_LEN + 1);
+		}
+		return lru;
+	}
+
+	void update()
+	{
+		for (uint8_t i = 0; i < HTTP_POOL_SIZE; i++)
+			if (CONNECTION_IDLE != pool[i].state)
+				receive(&pool[i]);
+
+		// Dispatch queue, requests to busy hosts go back in the same order
+		for (uint8_t count = queueCount; count > 0; count--)
+		{
+			Request* request = &queue[queueHead];
+			queueHead = (queueHead + 1) % HTTP_QUEUE_SIZE;
+			queueCount--;
+
+			if (WL_CONNECTED != WiFi.status())
+			{
+				Request failedRequest = *request;
+				complete(&failedRequest, HTTPC_ERROR_NOT_CONNECTED, String(), String());
+				continue;
+			}
+
+			Connection* connection = getConnection(getHost(request->url));
+			if (connection)
+			{
+				connection->request = *request;
+				start(connection);
+			}
+			else
+			{
+				queue[(queueHead + queueCount++) % HTTP_QUEUE_SIZE] = *request;
+			}
+		}
+	}
+
+	bool busy()
+	{
+		if (queueCount)
+			return true;
+
+		for (uint8_t i = 0; i < HTTP_POOL_SIZE; i++)
+			if (CONNECTION_IDLE != pool[i].state)
+				return true;
+
+		return false;
+	}
+
+	String getStatistics()
+	{
+		return
+			String("{ ") +
+				"\"Requests\" : " + String(requests) + ", " +
+				"\"Failed\" : " + String(failed) + ", " +
+				"\"ReuseRatio\" : " + String(requests ? (float)reused / requests : 0.0, 2) + ", " +
+				"\"AverageLatency\" : " + String(requests ? totalLatency / requests : 0) + ", " +
+				"\"MaxLatency\" : " + String(maxLatency) +
+			" }";
+	}
+}
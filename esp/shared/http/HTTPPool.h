@@ -0,0 +1,45 @@
+#ifndef HTTP_POOL_H
+#define HTTP_POOL_H
+
+#include <Arduino.h>
+
+namespace HTTPPool
+{
+	// Called from update() once request is done. @httpCode is HTTP code or
+	// negative HTTPC_ERROR_* code, @body is the response body.
+	typedef void (*ResponseCallback)(int httpCode, const String& body, void* context);
+
+	// Takes response body char by char instead of keeping it, returns true
+	// when it has got all it needs, so the callback is called right away.
+	typedef bool (*BodyFilter)(char c, void* context);
+
+	// Queue HTTP GET @url. Returns false if the queue is full. With @filter
+	// the body is passed to it and the callback gets it empty.
+	bool GET(const String& url, ResponseCallback callback = NULL, void* context = NULL,
+		BodyFilter filter = NULL);
+
+	// Queue conditional HTTP GET @url, sent with If-None-Match @etag unless
+	// it is empty. 304 means it is the same, the callback gets no body then.
+	bool GET(const String& url, const String& etag, ResponseCallback callback,
+		void* context = NULL);
+
+	// ETag of the response, only valid in the callback.
+	const String& getETag();
+
+	// Queue HTTP POST of JSON @payload to @url. Returns false if the queue is full.
+	bool POST(const String& url, const String& payload,
+		ResponseCallback callback = NULL, void* context = NULL);
+
+	// Sends queued requests, receives responses and fires callbacks. Never
+	// waits for responses, only opening a connection blocks: up to 250 ms
+	// for DNS lookup and 250 ms for TCP connect. Call from loop().
+	void update();
+
+	// True if there are requests queued or in flight.
+	bool busy();
+
+	// Outbound requests statistics as JSON object.
+	String getStatistics();
+}
+
+#endif
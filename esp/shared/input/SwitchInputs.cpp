@@ -0,0 +1,157 @@
+/*
+How it works:
+
+Each input pin has a CHANGE interrupt. The handler only puts the edge (line,
+level, time in microseconds) to a ring buffer and returns. There is one
+producer (GPIO interrupts don't nest) and one consumer (loop()), so head is
+only written by the handler and tail only by loop(), no locking needed.
+When the buffer is full the edge is dropped and counted, the level is read
+again after debounce anyway.
+
+update() takes the edges out. The first edge starts settling of its line,
+every next one (contact bounce) pushes the end of settling further. Once
+the line has been quiet for INPUT_DEBOUNCE the pin is read and, if the level
+differs from the debounced one, the callback is fired. A short spike that
+leaves the level as it was is counted as a glitch.
+
+Latency is measured from the first edge to the callback return, i.e. till
+the output has been switched. Nothing is polled between edges.
+*/
+#include <SwitchInputs.h>
+
+#define EDGE_QUEUE_LEN		32		// power of 2
+
+namespace SwitchInputs
+{
+	struct Edge
+	{
+		uint8_t		line;
+		uint8_t		level;
+		uint32_t	time;			// us
+	};
+
+	struct Line
+	{
+		int		pin;
+		int		level;			// debounced
+		bool		settling;
+		uint32_t	firstEdge;		// us
+		uint32_t	lastEdge;		// us
+	};
+
+	volatile Edge edges[EDGE_QUEUE_LEN];
+	volatile uint8_t head = 0;			// written by interrupts
+	volatile uint8_t tail = 0;			// written by update()
+	volatile uint32_t dropped = 0;
+
+	Line lines[SWITCH_INPUTS_MAX];
+	uint8_t lineCount = 0;
+	ChangeCallback callback = NULL;
+
+	// Statistics
+	uint32_t edgeCount = 0;
+	uint32_t changes = 0;
+	uint32_t glitches = 0;
+	uint32_t latencySum = 0;		// us
+	uint32_t latencyMax = 0;		// us
+
+	void ICACHE_RAM_ATTR pushEdge(uint8_t line)
+	{
+		uint8_t next = (head + 1) & (EDGE_QUEUE_LEN - 1);
+		if (next == tail)
+		{
+			dropped++;
+			return;
+		}
+
+		edges[head].line = line;
+		edges[head].level = digitalRead(lines[line].pin);
+		edges[head].time = micros();
+		head = next;
+	}
+
+	template <uint8_t line> void ICACHE_RAM_ATTR onEdge()
+	{
+		pushEdge(line);
+	}
+
+	void (*const handlers[SWITCH_INPUTS_MAX])() =
+	{
+		onEdge<0>, onEdge<1>, onEdge<2>, onEdge<3>
+	};
+
+	void init(const int* pins, uint8_t count, ChangeCallback callback)
+	{
+		SwitchInputs::callback = callback;
+		lineCount = min(count, (uint8_t)SWITCH_INPUTS_MAX);
+
+		for (uint8_t i = 0; i < lineCount; i++)
+		{
+			lines[i].pin = pins[i];
+			lines[i].settling = false;
+			pinMode(pins[i], INPUT);
+			lines[i].level = digitalRead(pins[i]);
+			attachInterrupt(digitalPinToInterrupt(pins[i]), handlers[i], CHANGE);
+		}
+	}
+
+	void update()
+	{
+		while (tail != head)
+		{
+			Line* line = &lines[edges[tail].line];
+			uint32_t time = edges[tail].time;
+			tail = (tail + 1) & (EDGE_QUEUE_LEN - 1);
+
+			if (!line->settling)
+			{
+				line->settling = true;
+				line->firstEdge = time;
+			}
+			line->lastEdge = time;
+			edgeCount++;
+		}
+
+		for (uint8_t i = 0; i < lineCount; i++)
+		{
+			Line* line = &lines[i];
+			if (!line->settling || micros() - line->lastEdge < INPUT_DEBOUNCE * 1000L)
+				continue;
+
+			line->settling = false;
+			int level = digitalRead(line->pin);
+			if (level == line->level)
+			{
+				glitches++;
+				continue;
+			}
+
+			line->level = level;
+			if (callback)
+				callback(i, level);
+
+			uint32_t latency = micros() - line->firstEdge;
+			latencySum += latency;
+			latencyMax = max(latencyMax, latency);
+			changes++;
+		}
+	}
+
+	int getLevel(uint8_t line)
+	{
+		return line < lineCount ? lines[line].level : LOW;
+	}
+
+	String getStatistics()
+	{
+		return
+			String("{ ") +
+				"\"Edges\" : " + String(edgeCount) + ", " +
+				"\"Changes\" : " + String(changes) + ", " +
+				"\"Glitches\" : " + String(glitches) + ", " +
+				"\"Dropped\" : " + String(dropped) + ", " +
+				"\"LatencyAvg\" : " + String(changes ? latencySum / changes : 0) + ", " +
+				"\"LatencyMax\" : " + String(latencyMax) +
+			" }";
+	}
+}
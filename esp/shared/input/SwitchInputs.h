@@ -0,0 +1,29 @@
+#ifndef SWITCH_INPUTS_H
+#define SWITCH_INPUTS_H
+
+#include <Arduino.h>
+
+#define SWITCH_INPUTS_MAX	4
+#define INPUT_DEBOUNCE		5		// ms input has to be stable
+
+namespace SwitchInputs
+{
+	// Called from update() once input @line has settled at a new @level.
+	typedef void (*ChangeCallback)(uint8_t line, int level);
+
+	// Watch @count of @pins (up to SWITCH_INPUTS_MAX) by pin change
+	// interrupts.
+	void init(const int* pins, uint8_t count, ChangeCallback callback);
+
+	// Debounces edges queued by interrupts and fires the callback. Call
+	// from loop().
+	void update();
+
+	// Debounced level of @line.
+	int getLevel(uint8_t line);
+
+	// Edges, changes and input to output latency (us) as JSON object.
+	String getStatistics();
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+How it works:
+
+Every device queues the same slow HTTP actions (WiFi reconnect, OTA update
+check) and serves their status at JOBS_PATH<id>, so the replies and the
+jobs are here. OTA check runs as a task after its job returns, the job is
+deferred and JobQueue::finish() is called with the check result.
+*/
+#include <DeviceJobs.h>
+#include <WiFiManager.h>
+#include <OTA.h>
+
+#define TEXT_PLAIN		"text/plain"
+#define APPLICATION_JSON	"application/json"
+
+namespace DeviceJobs
+{
+	ESP8266WebServer* server = NULL;
+
+	// Update check to run
+	int firmwareVersion;
+	const char* repositoryBaseUrl;
+
+	void init(ESP8266WebServer* server)
+	{
+		DeviceJobs::server = server;
+	}
+
+	void accept(const char* name, JobQueue::Job job, void* context)
+	{
+		uint16_t id = JobQueue::enqueue(name, job, context);
+		if (!id)
+		{
+			server->send(503, TEXT_PLAIN, "Job queue is full, try later.\r\n");
+			return;
+		}
+		server->sendHeader("Location", String(JOBS_PATH) + id);
+		server->send(202, APPLICATION_JSON, JobQueue::accepted(id) + "\r\n");
+	}
+
+	// Update check is over, so is its job
+	void onUpdateChecked(bool ok, void* context)
+	{
+		JobQueue::finish((uint16_t)(uintptr_t)context, ok);
+	}
+
+	void checkSoftwareUpdates(void* context)
+	{
+		uint16_t id = JobQueue::defer();
+		updateAll(firmwareVersion, getSPIFFSVersion(), repositoryBaseUrl,
+			onUpdateChecked, (void*)(uintptr_t)id);
+	}
+
+	void acceptUpdateCheck(int firmwareVersion, const char* repositoryBaseUrl)
+	{
+		DeviceJobs::firmwareVersion = firmwareVersion;
+		DeviceJobs::repositoryBaseUrl = repositoryBaseUrl;
+		accept("checkSoftwareUpdates", checkSoftwareUpdates);
+	}
+
+	bool handleStatus()
+	{
+		String path = server->uri();
+		if (!path.startsWith(JOBS_PATH))
+			return false;
+
+		String reply;
+		int code = JobQueue::getStatus(path, &reply);
+		server->send(code, APPLICATION_JSON, reply + "\r\n");
+		return true;
+	}
+
+	void handleNotFound()
+	{
+		if (!handleStatus())
+			server->send(404, TEXT_PLAIN, "Not found.\r\n");
+	}
+
+	void reconnectWiFi(void* context)
+	{
+		WiFi.disconnect();
+		WiFiManager::handleWiFiConnectivity();
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef DEVICE_JOBS_H
+#define DEVICE_JOBS_H
+
+#include <Arduino.h>
+#include <ESP8266WebServer.h>
+#include <JobQueue.h>
+
+// HTTP side of JobQueue and the jobs every device has.
+namespace DeviceJobs
+{
+	// Jobs are accepted and their status is served on @server.
+	void init(ESP8266WebServer* server);
+
+	// Queues @job and replies 202 Accepted with its id, 503 if the queue
+	// is full. The client polls JOBS_PATH<id> for the job status.
+	void accept(const char* name, JobQueue::Job job, void* context = NULL);
+
+	// Queues OTA update check of @firmwareVersion from @repositoryBaseUrl,
+	// replies as accept() does. The job is over when the check is.
+	void acceptUpdateCheck(int firmwareVersion, const char* repositoryBaseUrl);
+
+	// Replies the job status if the request is for JOBS_PATH<id>, false if
+	// it is not.
+	bool handleStatus();
+
+	// HTTP GET /jobs/<id>, anything else is not found. For onNotFound().
+	void handleNotFound();
+
+	// Job: reconnect WiFi, e.g. with new credentials.
+	void reconnectWiFi(void* context);
+}
+
+#endif
@@ -0,0 +1,212 @@
+/*
+How it works:
+
+HTTP handlers that would take long (OTA check, WiFi reconnect) queue the work
+here and reply 202 Accepted with the job id right away, so the request takes
+the same time whatever the job does. update() from loop() runs queued jobs
+in order, one per loop, after the handler's response is out. A job that
+goes on after it returns (a task waiting for a response) calls defer() and
+reports its result by finish() later, till then it is running.
+
+Jobs are kept in JOBS_LEN records, finished ones (done or failed) stay for status polling
+at JOBS_PATH<id> till the record is taken by a new job, oldest first. A job
+can only be queued while there is a record that is finished, so nothing
+waiting or running is ever dropped. Ids go up from 1, so an old id never shows someone
+else's job.
+*/
+#include <JobQueue.h>
+
+#define JOBS_LEN		6
+
+namespace JobQueue
+{
+	enum JobState
+	{
+		JOB_FREE,
+		JOB_QUEUED,
+		JOB_RUNNING,			// deferred, till finish()
+		JOB_DONE,
+		JOB_FAILED
+	};
+
+	struct Record
+	{
+		uint16_t		id;
+		const char*		name;
+		Job			job;
+		void*			context;
+		JobState		state;
+		bool			deferred;
+		unsigned long		queuedAt;	// ms
+		unsigned long		startedAt;	// ms
+		unsigned long		waited;		// ms in the queue
+		unsigned long		took;		// ms running
+	};
+
+	Record records[JOBS_LEN];
+	uint16_t lastId = 0;
+	Record* current = NULL;		// job update() is running
+
+	// statistics
+	unsigned long queued = 0;
+	unsigned long refused = 0;
+	unsigned long failed = 0;
+	unsigned long maxWait = 0;
+	unsigned long maxRun = 0;
+
+	Record* find(uint16_t id)
+	{
+		for (uint8_t i = 0; i < JOBS_LEN; i++)
+			if (records[i].state != JOB_FREE && records[i].id == id)
+				return &records[i];
+		return NULL;
+	}
+
+	bool isFinished(Record* record)
+	{
+		return record->state == JOB_DONE || record->state == JOB_FAILED;
+	}
+
+	void setTook(Record* record)
+	{
+		record->took = millis() - record->startedAt;
+		maxRun = max(maxRun, record->took);
+	}
+
+	uint16_t enqueue(const char* name, Job job, void* context)
+	{
+		// free record, or the one done longest ago
+		Record* record = NULL;
+		for (uint8_t i = 0; i < JOBS_LEN; i++)
+		{
+			Record* r = &records[i];
+			if (r->state == JOB_FREE)
+			{
+				record = r;
+				break;
+			}
+			if (isFinished(r) && (!record || (uint16_t)(r->id - record->id) > 0x8000))
+				record = r;
+		}
+
+		if (!record)
+		{
+			Serial.printf("Job %s refused, queue is full.\n", name);
+			refused++;
+			return 0;
+		}
+
+		if (++lastId == 0)
+			lastId = 1;
+
+		record->id = lastId;
+		record->name = name;
+		record->job = job;
+		record->context = context;
+		record->state = JOB_QUEUED;
+		record->deferred = false;
+		record->queuedAt = millis();
+		record->waited = record->took = 0;
+		queued++;
+
+		Serial.printf("Job %u queued: %s\n", record->id, name);
+		return record->id;
+	}
+
+	void update()
+	{
+		// oldest queued first
+		Record* next = NULL;
+		for (uint8_t i = 0; i < JOBS_LEN; i++)
+		{
+			Record* r = &records[i];
+			if (r->state == JOB_QUEUED && (!next || (uint16_t)(r->id - next->id) > 0x8000))
+				next = r;
+		}
+		if (!next)
+			return;
+
+		next->startedAt = millis();
+		next->waited = next->startedAt - next->queuedAt;
+		maxWait = max(maxWait, next->waited);
+
+		// done before it runs: a job may restart the device or queue another
+		next->state = JOB_DONE;
+		current = next;
+		next->job(next->context);
+		current = NULL;
+
+		// deferred one is timed by finish()
+		if (next->deferred)
+			return;
+
+		setTook(next);
+		Serial.printf("Job %u done in %lu ms: %s\n", next->id, next->took, next->name);
+	}
+
+	uint16_t defer()
+	{
+		if (!current)
+			return 0;
+
+		current->deferred = true;
+		current->state = JOB_RUNNING;
+		return current->id;
+	}
+
+	void finish(uint16_t id, bool ok)
+	{
+		Record* record = find(id);
+		if (!record || record->state != JOB_RUNNING)
+			return;
+
+		record->state = ok ? JOB_DONE : JOB_FAILED;
+		if (!ok)
+			failed++;
+		setTook(record);
+		Serial.printf("Job %u %s in %lu ms: %s\n", record->id, ok ? "done" : "failed",
+			record->took, record->name);
+	}
+
+	bool busy()
+	{
+		for (uint8_t i = 0; i < JOBS_LEN; i++)
+			if (records[i].state == JOB_QUEUED)
+				return true;
+		return false;
+	}
+
+	String accepted(uint16_t id)
+	{
+		return String("{ \"Id\" : ") + id + ", \"Status\" : \"" + JOBS_PATH + id + "\" }";
+	}
+
+	int getStatus(const String& path, String* reply)
+	{
+		long id = path.substring(strlen(JOBS_PATH)).toInt();
+		Record* record = (id > 0 && id <= 0xFFFF) ? find(id) : NULL;
+		if (!record)
+		{
+			*reply = String("{ \"Error\" : \"No such job.\" }");
+			return 404;
+		}
+
+		const char* states[] = { "Free", "Queued", "Running", "Done", "Failed" };
+		*reply = String("{ \"Id\" : ") + record->id + ", " +
+			"\"Name\" : \"" + record->name + "\", " +
+			"\"State\" : \"" + states[record->state] + "\", " +
+			"\"Waited\" : " + record->waited + ", " +
+			"\"Took\" : " + record->took + " }";
+		return 200;
+	}
+
+	String getStatistics()
+	{
+		return String("{ ") +
+			"\"Queued\" : " + queued + ", " +
+			"\"Refused\" : " + refused + ", " +
+			"\"Failed\" : " + failed + ", " +
+			"\"WaitMax\" : " + maxWait + ", " +
+			"\"RunTimeMax\" : " + maxRun + " }";
+	}
+}
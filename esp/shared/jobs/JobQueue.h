@@ -0,0 +1,41 @@
+#ifndef JOB_QUEUE_H
+#define JOB_QUEUE_H
+
+#include <Arduino.h>
+
+#define JOBS_PATH		"/jobs/"	// job status is at JOBS_PATH<id>
+
+namespace JobQueue
+{
+	// Slow work an HTTP handler shouldn't do itself.
+	typedef void (*Job)(void* context);
+
+	// Queue @job to run from update(), @name is shown in its status.
+	// Returns job id, 0 if the queue is full.
+	uint16_t enqueue(const char* name, Job job, void* context = NULL);
+
+	// Runs the next queued job, one per call. Call from loop().
+	void update();
+
+	// True if there are jobs queued.
+	bool busy();
+
+	// Called by a running job that goes on after it returns, e.g. as a
+	// task: the job is running till finish() is called. Returns job id.
+	uint16_t defer();
+
+	// Deferred job @id is over, @ok is false if it has failed.
+	void finish(uint16_t id, bool ok);
+
+	// Body of 202 Accepted reply for job @id.
+	String accepted(uint16_t id);
+
+	// Status of the job HTTP @path refers to, JOBS_PATH<id>. Returns HTTP
+	// code, 404 if there is no such job or it is forgotten already.
+	int getStatus(const String& path, String* reply);
+
+	// Jobs statistics as JSON object.
+	String getStatistics();
+}
+
+#endif
@@ -0,0 +1,209 @@
+/*
+How it works:
+
+The filter is a minimal JSON tokenizer that doesn't build anything. It keeps
+track of the nesting depth (with object/array bit per level) and how many
+leading keys of the path are matched. A key is compared against the next
+path key char by char while it comes, only when it is right at the level of
+the matched part. Matched key followed by an object goes one path key deeper,
+closing this object goes back, so a sibling object with the same key doesn't
+match.
+
+Once the last path key is matched its value (number, string, true/false/null)
+is collected to the buffer and feed() starts returning true. Values of the
+path key that are objects or arrays are not collected.
+*/
+#include <JSONPathFilter.h>
+
+JSONPathFilter::JSONPathFilter(const char* path) : path(path)
+{
+	segments = 1;
+	for (const char* p = path; *p; p++)
+		if ('.' == *p)
+			segments++;
+
+	reset();
+}
+
+void JSONPathFilter::reset()
+{
+	depth = 0;
+	objects = 0;
+	matched = 0;
+	inString = false;
+	escape = false;
+	expectKey = false;
+	keyCandidate = false;
+	keyPosition = 0;
+	valueCandidate = false;
+	capturing = false;
+	done = false;
+	length = 0;
+	buffer[0] = '\0';
+}
+
+// Path key by @index and its @length.
+const char* JSONPathFilter::segment(uint8_t index, uint8_t* length)
+{
+	const char* start = path;
+	while (index--)
+		start = strchr(start, '.') + 1;
+
+	const char* end = strchr(start, '.');
+	*length = end ? end - start : strlen(start);
+	return start;
+}
+
+bool JSONPathFilter::isObject()
+{
+	return depth > 0 && depth <= JSON_PATH_MAX_DEPTH && (objects & (1 << (depth - 1)));
+}
+
+bool JSONPathFilter::feed(char c)
+{
+	if (done)
+		return true;
+
+	if (inString)
+	{
+		if (escape)
+			escape = false;
+		else if ('\\' == c)
+		{
+			escape = true;
+			return false;
+		}
+		else if ('"' == c)
+		{
+			inString = false;
+			if (capturing)
+			{
+				done = true;
+			}
+			else if (expectKey)
+			{
+				uint8_t segmentLength;
+				segment(matched, &segmentLength);
+				valueCandidate = keyCandidate && keyPosition == segmentLength;
+				expectKey = false;
+			}
+			return done;
+		}
+
+		if (capturing)
+		{
+			if (length < JSON_VALUE_LEN)
+				buffer[length++] = c;
+			buffer[length] = '\0';
+		}
+		else if (expectKey && keyCandidate)
+		{
+			uint8_t segmentLength;
+			const char* key = segment(matched, &segmentLength);
+			if (keyPosition < segmentLength && key[keyPosition] == c)
+				keyPosition++;
+			else
+				keyCandidate = false;
+		}
+		return false;
+	}
+
+	if (capturing)
+	{
+		// Scalar value goes till delimiter
+		if (',' == c || '}' == c || ']' == c || isspace(c))
+		{
+			done = true;
+			return true;
+		}
+
+		if (length < JSON_VALUE_LEN)
+			buffer[length++] = c;
+		buffer[length] = '\0';
+		return false;
+	}
+
+	if (isspace(c) || ':' == c)
+		return false;
+
+	switch (c)
+	{
+		case ',':
+			expectKey = isObject();
+			valueCandidate = false;
+			return false;
+
+		case '}':
+		case ']':
+			if (depth > 0)
+				depth--;
+			// Matched key objects are at depths 2..matched + 1, leaving
+			// one of them goes back to the key it is the value of
+			if (matched >= depth)
+				matched = depth ? depth - 1 : 0;
+			expectKey = false;
+			valueCandidate = false;
+			return false;
+
+		case '"':
+			inString = true;
+			if (expectKey)
+			{
+				keyCandidate = depth == matched + 1 && matched < segments;
+				keyPosition = 0;
+				return false;
+			}
+			break;
+	}
+
+	// Value starts
+	bool last = matched + 1 == segments;
+	if (valueCandidate && last && '{' != c && '[' != c)
+	{
+		capturing = true;
+		if ('"' != c)
+		{
+			buffer[length++] = c;
+			buffer[length] = '\0';
+		}
+	}
+	else if (valueCandidate && !last && '{' == c)
+	{
+		matched++;
+	}
+	valueCandidate = false;
+
+	if ('{' == c || '[' == c)
+	{
+		depth++;
+		if (depth <= JSON_PATH_MAX_DEPTH)
+		{
+			if ('{' == c)
+				objects |= 1 << (depth - 1);
+			else
+				objects &= ~(1 << (depth - 1));
+		}
+		expectKey = '{' == c;
+	}
+	return false;
+}
+
+bool JSONPathFilter::found()
+{
+	return done;
+}
+
+const char* JSONPathFilter::value()
+{
+	return buffer;
+}
+
+float JSONPathFilter::toFloat()
+{
+	return atof(buffer);
+}
+
+bool JSONPathFilter::filter(char c, void* filter)
+{
+	return ((JSONPathFilter*)filter)->feed(c);
+}
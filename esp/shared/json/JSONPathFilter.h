@@ -0,0 +1,56 @@
+#ifndef JSON_PATH_FILTER_H
+#define JSON_PATH_FILTER_H
+
+#include <Arduino.h>
+
+#define JSON_PATH_MAX_DEPTH	16		// nesting levels tracked
+#define JSON_VALUE_LEN		32		// longest value kept, MD5 hex
+
+// Streaming extractor of a single value from JSON by its object keys path,
+// e.g. "P.sum". JSON is fed char by char as it comes, only the value found
+// is kept, so there is no need to have the whole document in memory.
+class JSONPathFilter
+{
+public:
+	// @path is dot separated keys, has to live as long as the filter.
+	JSONPathFilter(const char* path);
+
+	// Start over for a new document.
+	void reset();
+
+	// Next char of the document. Returns true once the value is complete,
+	// the rest of the document can be skipped then.
+	bool feed(char c);
+
+	// True if the value is found.
+	bool found();
+
+	// Value found as is, without quotes for strings.
+	const char* value();
+	float toFloat();
+
+	// HTTPPool::BodyFilter adapter, @filter is JSONPathFilter*.
+	static bool filter(char c, void* filter);
+
+private:
+	bool isObject();
+	const char* segment(uint8_t index, uint8_t* length);
+
+	const char*	path;
+	uint8_t		segments;		// keys in the path
+	uint8_t		depth;			// current nesting
+	uint16_t	objects;		// bit per level, 1 for object, 0 for array
+	uint8_t		matched;		// leading path keys matched so far
+	bool		inString;
+	bool		escape;
+	bool		expectKey;		// next string is an object key
+	bool		keyCandidate;		// current key may be the next path key
+	uint8_t		keyPosition;
+	bool		valueCandidate;		// next value is at matched key
+	bool		capturing;
+	bool		done;
+	char		buffer[JSON_VALUE_LEN + 1];
+	uint8_t		length;
+};
+
+#endif
@@ -0,0 +1,202 @@
+/*
+How it works:
+
+A line change to propagate becomes the pending state of its link, a newer
+change just replaces it (coalesced). update() sends the pending state by
+HTTPPool as
+
+	GET http://<address>/ChangeLine?line=<n>&state=<0|1>&origin=<node>&boot=<id>&seq=<n>
+
+one request per link at a time. Pending state that the peer already has is
+not sent at all, so on-off-on toggles before the send cost nothing. A failed
+request puts its state back to pending unless there is a newer one, and the
+link waits LINK_RETRY_MIN, doubled with every failure up to LINK_RETRY_MAX.
+
+Changes made on this switch are tagged with its node id, boot id and a
+sequence number. A switch applying a remote change passes its tag along when
+propagating it further. So when the change comes back (mutually linked
+switches, rings) its origin is the receiver itself and it is dropped as an
+echo instead of bouncing forever. The last sequence seen from each origin
+is kept to drop repeated or reordered changes as well.
+
+Sequence starts from 1 again after reboot, while peers still have the last
+one from before. Boot id is random on every boot: a change with a new boot
+id of the origin is taken and its sequence is followed from then on.
+*/
+#include <LinkedLines.h>
+#include <HTTPPool.h>
+
+LinkedLines::LinkedLines(uint32_t node, uint32_t boot)
+{
+	this->node = node;
+	this->boot = boot;
+	seq = 0;
+	nextOrigin = 0;
+	sent = coalesced = echoes = repeated = restarted = failed = 0;
+
+	memset(origins, 0, sizeof(origins));
+	memset(originBoots, 0, sizeof(originBoots));
+	memset(originSeqs, 0, sizeof(originSeqs));
+	for (uint8_t i = 0; i < LINK_MAX_LINES; i++)
+	{
+		links[i].owner = this;
+		links[i].sending = -1;
+		setLink(i, NULL, 0);
+	}
+}
+
+void LinkedLines::setLink(uint8_t line, const char* address, int remoteLine)
+{
+	if (line >= LINK_MAX_LINES)
+		return;
+
+	Link* link = &links[line];
+	link->address = address;
+	link->remoteLine = remoteLine;
+	link->pending = -1;
+	link->delivered = -1;
+	link->failures = 0;
+	link->retryAt = millis();
+	// request in flight, if any, completes into the new link state
+}
+
+void LinkedLines::propagate(uint8_t line, int state, uint32_t origin, uint32_t boot,
+	uint32_t seq)
+{
+	if (line >= LINK_MAX_LINES)
+		return;
+
+	Link* link = &links[line];
+	if (!link->address || !link->address[0])
+		return;
+
+	if (link->pending >= 0)
+		coalesced++;
+
+	link->pending = state ? 1 : 0;
+	link->origin = origin ? origin : node;
+	link->boot = origin ? boot : this->boot;
+	link->seq = origin ? seq : ++this->seq;
+}
+
+bool LinkedLines::accept(uint32_t origin, uint32_t boot, uint32_t seq)
+{
+	if (!origin)
+		return true;
+
+	if (origin == node)
+	{
+		echoes++;
+		return false;
+	}
+
+	for (uint8_t i = 0; i < LINK_ORIGINS; i++)
+	{
+		if (origins[i] != origin)
+			continue;
+
+		if (originBoots[i] != boot)
+		{
+			// Origin has restarted, its sequence too
+			restarted++;
+			originBoots[i] = boot;
+			originSeqs[i] = seq;
+			return true;
+		}
+
+		if ((int32_t)(seq - originSeqs[i]) <= 0)
+		{
+			repeated++;
+			return false;
+		}
+		originSeqs[i] = seq;
+		return true;
+	}
+
+	// New origin takes the oldest slot
+	origins[nextOrigin] = origin;
+	originBoots[nextOrigin] = boot;
+	originSeqs[nextOrigin] = seq;
+	nextOrigin = (nextOrigin + 1) % LINK_ORIGINS;
+	return true;
+}
+
+void LinkedLines::send(Link* link)
+{
+	String url =
+		String("http://") + link->address + CHANGE_LINE_METHOD +
+		"?line=" + String(link->remoteLine) +
+		"&state=" + String(link->pending) +
+		"&origin=" + String(link->origin) +
+		"&boot=" + String(link->boot) +
+		"&seq=" + String(link->seq);
+
+	Serial.print("Linked update request url: ");
+	Serial.println(url);
+
+	if (!HTTPPool::GET(url, onResponse, link))
+		return;		// queue is full, next update()
+
+	link->sending = link->pending;
+	link->pending = -1;
+	sent++;
+}
+
+void LinkedLines::update()
+{
+	unsigned long now = millis();
+
+	for (uint8_t i = 0; i < LINK_MAX_LINES; i++)
+	{
+		Link* link = &links[i];
+		if (link->pending < 0 || link->sending >= 0 || (long)(now - link->retryAt) < 0)
+			continue;
+
+		if (link->pending == link->delivered)
+		{
+			link->pending = -1;
+			coalesced++;
+			continue;
+		}
+		send(link);
+	}
+}
+
+void LinkedLines::onResponse(int httpCode, const String& body, void* context)
+{
+	Link* link = (Link*)context;
+	LinkedLines* owner = link->owner;
+	int8_t state = link->sending;
+	link->sending = -1;
+
+	if (200 == httpCode)
+	{
+		link->delivered = state;
+		link->failures = 0;
+		return;
+	}
+
+	owner->failed++;
+	link->delivered = -1;
+	if (link->pending < 0)
+		link->pending = state;
+	if (link->failures < 16)
+		link->failures++;
+	link->retryAt = millis() + min((unsigned long)LINK_RETRY_MIN << (link->failures - 1),
+		(unsigned long)LINK_RETRY_MAX);
+	Serial.printf("Linked update failed (%d), retry in %lu ms.\n", httpCode,
+		link->retryAt - millis());
+}
+
+String LinkedLines::getStatistics()
+{
+	return
+		String("{ ") +
+			"\"Sent\" : " + String(sent) + ", " +
+			"\"Coalesced\" : " + String(coalesced) + ", " +
+			"\"Failed\" : " + String(failed) + ", " +
+			"\"Echoes\" : " + String(echoes) + ", " +
+			"\"Repeated\" : " + String(repeated) + ", " +
+			"\"Restarted\" : " + String(restarted) +
+		" }";
+}
@@ -0,0 +1,81 @@
+#ifndef LINKED_LINES_H
+#define LINKED_LINES_H
+
+#include <Arduino.h>
+
+#define LINK_MAX_LINES		4
+#define LINK_ORIGINS		8		// remote origins remembered
+#define LINK_RETRY_MIN		1000		// first retry, ms
+#define LINK_RETRY_MAX		(60000L)	// ms
+#define CHANGE_LINE_METHOD	"/ChangeLine"
+
+// Propagates line changes to linked switches. Changes are sent
+// asynchronously, rapid toggles are coalesced, failed peers are retried with
+// backoff. Each change is tagged with its origin node, boot and sequence,
+// so a change coming back through a chain of links is recognised as an echo.
+class LinkedLines
+{
+public:
+	// @node is this switch id (chip id), not 0. @boot is different on every
+	// boot (random), so peers don't take the restarted sequence as repeated.
+	LinkedLines(uint32_t node, uint32_t boot);
+
+	// Link @line to @remoteLine of switch at @address, empty address (or
+	// NULL) unlinks. @address has to stay valid (e.g. config).
+	void setLink(uint8_t line, const char* address, int remoteLine);
+
+	// @line has been switched to @state, by this switch if @origin is 0,
+	// otherwise by change @seq of @origin node @boot that is passed along.
+	void propagate(uint8_t line, int state, uint32_t origin = 0, uint32_t boot = 0,
+		uint32_t seq = 0);
+
+	// Whether a remote change tagged with @origin, @boot and @seq is to be
+	// applied: not an echo of own change and not seen already. Untagged
+	// changes (@origin 0) are always applied. A new @boot of the origin
+	// starts its sequence again.
+	bool accept(uint32_t origin, uint32_t boot, uint32_t seq);
+
+	// Sends pending changes, retries failed ones. Call from loop().
+	void update();
+
+	// Propagation statistics as JSON object.
+	String getStatistics();
+
+private:
+	struct Link
+	{
+		LinkedLines*	owner;
+		const char*	address;
+		int		remoteLine;
+		int8_t		pending;		// state to send, -1 none
+		int8_t		delivered;		// state peer has, -1 unknown
+		int8_t		sending;		// state in flight, -1 none
+		uint32_t	origin;
+		uint32_t	boot;
+		uint32_t	seq;
+		uint8_t		failures;
+		unsigned long	retryAt;
+	};
+
+	static void onResponse(int httpCode, const String& body, void* context);
+	void send(Link* link);
+
+	uint32_t	node;
+	uint32_t	boot;
+	uint32_t	seq;
+	Link		links[LINK_MAX_LINES];
+	uint32_t	origins[LINK_ORIGINS];
+	uint32_t	originBoots[LINK_ORIGINS];
+	uint32_t	originSeqs[LINK_ORIGINS];
+	uint8_t		nextOrigin;
+
+	// Statistics
+	uint32_t	sent;
+	uint32_t	coalesced;
+	uint32_t	echoes;
+	uint32_t	repeated;
+	uint32_t	restarted;
+	uint32_t	failed;
+};
+
+#endif
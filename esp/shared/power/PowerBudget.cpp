@@ -0,0 +1,607 @@
+/*
+How it works:
+
+Floor heating nodes share one power cap. Each of them reads the meter and
+switches heaters on when there is enough headroom, so two nodes seeing the
+same headroom at the same time could both switch on and overshoot the cap.
+To avoid that, nodes reserve power before closing a relay using UDP multicast
+messages to POWER_BUDGET_GROUP:
+
+	PB1 HELLO <node>			here, every HELLO_EVERY
+	PB1 CLAIM <node> <seq> <watts>		want to switch on
+	PB1 ACK <node> <seq> <from> <watts>	<from> has got the claim, it
+						has <watts> claimed itself
+	PB1 GRANT <node> <seq> <watts>		switched on, lease taken
+	PB1 RELEASE <node> <seq>		claim dropped, not enough power
+
+Node is the chip id. Every node keeps the table of claims and leases it has
+seen. A lease means power that is switched on but may not show up in the
+meter reading yet, it's added on top of the meter reading until a reading
+taken at least LEASE_TTL after it, by that time the meter has caught up
+with it. Local estimate of the house load is only reconciled with the meter
+now and then, so a peer lease is kept until the node has actually read the
+meter (meterRead()) and needsMeterReading() tells the node to do it. If the
+meter is not read at all, the lease goes after LEASE_MAX_AGE, this way a
+lease of a dead node also goes away.
+
+Reservation is multicasted as CLAIM and decided CLAIM_WINDOW later:
+
+	meter + leases + claims counted + watts < max power
+
+Claims of nodes with lower id are counted. Claims of nodes with higher id
+are only counted if they came before the own one: the claims at the same
+time are counted by the node with the higher id.
+
+Meter here is the house load the node estimates when it claims, own
+heaters switched on before are in it already. Own leases only count for
+the claims made before them, these are the claims decided in the same
+batch.
+
+Datagrams get lost, so a claim is only decided once every peer has
+acknowledged it, CLAIM is repeated every CLAIM_RESEND till then and denied
+if it is not acknowledged in CLAIM_TIMEOUT. Peer with a lower id that has
+got our CLAIM while claiming itself doesn't count ours, so its claim that
+comes with ACK is counted even if its CLAIM is lost. Peers are the nodes
+heard in PEER_TTL: each node says HELLO every HELLO_EVERY, answers HELLO of
+a new node, and doesn't claim for LISTEN_TIME after joining the group.
+
+Either GRANT or RELEASE is sent DECISION_COPIES times after the decision
+so that others count or forget the claim. Claim of others that got neither
+in CLAIM_TTL (all lost, or the node died) is taken as granted: its power may
+be on, so it is a lease till the meter shows it.
+*/
+#include <PowerBudget.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+
+#define MAX_LEASES		32		// claims and leases of all nodes
+#define MAX_OWN_CLAIMS		8		// one per heating channel
+#define MAX_PEERS		32		// other nodes sharing the cap
+#define CLAIM_WINDOW		200		// ms, wait for concurrent claims
+#define CLAIM_RESEND		50		// ms, CLAIM repeated till acknowledged
+#define CLAIM_TIMEOUT		1000		// ms, denied if not acknowledged
+#define CLAIM_TTL		(2 * CLAIM_TIMEOUT)	// ms, others claim without GRANT
+#define DECISION_COPIES		3		// GRANT or RELEASE, CLAIM_RESEND apart
+#define LEASE_TTL		(30000L)	// ms, till the meter shows it
+#define LEASE_MAX_AGE		(10 * 60000L)	// ms, meter is not read at all
+#define HELLO_EVERY		(10000L)	// ms
+#define PEER_TTL		(6 * HELLO_EVERY)	// ms, node is gone
+#define LISTEN_TIME		(3 * HELLO_EVERY)	// ms, to know peers after joining
+#define MESSAGE_LEN		64
+
+namespace PowerBudget
+{
+	struct Lease
+	{
+		uint32_t		node;
+		uint16_t		seq;
+		bool			granted;	// false for pending claim
+		float			watts;
+		unsigned long		since;		// claim or lease came
+	};
+
+	struct Claim
+	{
+		uint16_t		seq;
+		float			watts;
+		float			meterPower;
+		float			concurrent;	// claimed by peers with ACK
+		uint32_t		acknowledged;	// bit per peer slot
+		ReserveCallback		callback;
+		void*			context;
+		unsigned long		startedAt;
+		unsigned long		sentAt;
+	};
+
+	struct Decision
+	{
+		uint16_t		seq;
+		bool			granted;
+		float			watts;
+		uint8_t			copies;		// left to send
+		unsigned long		sentAt;
+	};
+
+	struct Peer
+	{
+		uint32_t		node;		// 0 for free slot
+		unsigned long		seenAt;
+	};
+
+	struct State
+	{
+		WiFiUDP			udp;
+		IPAddress		joinedIP;
+		unsigned long		joinedAt;
+		unsigned long		helloAt;
+		uint32_t		nodeId;
+		float			maxPower;
+		uint16_t		seq;
+
+		Lease			leases[MAX_LEASES];
+		uint8_t			leaseCount;
+		Claim			claims[MAX_OWN_CLAIMS];
+		uint8_t			claimCount;
+		Decision		decisions[MAX_OWN_CLAIMS];
+		uint8_t			decisionCount;
+		Peer			peers[MAX_PEERS];
+
+		// Statistics
+		unsigned long		granted;
+		unsigned long		denied;
+		unsigned long		unacknowledged;	// denied, peers didn't ACK
+		unsigned long		promoted;	// claims taken as granted
+	};
+
+	State defaultState;
+	State* s = &defaultState;
+
+	State* newState()
+	{
+		return new State();
+	}
+
+	void select(State* state)
+	{
+		s = state;
+	}
+
+	void init(float maxPower)
+	{
+		s->maxPower = maxPower;
+		s->nodeId = ESP.getChipId();
+	}
+
+	void send(const char* message)
+	{
+		if (!s->joinedIP.isSet())
+			return;
+
+		s->udp.beginPacketMulticast(POWER_BUDGET_GROUP, POWER_BUDGET_PORT, WiFi.localIP());
+		s->udp.print(message);
+		s->udp.endPacket();
+	}
+
+	void sayHello()
+	{
+		char message[MESSAGE_LEN + 1];
+		snprintf(message, sizeof(message), "PB1 HELLO %08x", (unsigned int)s->nodeId);
+		send(message);
+		s->helloAt = millis();
+	}
+
+	// Slot of peer @node, -1 if it is not known. Free slot for 0.
+	int8_t findPeer(uint32_t node)
+	{
+		for (uint8_t i = 0; i < MAX_PEERS; i++)
+			if (s->peers[i].node == node)
+				return i;
+		return -1;
+	}
+
+	// Peer @node is heard, returns its slot, -1 if there is no room.
+	// @added is set if the peer is new.
+	int8_t seen(uint32_t node, bool* added)
+	{
+		int8_t slot = findPeer(node);
+		*added = slot < 0;
+		if (*added)
+		{
+			slot = findPeer(0);
+			if (slot < 0)
+				return -1;
+			s->peers[slot].node = node;
+
+			// New one in the slot has not acknowledged anything yet
+			for (uint8_t i = 0; i < s->claimCount; i++)
+				s->claims[i].acknowledged &= ~(1UL << slot);
+		}
+		s->peers[slot].seenAt = millis();
+		return slot;
+	}
+
+	void expirePeers()
+	{
+		unsigned long now = millis();
+		for (uint8_t i = 0; i < MAX_PEERS; i++)
+			if (s->peers[i].node && now - s->peers[i].seenAt > PEER_TTL)
+				s->peers[i].node = 0;
+	}
+
+	// True if every peer known has got @claim
+	bool isAcknowledged(Claim* claim)
+	{
+		for (uint8_t i = 0; i < MAX_PEERS; i++)
+			if (s->peers[i].node && !(claim->acknowledged & (1UL << i)))
+				return false;
+		return true;
+	}
+
+	Lease* findLease(uint32_t node, uint16_t seq)
+	{
+		for (uint8_t i = 0; i < s->leaseCount; i++)
+			if (s->leases[i].node == node && s->leases[i].seq == seq)
+				return &s->leases[i];
+		return NULL;
+	}
+
+	void removeLease(Lease* lease)
+	{
+		*lease = s->leases[--s->leaseCount];
+	}
+
+	// Add claim or lease, or make the claim a lease
+	void putLease(uint32_t node, uint16_t seq, float watts, bool granted)
+	{
+		Lease* lease = findLease(node, seq);
+		if (lease)
+		{
+			// Repeated CLAIM keeps the time it came first
+			if (lease->granted || !granted)
+				return;
+		}
+		else if (MAX_LEASES == s->leaseCount)
+		{
+			// Replace the oldest one, it is closer to expire anyway
+			lease = &s->leases[0];
+			for (uint8_t i = 1; i < s->leaseCount; i++)
+				if (s->leases[i].since < lease->since)
+					lease = &s->leases[i];
+		}
+		else
+		{
+			lease = &s->leases[s->leaseCount++];
+		}
+
+		lease->node = node;
+		lease->seq = seq;
+		lease->watts = watts;
+		lease->granted = granted;
+		lease->since = millis();
+	}
+
+	void expireLeases()
+	{
+		unsigned long now = millis();
+		for (uint8_t i = 0; i < s->leaseCount; )
+		{
+			Lease* lease = &s->leases[i];
+			if (!lease->granted && now - lease->since > CLAIM_TTL)
+			{
+				// Neither GRANT nor RELEASE has come, the power may be on
+				lease->granted = true;
+				lease->since = now;
+				s->promoted++;
+			}
+
+			// Peer leases wait for the meter, own ones are in the local estimate
+			unsigned long ttl = lease->node == s->nodeId ? LEASE_TTL : LEASE_MAX_AGE;
+			if (now - lease->since > ttl)
+				removeLease(lease);
+			else
+				i++;
+		}
+	}
+
+	// Power of own claims pending
+	float getClaimed()
+	{
+		float claimed = 0;
+		for (uint8_t i = 0; i < s->claimCount; i++)
+			claimed += s->claims[i].watts;
+		return claimed;
+	}
+
+	// Peer @from has got own claim @seq, it has claimed @watts itself
+	void onAcknowledged(uint16_t seq, uint32_t from, float watts)
+	{
+		bool added;
+		int8_t slot = seen(from, &added);
+		if (slot < 0)
+			return;
+
+		for (uint8_t i = 0; i < s->claimCount; i++)
+		{
+			Claim* claim = &s->claims[i];
+			if (claim->seq != seq || (claim->acknowledged & (1UL << slot)))
+				continue;
+
+			claim->acknowledged |= 1UL << slot;
+			if (from < s->nodeId)
+				claim->concurrent += watts;
+		}
+	}
+
+	void onClaim(uint32_t node, uint16_t seq, float watts)
+	{
+		putLease(node, seq, watts, false);
+
+		char message[MESSAGE_LEN + 1];
+		snprintf(message, sizeof(message), "PB1 ACK %08x %u %08x %d",
+			(unsigned int)node, seq, (unsigned int)s->nodeId, (int)getClaimed());
+		send(message);
+	}
+
+	void receive()
+	{
+		while (s->udp.parsePacket())
+		{
+			char message[MESSAGE_LEN + 1];
+			int length = s->udp.read(message, MESSAGE_LEN);
+			if (length <= 0)
+				continue;
+			message[length] = '\0';
+
+			char type[8];
+			unsigned int node;
+			unsigned int seq = 0;
+			unsigned int from;
+			float watts = 0;
+			if (sscanf(message, "PB1 %7s %x %u", type, &node, &seq) < 2)
+				continue;
+
+			if (!strcmp(type, "ACK"))
+			{
+				if (sscanf(message, "PB1 ACK %*x %*u %x %f", &from, &watts) == 2 && from != s->nodeId)
+				{
+					if (node == s->nodeId)
+						onAcknowledged(seq, from, watts);
+					else
+					{
+						bool added;
+						seen(from, &added);
+					}
+				}
+				continue;
+			}
+
+			if (node == s->nodeId)
+				continue;
+
+			bool added;
+			seen(node, &added);
+			sscanf(message, "PB1 %*s %*x %*u %f", &watts);
+
+			if (!strcmp(type, "HELLO"))
+			{
+				// New one doesn't have to wait for the next HELLO to know us
+				if (added)
+					sayHello();
+			}
+			else if (!strcmp(type, "CLAIM"))
+				onClaim(node, seq, watts);
+			else if (!strcmp(type, "GRANT"))
+				putLease(node, seq, watts, true);
+			else if (!strcmp(type, "RELEASE"))
+			{
+				Lease* lease = findLease(node, seq);
+				if (lease)
+					removeLease(lease);
+			}
+		}
+	}
+
+	// Power to count on top of the meter for the own @claim
+	float getReserved(Claim* claim)
+	{
+		float reserved = claim->concurrent;
+		for (uint8_t i = 0; i < s->leaseCount; i++)
+		{
+			Lease* lease = &s->leases[i];
+			long after = (long)(lease->since - claim->startedAt);
+			if (lease->node == s->nodeId)
+			{
+				// Switched on before the claim, it's in its meter power
+				if (after < 0)
+					continue;
+			}
+			else if (!lease->granted && lease->node > s->nodeId && after > 0)
+			{
+				// Came after ours, that node counts ours
+				continue;
+			}
+			reserved += lease->watts;
+		}
+		return reserved;
+	}
+
+	void sendDecision(Decision* decision)
+	{
+		char message[MESSAGE_LEN + 1];
+		if (decision->granted)
+			snprintf(message, sizeof(message), "PB1 GRANT %08x %u %d",
+				(unsigned int)s->nodeId, decision->seq, (int)decision->watts);
+		else
+			snprintf(message, sizeof(message), "PB1 RELEASE %08x %u",
+				(unsigned int)s->nodeId, decision->seq);
+		send(message);
+		decision->copies--;
+		decision->sentAt = millis();
+	}
+
+	void decide(Claim* claim, bool acknowledged)
+	{
+		float reserved = getReserved(claim);
+		bool grant = acknowledged && claim->meterPower + reserved + claim->watts < s->maxPower;
+
+		if (grant)
+		{
+			s->granted++;
+			putLease(s->nodeId, claim->seq, claim->watts, true);
+		}
+		else
+		{
+			s->denied++;
+			if (!acknowledged)
+				s->unacknowledged++;
+		}
+
+		// Drop the oldest one if there is no room, it has been sent already
+		if (MAX_OWN_CLAIMS == s->decisionCount)
+			memmove(&s->decisions[0], &s->decisions[1], --s->decisionCount * sizeof(Decision));
+		Decision* decision = &s->decisions[s->decisionCount++];
+		decision->seq = claim->seq;
+		decision->granted = grant;
+		decision->watts = claim->watts;
+		decision->copies = DECISION_COPIES;
+		sendDecision(decision);
+
+		Serial.printf("Power claim %u for %dW: meter %dW, reserved %dW, %s.\n",
+			claim->seq, (int)claim->watts, (int)claim->meterPower, (int)reserved,
+			grant ? "granted" : acknowledged ? "denied" : "not acknowledged");
+
+		if (claim->callback)
+			claim->callback(grant, claim->context);
+	}
+
+	void sendClaim(Claim* claim)
+	{
+		char message[MESSAGE_LEN + 1];
+		snprintf(message, sizeof(message), "PB1 CLAIM %08x %u %d",
+			(unsigned int)s->nodeId, claim->seq, (int)claim->watts);
+		send(message);
+		claim->sentAt = millis();
+	}
+
+	void update()
+	{
+		unsigned long now = millis();
+
+		// (Re)join the group when got connected or IP has changed
+		if (WL_CONNECTED == WiFi.status())
+		{
+			if (WiFi.localIP() != s->joinedIP)
+			{
+				s->udp.stop();
+				s->udp.beginMulticast(WiFi.localIP(), POWER_BUDGET_GROUP, POWER_BUDGET_PORT);
+				s->joinedIP = WiFi.localIP();
+				s->joinedAt = now;
+				sayHello();
+			}
+			receive();
+			if (now - s->helloAt >= HELLO_EVERY)
+				sayHello();
+		}
+		else if (s->joinedIP.isSet())
+		{
+			s->udp.stop();
+			s->joinedIP = IPAddress();
+		}
+
+		expirePeers();
+		expireLeases();
+
+		// Repeat claims some peers haven't got, and decisions
+		for (uint8_t i = 0; i < s->claimCount; i++)
+		{
+			Claim* claim = &s->claims[i];
+			if (now - claim->sentAt >= CLAIM_RESEND && !isAcknowledged(claim))
+				sendClaim(claim);
+		}
+		for (uint8_t i = 0; i < s->decisionCount; )
+		{
+			Decision* decision = &s->decisions[i];
+			if (now - decision->sentAt >= CLAIM_RESEND)
+				sendDecision(decision);
+			if (decision->copies)
+				i++;
+			else
+				memmove(decision, decision + 1, (--s->decisionCount - i) * sizeof(Decision));
+		}
+
+		// Own claims in order, granted one counts for the next
+		while (s->claimCount)
+		{
+			unsigned long age = now - s->claims[0].startedAt;
+			bool acknowledged = isAcknowledged(&s->claims[0]);
+			if (age < CLAIM_WINDOW || (!acknowledged && age < CLAIM_TIMEOUT))
+				break;
+
+			Claim claim = s->claims[0];
+			memmove(&s->claims[0], &s->claims[1], --s->claimCount * sizeof(Claim));
+			decide(&claim, acknowledged);
+		}
+	}
+
+	bool busy()
+	{
+		return s->claimCount || s->decisionCount;
+	}
+
+	bool reserve(float watts, float meterPower, ReserveCallback callback, void* context)
+	{
+		if (MAX_OWN_CLAIMS == s->claimCount)
+			return false;
+
+		// Peers not heard yet wouldn't be waited for
+		if (s->joinedIP.isSet() && millis() - s->joinedAt < LISTEN_TIME)
+			return false;
+
+		Claim* claim = &s->claims[s->claimCount++];
+		claim->seq = ++s->seq;
+		claim->watts = watts;
+		claim->meterPower = meterPower;
+		claim->concurrent = 0;
+		claim->acknowledged = 0;
+		claim->callback = callback;
+		claim->context = context;
+		claim->startedAt = millis();
+		sendClaim(claim);
+		return true;
+	}
+
+	bool needsMeterReading()
+	{
+		unsigned long now = millis();
+		for (uint8_t i = 0; i < s->leaseCount; i++)
+		{
+			Lease* lease = &s->leases[i];
+			if (lease->granted && lease->node != s->nodeId && now - lease->since >= LEASE_TTL)
+				return true;
+		}
+		return false;
+	}
+
+	void meterRead()
+	{
+		unsigned long now = millis();
+		for (uint8_t i = 0; i < s->leaseCount; )
+		{
+			Lease* lease = &s->leases[i];
+			if (lease->granted && lease->node != s->nodeId && now - lease->since >= LEASE_TTL)
+				removeLease(lease);
+			else
+				i++;
+		}
+	}
+
+	String getStatistics()
+	{
+		float leased = 0;
+		uint8_t peerLeases = 0;
+		for (uint8_t i = 0; i < s->leaseCount; i++)
+		{
+			if (s->leases[i].granted)
+				leased += s->leases[i].watts;
+			if (s->leases[i].node != s->nodeId)
+				peerLeases++;
+		}
+
+		uint8_t peers = 0;
+		for (uint8_t i = 0; i < MAX_PEERS; i++)
+			if (s->peers[i].node)
+				peers++;
+
+		return
+			String("{ ") +
+				"\"MaxPower\" : " + String((int)s->maxPower) + ", " +
+				"\"Leased\" : " + String((int)leased) + ", " +
+				"\"PeerLeases\" : " + String(peerLeases) + ", " +
+				"\"Peers\" : " + String(peers) + ", " +
+				"\"Granted\" : " + String(s->granted) + ", " +
+				"\"Denied\" : " + String(s->denied) + ", " +
+				"\"Unacknowledged\" : " + String(s->unacknowledged) + ", " +
+				"\"Promoted\" : " + String(s->promoted) +
+			" }";
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef POWER_BUDGET_H
+#define POWER_BUDGET_H
+
+#include <Arduino.h>
+
+#define POWER_BUDGET_GROUP	IPAddress(239, 255, 42, 1)
+#define POWER_BUDGET_PORT	4210
+
+namespace PowerBudget
+{
+	// Called when reservation is decided.
+	typedef void (*ReserveCallback)(bool granted, void* context);
+
+	// Budget node: claims, leases and peers seen. Device has just one,
+	// host simulations run several nodes in one process.
+	struct State;
+
+	// New node state for select().
+	State* newState();
+
+	// Functions below work on @state from now on.
+	void select(State* state);
+
+	// Joins the budget group, @maxPower is the power cap shared by nodes.
+	void init(float maxPower);
+
+	// Receives peers messages, decides own claims, expires leases. Call
+	// from loop().
+	void update();
+
+	// True while own claims are pending or decisions are repeated, update()
+	// should be called often.
+	bool busy();
+
+	// Ask for @watts more on top of @meterPower measured. Callback is fired
+	// from update() once the claim is decided. False if too many claims
+	// are pending or the node is still learning its peers.
+	bool reserve(float watts, float meterPower, ReserveCallback callback, void* context = NULL);
+
+	// True when peer leases are old enough for the meter to show them, the
+	// meter should be read and meterRead() called to let them go.
+	bool needsMeterReading();
+
+	// Meter has been read, peer leases it shows now are not counted any more.
+	void meterRead();
+
+	// Budget state as JSON object.
+	String getStatistics();
+}
+
+#endif
@@ -0,0 +1,688 @@
+/*
+How it works:
+
+compile() parses rules text into bytecode, one record per rule:
+
+	[length] [event] [event argument] [event parameter, float] [code...]
+
+and a 0 length at the end. Code is for a small stack machine working on
+floats: the condition leaves its result on the stack and JZ jumps over the
+actions when it is false, actions pop their values. URLs of get actions are
+kept inline in the code.
+
+Nothing runs between events. init() indexes the rules by their event and
+each event source runs only its rules: onInput() the input edge rules of
+that input, onTemperature() the rules of that sensor whose threshold was
+crossed since the previous reading, update() timer rules that are due.
+The event value (input level, temperature) is there for the condition as
+"value". Machine checks stack and jumps as it goes, a broken rule is
+stopped and counted as an error.
+*/
+#include <RuleEngine.h>
+#include <HTTPPool.h>
+
+#define RULE_HEADER_LEN		7
+#define STACK_LEN		8
+#define URL_MAX_LEN		120
+
+namespace RuleEngine
+{
+	enum Event
+	{
+		EVENT_INPUT = 1,
+		EVENT_ABOVE,
+		EVENT_BELOW,
+		EVENT_EVERY
+	};
+
+	enum OpCode
+	{
+		OP_END = 0,
+		OP_CONST,		// float follows
+		OP_VALUE,
+		OP_LINE,		// line number follows
+		OP_TEMP,		// sensor number follows
+		OP_ADD,
+		OP_SUB,
+		OP_EQ,
+		OP_NE,
+		OP_LT,
+		OP_GT,
+		OP_LE,
+		OP_GE,
+		OP_AND,
+		OP_OR,
+		OP_NOT,
+		OP_JZ,			// forward offset follows
+		OP_SET_LINE,		// line number follows
+		OP_TOGGLE,		// line number follows
+		OP_SET_TARGET,
+		OP_GET,			// url length and url follow
+		OP_GET_VALUE		// same, value is appended to url
+	};
+
+	const uint8_t* program = NULL;
+	ReadCallback read = NULL;
+	WriteCallback write = NULL;
+
+	uint8_t ruleCount = 0;
+	uint16_t rules[RULES_MAX];		// rule offsets in program
+	unsigned long dueAt[RULES_MAX];		// timer rules
+	float lastTemperature[RULES_SENSORS];
+
+	// Statistics
+	unsigned long runs = 0;
+	unsigned long errors = 0;
+	unsigned long runTimeSum = 0;		// us
+	unsigned long runTimeMax = 0;		// us
+
+	float getParameter(const uint8_t* rule)
+	{
+		float parameter;
+		memcpy(&parameter, rule + 3, sizeof(float));
+		return parameter;
+	}
+
+	void init(const uint8_t* program, ReadCallback read, WriteCallback write)
+	{
+		RuleEngine::read = read;
+		RuleEngine::write = write;
+		RuleEngine::program = NULL;
+		ruleCount = 0;
+		for (uint8_t i = 0; i < RULES_SENSORS; i++)
+			lastTemperature[i] = NAN;
+
+		// Uninitialised in EEPROM or broken: not run
+		uint16_t position = 0;
+		while (position < RULES_PROGRAM_LEN && program[position])
+		{
+			uint8_t length = program[position];
+			if (length < RULE_HEADER_LEN + 1 || position + length >= RULES_PROGRAM_LEN ||
+				RULES_MAX == ruleCount)
+			{
+				ruleCount = 0;
+				return;
+			}
+
+			const uint8_t* rule = program + position;
+			if (EVENT_EVERY == rule[1])
+				dueAt[ruleCount] = millis() + getParameter(rule) * 1000;
+			rules[ruleCount++] = position;
+			position += length;
+		}
+
+		if (position >= RULES_PROGRAM_LEN)
+		{
+			ruleCount = 0;
+			return;
+		}
+		RuleEngine::program = program;
+	}
+
+	void run(const uint8_t* rule, float value)
+	{
+		const uint8_t* end = rule + rule[0];
+		const uint8_t* pc = rule + RULE_HEADER_LEN;
+		float stack[STACK_LEN];
+		uint8_t sp = 0;
+		unsigned long startedAt = micros();
+
+		#define NEED(in, out)	if (sp < (in) || sp - (in) + (out) > STACK_LEN) goto error
+		#define ARGUMENT(n)	if (pc + (n) > end) goto error
+
+		while (pc < end)
+		{
+			uint8_t op = *pc++;
+			switch (op)
+			{
+				case OP_END:
+					goto done;
+
+				case OP_CONST:
+					NEED(0, 1);
+					ARGUMENT(sizeof(float));
+					memcpy(&stack[sp++], pc, sizeof(float));
+					pc += sizeof(float);
+					break;
+
+				case OP_VALUE:
+					NEED(0, 1);
+					stack[sp++] = value;
+					break;
+
+				case OP_LINE:
+				case OP_TEMP:
+					NEED(0, 1);
+					ARGUMENT(1);
+					stack[sp++] = read ? read(OP_LINE == op ? RULE_LINE : RULE_TEMP, *pc) : 0;
+					pc++;
+					break;
+
+				case OP_NOT:
+					NEED(1, 1);
+					stack[sp - 1] = !stack[sp - 1];
+					break;
+
+				case OP_ADD: case OP_SUB: case OP_EQ: case OP_NE: case OP_LT:
+				case OP_GT: case OP_LE: case OP_GE: case OP_AND: case OP_OR:
+				{
+					NEED(2, 1);
+					float b = stack[--sp];
+					float a = stack[sp - 1];
+					float r =
+						OP_ADD == op ? a + b :
+						OP_SUB == op ? a - b :
+						OP_EQ == op ? a == b :
+						OP_NE == op ? a != b :
+						OP_LT == op ? a < b :
+						OP_GT == op ? a > b :
+						OP_LE == op ? a <= b :
+						OP_GE == op ? a >= b :
+						OP_AND == op ? a && b : a || b;
+					stack[sp - 1] = r;
+					break;
+				}
+
+				case OP_JZ:
+					NEED(1, 0);
+					ARGUMENT(1);
+					if (!stack[--sp])
+						pc += *pc;
+					pc++;
+					break;
+
+				case OP_SET_LINE:
+					NEED(1, 0);
+					ARGUMENT(1);
+					if (write)
+						write(RULE_LINE, *pc, stack[sp - 1]);
+					sp--;
+					pc++;
+					break;
+
+				case OP_TOGGLE:
+					ARGUMENT(1);
+					if (read && write)
+						write(RULE_LINE, *pc, !read(RULE_LINE, *pc));
+					pc++;
+					break;
+
+				case OP_SET_TARGET:
+					NEED(1, 0);
+					if (write)
+						write(RULE_TARGET, 0, stack[sp - 1]);
+					sp--;
+					break;
+
+				case OP_GET:
+				case OP_GET_VALUE:
+				{
+					ARGUMENT(1);
+					uint8_t length = *pc++;
+					ARGUMENT(length);
+					char url[URL_MAX_LEN + 1];
+					memcpy(url, pc, length);
+					url[length] = '\0';
+					pc += length;
+
+					String request(url);
+					if (OP_GET_VALUE == op)
+					{
+						NEED(1, 0);
+						float v = stack[--sp];
+						request += v == (long)v ? String((long)v) : String(v, 2);
+					}
+					HTTPPool::GET(request);
+					break;
+				}
+
+				default:
+					goto error;
+			}
+		}
+
+	done:
+		{
+			unsigned long runTime = micros() - startedAt;
+			runs++;
+			runTimeSum += runTime;
+			runTimeMax = max(runTimeMax, runTime);
+		}
+		return;
+
+	error:
+		errors++;
+		Serial.printf("Rule at %d stopped: broken code.\n", (int)(rule - program));
+
+		#undef NEED
+		#undef ARGUMENT
+	}
+
+	void onInput(uint8_t input, int level)
+	{
+		for (uint8_t i = 0; program && i < ruleCount; i++)
+		{
+			const uint8_t* rule = program + rules[i];
+			if (EVENT_INPUT == rule[1] && input == rule[2])
+				run(rule, level);
+		}
+	}
+
+	void onTemperature(uint8_t sensor, float temperature)
+	{
+		if (sensor >= RULES_SENSORS)
+			return;
+
+		float last = lastTemperature[sensor];
+		lastTemperature[sensor] = temperature;
+		if (isnan(last))
+			return;
+
+		for (uint8_t i = 0; program && i < ruleCount; i++)
+		{
+			const uint8_t* rule = program + rules[i];
+			if (sensor != rule[2])
+				continue;
+
+			float threshold = getParameter(rule);
+			if ((EVENT_ABOVE == rule[1] && last <= threshold && temperature > threshold) ||
+				(EVENT_BELOW == rule[1] && last >= threshold && temperature < threshold))
+				run(rule, temperature);
+		}
+	}
+
+	void update()
+	{
+		unsigned long now = millis();
+		for (uint8_t i = 0; program && i < ruleCount; i++)
+		{
+			const uint8_t* rule = program + rules[i];
+			if (EVENT_EVERY != rule[1] || (long)(now - dueAt[i]) < 0)
+				continue;
+
+			dueAt[i] += getParameter(rule) * 1000;
+			run(rule, 0);
+		}
+	}
+
+	String getStatistics()
+	{
+		return
+			String("{ ") +
+				"\"Rules\" : " + String(ruleCount) + ", " +
+				"\"Runs\" : " + String(runs) + ", " +
+				"\"Errors\" : " + String(errors) + ", " +
+				"\"RunTimeAvg\" : " + String(runs ? runTimeSum / runs : 0) + ", " +
+				"\"RunTimeMax\" : " + String(runTimeMax) +
+			" }";
+	}
+
+	// Compiler state
+	const char* source;
+	uint8_t* output;
+	uint16_t position;
+	const char* error;
+
+	void emit(uint8_t byte)
+	{
+		if (position < RULES_PROGRAM_LEN - 1)
+			output[position++] = byte;
+		else if (!error)
+			error = "program is too long";
+	}
+
+	void emitFloat(float value)
+	{
+		uint8_t bytes[sizeof(float)];
+		memcpy(bytes, &value, sizeof(float));
+		for (uint8_t i = 0; i < sizeof(float); i++)
+			emit(bytes[i]);
+	}
+
+	void skipSpaces()
+	{
+		while (' ' == *source || '\t' == *source || '\r' == *source)
+			source++;
+	}
+
+	// Consume keyword @word if it's next
+	bool keyword(const char* word)
+	{
+		skipSpaces();
+		size_t length = strlen(word);
+		if (strncmp(source, word, length) || isalnum(source[length]) || '_' == source[length])
+			return false;
+		source += length;
+		return true;
+	}
+
+	// Consume @symbol if it's next
+	bool symbol(const char* symbol)
+	{
+		skipSpaces();
+		size_t length = strlen(symbol);
+		if (strncmp(source, symbol, length))
+			return false;
+		source += length;
+		return true;
+	}
+
+	bool number(float* value)
+	{
+		skipSpaces();
+		char* end;
+		*value = strtod(source, &end);
+		if (end == source)
+			return false;
+		source = end;
+		return true;
+	}
+
+	bool index(uint8_t* value)
+	{
+		float v;
+		if (!number(&v) || v < 0 || v > 255 || v != (int)v)
+		{
+			if (!error)
+				error = "line or sensor number expected";
+			return false;
+		}
+		*value = v;
+		return true;
+	}
+
+	void expression();
+
+	void term()
+	{
+		float value;
+		uint8_t n;
+
+		if (symbol("("))
+		{
+			expression();
+			if (!symbol(")") && !error)
+				error = "')' expected";
+		}
+		else if (keyword("value"))
+		{
+			emit(OP_VALUE);
+		}
+		else if (keyword("line") && index(&n))
+		{
+			emit(OP_LINE);
+			emit(n);
+		}
+		else if (keyword("temp") && index(&n))
+		{
+			emit(OP_TEMP);
+			emit(n);
+		}
+		else if (!error && number(&value))
+		{
+			emit(OP_CONST);
+			emitFloat(value);
+		}
+		else if (!error)
+		{
+			error = "value expected";
+		}
+	}
+
+	void sum()
+	{
+		term();
+		while (!error)
+		{
+			if (symbol("+"))
+			{
+				term();
+				emit(OP_ADD);
+			}
+			else if (symbol("-"))
+			{
+				term();
+				emit(OP_SUB);
+			}
+			else
+				break;
+		}
+	}
+
+	void comparison()
+	{
+		sum();
+
+		const char* symbols[] = { "==", "!=", "<=", ">=", "<", ">" };
+		const uint8_t ops[] = { OP_EQ, OP_NE, OP_LE, OP_GE, OP_LT, OP_GT };
+		for (uint8_t i = 0; i < sizeof(ops); i++)
+		{
+			if (symbol(symbols[i]))
+			{
+				sum();
+				emit(ops[i]);
+				break;
+			}
+		}
+	}
+
+	void negation()
+	{
+		if (keyword("not"))
+		{
+			negation();
+			emit(OP_NOT);
+		}
+		else
+		{
+			comparison();
+		}
+	}
+
+	void conjunction()
+	{
+		negation();
+		while (!error && keyword("and"))
+		{
+			negation();
+			emit(OP_AND);
+		}
+	}
+
+	void expression()
+	{
+		conjunction();
+		while (!error && keyword("or"))
+		{
+			conjunction();
+			emit(OP_OR);
+		}
+	}
+
+	// End of an action: ';', end of line or source
+	bool actionEnd()
+	{
+		skipSpaces();
+		return ';' == *source || '\n' == *source || '\0' == *source;
+	}
+
+	void action()
+	{
+		uint8_t n;
+
+		if (keyword("line") && index(&n))
+		{
+			if (!symbol("="))
+			{
+				error = "'=' expected";
+				return;
+			}
+			expression();
+			emit(OP_SET_LINE);
+			emit(n);
+		}
+		else if (!error && keyword("toggle") && index(&n))
+		{
+			emit(OP_TOGGLE);
+			emit(n);
+		}
+		else if (!error && keyword("target"))
+		{
+			if (!symbol("="))
+			{
+				error = "'=' expected";
+				return;
+			}
+			expression();
+			emit(OP_SET_TARGET);
+		}
+		else if (!error && keyword("get"))
+		{
+			if (!symbol("\""))
+			{
+				error = "url expected";
+				return;
+			}
+			const char* url = source;
+			while (*source && '"' != *source && '\n' != *source)
+				source++;
+			size_t length = source - url;
+			if ('"' != *source++ || length > URL_MAX_LEN)
+			{
+				error = "url is not closed or too long";
+				return;
+			}
+
+			bool withValue = !actionEnd();
+			if (withValue)
+				expression();
+			emit(withValue ? OP_GET_VALUE : OP_GET);
+			emit(length);
+			for (size_t i = 0; i < length; i++)
+				emit(url[i]);
+		}
+		else if (!error)
+		{
+			error = "action expected";
+		}
+	}
+
+	void rule()
+	{
+		uint16_t start = position;
+		uint8_t event;
+		uint8_t argument = 0;
+		float parameter = 0;
+
+		if (!keyword("on"))
+		{
+			error = "'on' expected";
+			return;
+		}
+
+		if (keyword("input"))
+		{
+			event = EVENT_INPUT;
+			index(&argument);
+		}
+		else if (keyword("temp"))
+		{
+			index(&argument);
+			if (keyword("above"))
+				event = EVENT_ABOVE;
+			else if (keyword("below"))
+				event = EVENT_BELOW;
+			else
+			{
+				error = "'above' or 'below' expected";
+				return;
+			}
+			if (!number(&parameter))
+				error = "temperature expected";
+		}
+		else if (keyword("every"))
+		{
+			event = EVENT_EVERY;
+			if (!number(&parameter) || parameter < 1)
+				error = "period in seconds expected";
+		}
+		else
+		{
+			error = "event expected";
+			return;
+		}
+		if (error)
+			return;
+
+		emit(0);			// length, set when done
+		emit(event);
+		emit(argument);
+		emitFloat(parameter);
+
+		uint16_t jump = 0;
+		if (keyword("if"))
+		{
+			expression();
+			emit(OP_JZ);
+			jump = position;
+			emit(0);
+		}
+
+		if (!error && !keyword("do"))
+			error = "'do' expected";
+
+		while (!error)
+		{
+			action();
+			if (!symbol(";"))
+				break;
+		}
+		emit(OP_END);
+
+		if (jump)
+			output[jump] = position - 1 - jump - 1;
+		if (position - start > 255 && !error)
+			error = "rule is too long";
+		output[start] = position - start;
+	}
+
+	String compile(const char* text, uint8_t* program)
+	{
+		source = text;
+		output = program;
+		position = 0;
+		error = NULL;
+		int line = 1;
+
+		while (*source && !error)
+		{
+			skipSpaces();
+			if ('#' == *source)
+				while (*source && '\n' != *source)
+					source++;
+
+			if ('\n' == *source)
+			{
+				source++;
+				line++;
+				continue;
+			}
+			if (!*source)
+				break;
+
+			rule();
+			skipSpaces();
+			if (!error && *source && '\n' != *source)
+				error = "end of rule expected";
+		}
+
+		if (error)
+		{
+			memset(program, 0, RULES_PROGRAM_LEN);
+			return String("Line ") + String(line) + ": " + error;
+		}
+
+		program[position] = 0;
+		return String();
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef RULE_ENGINE_H
+#define RULE_ENGINE_H
+
+#include <Arduino.h>
+
+#define RULES_PROGRAM_LEN	256		// bytecode in config, bytes
+#define RULES_MAX		16
+#define RULES_SENSORS		4
+
+// What rules read and write through the callbacks
+#define RULE_LINE		0		// output line state, 0 or 1
+#define RULE_TEMP		1		// sensor temperature, read only
+#define RULE_TARGET		2		// target temperature, write only
+
+// Local automation: rules compiled to bytecode, run when their event fires.
+//
+//	on <event> [if <condition>] do <action>[; <action>...]
+//
+// events:	input <n>, temp <n> above <x>, temp <n> below <x>, every <seconds>
+// condition:	expression of numbers, value (of the event), line <n>,
+//		temp <n>, + - == != < > <= >= and or not ( )
+// actions:	line <n> = <expression>, toggle <n>, target = <expression>,
+//		get "<url>" [<expression>] (value appended to url)
+//
+// Rules are separated by new lines, e.g.
+//	on input 1 if value == 1 do toggle 0
+//	on temp 0 below 26.5 do get "http://switch-b.local/ChangeLine?line=0&state=1"
+namespace RuleEngine
+{
+	typedef float (*ReadCallback)(uint8_t source, uint8_t index);
+	typedef void (*WriteCallback)(uint8_t target, uint8_t index, float value);
+
+	// Run @program (RULES_PROGRAM_LEN bytes, e.g. in config), invalid one
+	// is not run at all.
+	void init(const uint8_t* program, ReadCallback read, WriteCallback write);
+
+	// Compile @source to @program. Returns empty string if done, error
+	// otherwise, @program is left empty then.
+	String compile(const char* source, uint8_t* program);
+
+	// Events: input @input edge to @level, @sensor temperature reading.
+	void onInput(uint8_t input, int level);
+	void onTemperature(uint8_t sensor, float temperature);
+
+	// Runs timer rules when due. Call from loop().
+	void update();
+
+	// Rules and run time statistics as JSON object.
+	String getStatistics();
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*
+How it works:
+
+Each property is looked up in the desired document by JSONPathFilter at
+"Desired.<name>", one pass over the document per property, the document
+is small. Properties missing there are left as they are.
+
+The version applied last is kept in RAM. A newer version is applied: each
+property that differs from desired is written. Then every property of the
+document is read back and the ones still differing go to the delta. The
+same version again is a retry (the reply got lost), it's not written
+again, only the delta is made. After reboot any version is taken, the
+state is from config then and the hub has to bring it back anyway.
+*/
+#include <DeviceShadow.h>
+#include <JSONPathFilter.h>
+
+#define SHADOW_TOLERANCE	0.005		// floats compared, 2 decimals reported
+
+namespace DeviceShadow
+{
+	const char* const* names = NULL;
+	uint8_t count = 0;
+	ReadCallback read = NULL;
+	WriteCallback write = NULL;
+	uint32_t version = 0;
+
+	// Statistics
+	unsigned long applied = 0;
+	unsigned long repeated = 0;
+	unsigned long refused = 0;
+	unsigned long rejected = 0;		// property values not accepted
+
+	void init(const char* const* names, uint8_t count, ReadCallback read, WriteCallback write)
+	{
+		DeviceShadow::names = names;
+		DeviceShadow::count = min(count, (uint8_t)SHADOW_PROPERTIES_MAX);
+		DeviceShadow::read = read;
+		DeviceShadow::write = write;
+	}
+
+	// Looks @result path up in @json, false if it's not there
+	bool find(const String& json, JSONPathFilter* result)
+	{
+		const char* c = json.c_str();
+		while (*c && !result->feed(*c))
+			c++;
+		return result->found();
+	}
+
+	String format(float value)
+	{
+		return value == (long)value ? String((long)value) : String(value, 2);
+	}
+
+	int apply(const String& json, String* reply, bool* changed)
+	{
+		*changed = false;
+
+		JSONPathFilter versionFilter("Version");
+		if (!find(json, &versionFilter))
+		{
+			*reply = "{ \"Error\" : \"Version expected\" }";
+			return 400;
+		}
+
+		uint32_t desiredVersion = strtoul(versionFilter.value(), NULL, 10);
+		if (desiredVersion < version)
+		{
+			refused++;
+			*reply = getReported();
+			return 409;
+		}
+
+		bool repeat = desiredVersion == version && version;
+		*reply = String("{ \"Version\" : ") + String(desiredVersion) + ", \"Delta\" : { ";
+		bool first = true;
+		for (uint8_t i = 0; i < count; i++)
+		{
+			char path[SHADOW_NAME_LEN + 9];
+			snprintf(path, sizeof(path), "Desired.%s", names[i]);
+			JSONPathFilter filter(path);
+			if (!find(json, &filter))
+				continue;
+
+			float desired = filter.toFloat();
+			if (!repeat && fabs(read(i) - desired) >= SHADOW_TOLERANCE)
+			{
+				if (write(i, desired))
+					*changed = true;
+				else
+					rejected++;
+			}
+
+			float reported = read(i);
+			if (fabs(reported - desired) >= SHADOW_TOLERANCE)
+			{
+				*reply += String(first ? "" : ", ") + "\"" + names[i] + "\" : " + format(reported);
+				first = false;
+			}
+		}
+		*reply += String(first ? "}" : " }") + " }";
+
+		if (repeat)
+			repeated++;
+		else
+			applied++;
+		version = desiredVersion;
+		return 200;
+	}
+
+	String getReported()
+	{
+		String json = String("{ \"Version\" : ") + String(version) + ", \"Reported\" : { ";
+		for (uint8_t i = 0; i < count; i++)
+			json += String(i ? ", " : "") + "\"" + names[i] + "\" : " + format(read(i));
+		return json + " } }";
+	}
+
+	String getStatistics()
+	{
+		return
+			String("{ ") +
+				"\"Version\" : " + String(version) + ", " +
+				"\"Applied\" : " + String(applied) + ", " +
+				"\"Repeated\" : " + String(repeated) + ", " +
+				"\"Refused\" : " + String(refused) + ", " +
+				"\"Rejected\" : " + String(rejected) +
+			" }";
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef DEVICE_SHADOW_H
+#define DEVICE_SHADOW_H
+
+#include <Arduino.h>
+
+#define SHADOW_PROPERTIES_MAX	8
+#define SHADOW_NAME_LEN		23
+
+// Desired/reported state: the hub sends the whole desired state in one
+// versioned document
+//
+//	{ "Version" : 7, "Desired" : { "Active" : 1, "TargetTemperature" : 27.5 } }
+//
+// device sets what differs and replies with the version applied and only
+// the properties that are still not as desired (rejected values):
+//
+//	{ "Version" : 7, "Delta" : { } }
+//
+// Same version sent again is not applied twice, older one is refused, so
+// retries are safe. Properties are numbers, the firmware names them.
+namespace DeviceShadow
+{
+	typedef float (*ReadCallback)(uint8_t property);
+
+	// Sets @property to @value, false if the value is not accepted.
+	typedef bool (*WriteCallback)(uint8_t property, float value);
+
+	// @names of @count properties, have to stay valid.
+	void init(const char* const* names, uint8_t count, ReadCallback read, WriteCallback write);
+
+	// Reconcile to desired state document @json. Reply goes to @reply,
+	// @changed is set if any property was written. Returns HTTP code: 200
+	// applied or repeated version, 409 older version (reply has the
+	// current state then), 400 broken document.
+	int apply(const String& json, String* reply, bool* changed);
+
+	// Version applied and all properties as JSON object.
+	String getReported();
+
+	// Documents applied, repeated, refused as JSON object.
+	String getStatistics();
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+	HTTPPool: loop() keeps running while the upstream is slow, update()
+	takes no time waiting for a response, only opening a connection
+	blocks and that is bounded by the DNS and connect timeouts.
+*/
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266HTTPClient.h>
+#include <HTTPPool.h>
+#include <Clock.h>
+#include "Test.h"
+
+#define OPEN_BOUND		500		// HTTP_DNS_TIMEOUT + HTTP_CONNECT_TIMEOUT
+#define LOOP_PERIOD		1		// ms of other work each loop
+
+TEST_MAIN_DATA
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+unsigned long millis() { return VirtualClock::clock.millis(); }
+unsigned long micros() { return VirtualClock::clock.micros(); }
+void delay(unsigned long ms) { VirtualClock::clock.delay(ms); }
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+int digitalRead(uint8_t pin) { return 0; }
+
+struct Result
+{
+	int		httpCode;
+	String		body;
+	unsigned long	doneAt;
+	unsigned long	loops;		// loop() runs till done
+	unsigned long	firstUpdate;	// ms the update() sending it took
+	unsigned long	maxUpdate;	// ms any later update() took
+};
+
+void onResponse(int httpCode, const String& body, void* context)
+{
+	Result* result = (Result*)context;
+	result->httpCode = httpCode;
+	result->body = body;
+	result->doneAt = millis();
+}
+
+// GET a url and run loop() till the callback, or give up after 10 s
+Result request(const char* url)
+{
+	Result result = { 0, String(), 0, 0, 0, 0 };
+	CHECK(HTTPPool::GET(url, onResponse, &result));
+
+	unsigned long start = millis();
+	while (!result.doneAt && millis() - start < 10000)
+	{
+		unsigned long before = millis();
+		HTTPPool::update();
+		unsigned long took = millis() - before;
+
+		if (!result.loops)
+			result.firstUpdate = took;
+		else if (took > result.maxUpdate)
+			result.maxUpdate = took;
+
+		result.loops++;
+		delay(LOOP_PERIOD);
+	}
+
+	result.doneAt -= start;
+	return result;
+}
+
+int main()
+{
+	VirtualServer& server = VirtualServer::get();
+	server.response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+	WiFi.ip = IPAddress(10, 0, 0, 2);
+	VirtualClock::set(1000);
+
+	// Server takes 2 s to answer: only the connect blocks, loop() keeps going
+	WiFi.dnsTime = 30;
+	server.connectTime = 20;
+	server.delay = 2000;
+	{
+		Result result = request("http://api.example.com/slow");
+		CHECK(200 == result.httpCode);
+		CHECK(String("ok") == result.body);
+		CHECK(result.firstUpdate == 50);
+		CHECK(result.maxUpdate == 0);
+		CHECK_NEAR(result.doneAt, 2050, 2);
+		CHECK(result.loops > 2000);
+		CHECK(1 == server.connects);
+	}
+
+	// Kept alive: nothing blocks at all
+	{
+		Result result = request("http://api.example.com/again");
+		CHECK(200 == result.httpCode);
+		CHECK(result.firstUpdate == 0);
+		CHECK(result.maxUpdate == 0);
+		CHECK(1 == server.connects);
+	}
+
+	// Server never answers: read timeout, loop() unaffected
+	server.delay = 60000;
+	{
+		Result result = request("http://api.example.com/hang");
+		CHECK(HTTPC_ERROR_READ_TIMEOUT == result.httpCode);
+		CHECK(result.firstUpdate == 0);
+		CHECK(result.maxUpdate == 0);
+		CHECK_NEAR(result.doneAt, 3000, 2);
+	}
+	server.delay = 0;
+
+	// Unreachable host: connect gives up within its timeout
+	server.connectTime = 60000;
+	{
+		Result result = request("http://api.example.com/down");
+		CHECK(HTTPC_ERROR_CONNECTION_REFUSED == result.httpCode);
+		CHECK(result.firstUpdate <= OPEN_BOUND);
+		CHECK(result.firstUpdate >= 250);
+	}
+	server.connectTime = 20;
+
+	// Name doesn't resolve: lookup gives up within its timeout
+	WiFi.dnsTime = 60000;
+	{
+		Result result = request("http://nowhere.example.com/");
+		CHECK(HTTPC_ERROR_CONNECTION_REFUSED == result.httpCode);
+		CHECK(result.firstUpdate == 250);
+	}
+	WiFi.dnsTime = 30;
+
+	// Both as slow as allowed is the most a request stalls loop()
+	WiFi.dnsTime = 250;
+	server.connectTime = 250;
+	{
+		Result result = request("http://api.example.com/edge");
+		CHECK(200 == result.httpCode);
+		CHECK(result.firstUpdate == OPEN_BOUND);
+		CHECK(result.maxUpdate == 0);
+	}
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,151 @@
+/*
+	HeatingEngine: out of the channels needed it switches on the set with
+	the best total score that fits under the cap, score is the deficit
+	times priority. Of the sets scoring the same, the one taking less
+	power wins, then the lower channels. Once every channel has learned
+	its thermal response the score is the run time to the target, until
+	then a learned channel is scored by deficit as well.
+*/
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <HeatingEngine.h>
+#include <PowerBudget.h>
+#include "Test.h"
+
+#define TARGET			25
+
+TEST_MAIN_DATA
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+unsigned long now = 0;
+unsigned long millis() { return now; }
+unsigned long micros() { return now * 1000; }
+void delay(unsigned long ms) { now += ms; }
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+int digitalRead(uint8_t pin) { return 0; }
+
+// Channels on after one control step of @count heaters under @maxPower
+// cap, on top of @currentPower house load, with learned @thermal response
+// of those it's given for
+uint8_t control(const float* power, const uint8_t* priority, const float* temperature,
+	uint8_t count, float maxPower, float currentPower = 0, const ThermalParameters* thermal = NULL)
+{
+	Heater heaters[HEATING_MAX_CHANNELS];
+	for (uint8_t i = 0; i < count; i++)
+	{
+		heaters[i].pin = i;
+		heaters[i].power = power[i];
+		heaters[i].priority = priority[i];
+		heaters[i].temperature = temperature[i];
+	}
+
+	HeatingEngine engine(heaters, count, maxPower);
+	engine.init();
+	for (uint8_t i = 0; thermal && i < count; i++)
+		engine.getThermalModel(i).setParameters(thermal[i]);
+	engine.control(currentPower, TARGET, true);
+
+	// Budget decides the claims, it doesn't limit here
+	now += 1000;
+	PowerBudget::update();
+	return engine.getStates();
+}
+
+int main()
+{
+	PowerBudget::init(1e6);
+
+	// Priority order: room for two of three, the higher priorities go
+	{
+		float power[] = { 1000, 1000, 1000 };
+		uint8_t priority[] = { 1, 3, 2 };
+		float temperature[] = { 20, 20, 20 };
+		CHECK(control(power, priority, temperature, 3, 2500) == 0x06);
+	}
+
+	// Priority weights the deficit: 1 degree at 3 beats 2 degrees at 1
+	{
+		float power[] = { 1000, 1000 };
+		uint8_t priority[] = { 1, 3 };
+		float temperature[] = { 23, 24 };
+		CHECK(control(power, priority, temperature, 2, 1500) == 0x02);
+	}
+
+	// Power cap: two small ones score more than the big one with a small
+	// one, that is over the cap
+	{
+		float power[] = { 2000, 1000, 1000 };
+		uint8_t priority[] = { 1, 1, 1 };
+		float temperature[] = { 20, 20, 20 };
+		CHECK(control(power, priority, temperature, 3, 2500) == 0x06);
+	}
+
+	// House load takes the headroom: nothing fits, then just the small one
+	{
+		float power[] = { 2000, 1000 };
+		uint8_t priority[] = { 1, 1 };
+		float temperature[] = { 20, 20 };
+		CHECK(control(power, priority, temperature, 2, 3500, 2600) == 0x00);
+		CHECK(control(power, priority, temperature, 2, 3500, 2000) == 0x02);
+	}
+
+	// All fit, all go, channels not needed stay off
+	{
+		float power[] = { 1000, 1000, 1000, 1000 };
+		uint8_t priority[] = { 1, 1, 1, 1 };
+		float temperature[] = { 20, 26, 20, 25 };
+		CHECK(control(power, priority, temperature, 4, 10000) == 0x05);
+	}
+
+	// Equal priorities and scores: the one taking less power
+	{
+		float power[] = { 1500, 1000 };
+		uint8_t priority[] = { 1, 1 };
+		float temperature[] = { 20, 20 };
+		CHECK(control(power, priority, temperature, 2, 1800) == 0x02);
+	}
+
+	// Equal in everything: the lower channel
+	{
+		float power[] = { 1000, 1000, 1000 };
+		uint8_t priority[] = { 2, 2, 2 };
+		float temperature[] = { 21, 21, 21 };
+		CHECK(control(power, priority, temperature, 3, 1500) == 0x01);
+		CHECK(control(power, priority, temperature, 3, 2500) == 0x03);
+	}
+
+	// All the channels there can be, best four of eight
+	{
+		float power[HEATING_MAX_CHANNELS];
+		uint8_t priority[HEATING_MAX_CHANNELS];
+		float temperature[HEATING_MAX_CHANNELS];
+		for (uint8_t i = 0; i < HEATING_MAX_CHANNELS; i++)
+		{
+			power[i] = 1000;
+			priority[i] = 1;
+			temperature[i] = 24 - (i % 2) * 3;
+		}
+		CHECK(control(power, priority, temperature, HEATING_MAX_CHANNELS, 4500) == 0xAA);
+	}
+
+	// Learned: the slow channel 1 degree off runs longer than the fast one
+	// 5 degrees off, it goes first
+	{
+		float power[] = { 1000, 1000 };
+		uint8_t priority[] = { 1, 1 };
+		float temperature[] = { 20, 24 };
+		ThermalParameters thermal[] = { { 50, 100, 100, 20 }, { 0.5, 100, 100, 20 } };
+		CHECK(control(power, priority, temperature, 2, 1500, 0, thermal) == 0x02);
+
+		// Channel 1 still learning: hours and degrees don't compare, deficit
+		// for both
+		thermal[1].samples = 0;
+		CHECK(control(power, priority, temperature, 2, 1500, 0, thermal) == 0x01);
+	}
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,73 @@
+/*
+	JSONPathFilter on recorded responses: power meter GetPowerMeterData,
+	device shadow documents and OTA manifest, with sibling objects sharing
+	the keys looked up.
+*/
+
+#include <Arduino.h>
+#include <JSONPathFilter.h>
+#include "Test.h"
+
+TEST_MAIN_DATA
+HardwareSerial Serial;
+EspClass ESP;
+
+// Feeds @json to a filter of @path as HTTPPool does, value or "-" if not found
+String find(const char* json, const char* path)
+{
+	JSONPathFilter filter(path);
+	for (const char* c = json; *c; c++)
+		if (JSONPathFilter::filter(*c, &filter))
+			break;
+	return filter.found() ? String(filter.value()) : String("-");
+}
+
+// Power meter, as it comes
+const char* meter =
+	"{\"P\":{\"L1\":1523.4,\"L2\":988.0,\"L3\":2410.7,\"sum\":4922.1},"
+	"\"U\":{\"L1\":230.1,\"L2\":229.8,\"L3\":231.0},"
+	"\"I\":{\"L1\":6.62,\"L2\":4.30,\"L3\":10.44,\"sum\":21.36}}";
+
+// Power meter with no total, current has one
+const char* meterNoSum =
+	"{ \"P\" : { \"L1\" : 1523.4, \"L2\" : 988.0 },\r\n"
+	"  \"I\" : { \"L1\" : 6.62, \"sum\" : 21.36 } }";
+
+const char* shadow =
+	"{ \"Version\" : 7, \"Reported\" : { \"Active\" : 0, \"TargetTemperature\" : 24.0 },"
+	" \"Desired\" : { \"Active\" : 1, \"TargetTemperature\" : 28.5 } }";
+
+const char* manifest =
+	"{ \"Firmware\" : { \"Version\" : 12, \"MD5\" : \"900150983cd24fb0d6963f7d28e17f72\" },\n"
+	"  \"SPIFFS\" : { \"Version\" : 11, \"MD5\" : \"d16fb36f0911f878998c136191af705e\" } }";
+
+int main()
+{
+	CHECK(find(meter, "P.sum") == "4922.1");
+	CHECK(find(meter, "I.sum") == "21.36");
+	CHECK(find(meter, "U.L3") == "231.0");
+	CHECK(find(meter, "U.sum") == "-");
+
+	// Sibling objects with the key: the matched prefix ends with its object
+	CHECK(find(meterNoSum, "P.sum") == "-");
+	CHECK(find(meterNoSum, "I.sum") == "21.36");
+	CHECK(find("{\"P\":{\"x\":1},\"Q\":{\"sum\":5}}", "P.sum") == "-");
+	CHECK(find("{\"P\":{\"x\":{\"sum\":2}},\"sum\":3}", "P.sum") == "-");
+	CHECK(find("{\"P\":{\"x\":[{\"sum\":2}]},\"P2\":{\"sum\":3},\"P\":{\"sum\":4}}", "P.sum") == "4");
+
+	CHECK(find(shadow, "Desired.Active") == "1");
+	CHECK(find(shadow, "Desired.TargetTemperature") == "28.5");
+	CHECK(find(shadow, "Reported.TargetTemperature") == "24.0");
+	CHECK(find(shadow, "Desired.ControlMode") == "-");
+	CHECK(find(shadow, "Version") == "7");
+
+	CHECK(find(manifest, "Firmware.Version") == "12");
+	CHECK(find(manifest, "SPIFFS.Version") == "11");
+	CHECK(find(manifest, "SPIFFS.MD5") == "d16fb36f0911f878998c136191af705e");
+	CHECK(find(manifest, "Firmware.MD5") == "900150983cd24fb0d6963f7d28e17f72");
+
+	// Objects and arrays as values are not taken
+	CHECK(find(meter, "P") == "-");
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,103 @@
+/*
+	JobQueue: jobs run in order after the reply, a deferred job is running
+	till finish() and its status shows the result, records of finished jobs
+	are reused oldest first, queued and running ones never.
+*/
+
+#include <Arduino.h>
+#include <JobQueue.h>
+#include "Test.h"
+
+TEST_MAIN_DATA
+HardwareSerial Serial;
+EspClass ESP;
+
+unsigned long now = 0;
+unsigned long millis() { return now; }
+
+int runs = 0;
+uint16_t deferredId = 0;
+
+void job(void* context)
+{
+	runs++;
+}
+
+// Goes on as a task would, finished by the test
+void deferredJob(void* context)
+{
+	runs++;
+	deferredId = JobQueue::defer();
+}
+
+// Finishes right away, before it returns, as a skipped OTA check does
+void failingJob(void* context)
+{
+	JobQueue::finish(JobQueue::defer(), false);
+}
+
+// State of job @id from its status reply, "-" if there is no such job
+String state(uint16_t id)
+{
+	String reply;
+	if (JobQueue::getStatus(String(JOBS_PATH) + id, &reply) != 200)
+		return "-";
+	const char* s = strstr(reply.c_str(), "\"State\" : \"");
+	if (!s)
+		return "?";
+	s += strlen("\"State\" : \"");
+	return String(std::string(s, strchr(s, '"') - s));
+}
+
+int main()
+{
+	// Runs in update(), not when queued
+	uint16_t first = JobQueue::enqueue("job", job);
+	CHECK(first > 0);
+	CHECK(state(first) == "Queued");
+	CHECK(JobQueue::busy());
+	CHECK(runs == 0);
+	JobQueue::update();
+	CHECK(runs == 1);
+	CHECK(state(first) == "Done");
+	CHECK(!JobQueue::busy());
+
+	// Deferred job is running till finish(), then shows the result
+	uint16_t deferred = JobQueue::enqueue("deferred", deferredJob);
+	JobQueue::update();
+	CHECK(deferredId == deferred);
+	CHECK(state(deferred) == "Running");
+	now += 1500;
+	JobQueue::finish(deferred, true);
+	CHECK(state(deferred) == "Done");
+
+	uint16_t failing = JobQueue::enqueue("failing", failingJob);
+	JobQueue::update();
+	CHECK(state(failing) == "Failed");
+
+	// Not from a job: nothing to defer
+	CHECK(JobQueue::defer() == 0);
+
+	// Running one is kept while finished ones are reused
+	uint16_t running = JobQueue::enqueue("deferred", deferredJob);
+	JobQueue::update();
+	CHECK(state(running) == "Running");
+	uint16_t ids[8];
+	int queued = 0;
+	while (queued < 8 && (ids[queued] = JobQueue::enqueue("job", job)))
+		queued++;
+	CHECK(queued == 5);
+	CHECK(state(first) == "-");
+	CHECK(state(running) == "Running");
+	for (int i = 0; i < queued; i++)
+		JobQueue::update();
+	CHECK(state(ids[queued - 1]) == "Done");
+	JobQueue::finish(running, false);
+	CHECK(state(running) == "Failed");
+
+	String reply;
+	CHECK(JobQueue::getStatus(String(JOBS_PATH) + "x", &reply) == 404);
+	CHECK(strstr(JobQueue::getStatistics().c_str(), "\"Failed\" : 2"));
+
+	return TEST_RESULT();
+}
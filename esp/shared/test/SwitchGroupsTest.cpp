@@ -0,0 +1,116 @@
+/*
+	SwitchGroups: a command is applied once per origin sequence, a new
+	boot id of the origin starts its sequence again. Acks of the last
+	command are counted once per member, by the full node id.
+*/
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+#include <SwitchGroups.h>
+#include "Test.h"
+
+TEST_MAIN_DATA
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+unsigned long now = 0;
+unsigned long millis() { return now; }
+unsigned long micros() { return now * 1000; }
+void delay(unsigned long ms) { now += ms; }
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+int digitalRead(uint8_t pin) { return 0; }
+
+int lines[8];
+unsigned long applied = 0;
+
+void setLine(uint8_t line, int state)
+{
+	lines[line] = state;
+	applied++;
+}
+
+WiFiUDP peer;
+
+// Peer datagram to the switch, the switch takes it
+void fromPeer(const char* message)
+{
+	peer.beginPacketMulticast(SWITCH_GROUPS_GROUP, SWITCH_GROUPS_PORT, IPAddress());
+	peer.print(message);
+	peer.endPacket();
+	now += 10;
+	SwitchGroups::update();
+}
+
+// Last datagram the peer got, empty if none
+String toPeer()
+{
+	std::string last;
+	now += 10;
+	while (int length = peer.parsePacket())
+	{
+		char buffer[65];
+		length = peer.read(buffer, 64);
+		last.assign(buffer, length);
+	}
+	return String(last);
+}
+
+bool statistic(const char* field)
+{
+	return strstr(SwitchGroups::getStatistics().c_str(), field);
+}
+
+int main()
+{
+	static SwitchGroup groups[SWITCH_GROUPS_MAX];
+	WiFi.ip = IPAddress(10, 0, 0, 2);
+	SwitchGroups::init(groups, setLine, 0x1234);
+	CHECK(SwitchGroups::setGroup(0, "hall", 0x03, 0x01));
+	SwitchGroups::update();
+	peer.beginMulticast(IPAddress(), SWITCH_GROUPS_GROUP, SWITCH_GROUPS_PORT);
+
+	// Applied once, the copy is repeated
+	fromPeer("SG2 ON hall 0000000a 11111111 5");
+	CHECK(2 == applied && HIGH == lines[0] && HIGH == lines[1]);
+	fromPeer("SG2 ON hall 0000000a 11111111 5");
+	fromPeer("SG2 OFF hall 0000000a 11111111 4");
+	CHECK(2 == applied && HIGH == lines[0]);
+	CHECK(statistic("\"Repeated\" : 2"));
+
+	// Peer restarted: sequence from 1 again is taken
+	fromPeer("SG2 OFF hall 0000000a 22222222 1");
+	CHECK(4 == applied && LOW == lines[0] && LOW == lines[1]);
+	CHECK(statistic("\"Restarted\" : 1"));
+	fromPeer("SG2 SCENE hall 0000000a 22222222 1");
+	CHECK(4 == applied);
+	fromPeer("SG2 SCENE hall 0000000a 22222222 2");
+	CHECK(6 == applied && HIGH == lines[0] && LOW == lines[1]);
+
+	// Other groups, own commands and unknown versions are not applied
+	fromPeer("SG2 ON attic 0000000a 22222222 3");
+	fromPeer("SG2 ON hall 00005151 22222222 3");
+	fromPeer("SG1 ON hall 0000000a 3");
+	CHECK(6 == applied);
+
+	// Acks asked are given to each copy, repeated ones too
+	toPeer();
+	fromPeer("SG2 ON hall 0000000b 33333333 1 ACK");
+	CHECK(toPeer() == String("SG2 ACK hall 0000000b 1 00005151"));
+	fromPeer("SG2 ON hall 0000000b 33333333 1 ACK");
+	CHECK(toPeer() == String("SG2 ACK hall 0000000b 1 00005151"));
+
+	// Acks counted by the full node id, ones differing in the last digit too
+	uint32_t seq = SwitchGroups::send("hall", "OFF", true);
+	CHECK(1 == seq);
+	fromPeer("SG2 ACK hall 00005151 1 1000000a");
+	fromPeer("SG2 ACK hall 00005151 1 1000000b");
+	fromPeer("SG2 ACK hall 00005151 1 1000000a");
+	fromPeer("SG2 ACK hall 00005151 0 1000000c");
+	fromPeer("SG2 ACK hall 0000000a 1 1000000d");
+	CHECK(statistic("\"LastAcks\" : 2"));
+
+	return TEST_RESULT();
+}
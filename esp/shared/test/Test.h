@@ -0,0 +1,28 @@
+#ifndef TEST_H
+#define TEST_H
+
+/*
+	Minimal host test support: CHECK counts failures and prints where,
+	main() of the test returns TEST_RESULT() for make to see.
+*/
+
+#include <stdio.h>
+
+extern int testFailures;
+
+#define CHECK(condition) \
+	do { if (!(condition)) { testFailures++; \
+		printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); } } while (0)
+
+#define CHECK_NEAR(value, expected, tolerance) \
+	do { double v_ = (value), e_ = (expected); \
+		if (v_ < e_ - (tolerance) || v_ > e_ + (tolerance)) { testFailures++; \
+		printf("%s:%d: %s = %g, expected %g +- %g\n", __FILE__, __LINE__, \
+			#value, v_, e_, (double)(tolerance)); } } while (0)
+
+#define TEST_RESULT() \
+	(printf("%s: %s\n", __FILE__, testFailures ? "FAILED" : "passed"), testFailures ? 1 : 0)
+
+#define TEST_MAIN_DATA int testFailures = 0;
+
+#endif
@@ -0,0 +1,113 @@
+/*
+	Timer: a callback may stop its own event and start another one, which
+	then takes the same slot. The new event keeps its own period, count and
+	repeats, the one fired before doesn't touch it.
+*/
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <Timer.h>
+#include "Test.h"
+
+TEST_MAIN_DATA
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+unsigned long millis() { return VirtualClock::clock.millis(); }
+unsigned long micros() { return VirtualClock::clock.micros(); }
+void delay(unsigned long ms) { VirtualClock::clock.delay(ms); }
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+int digitalRead(uint8_t pin) { return 0; }
+
+TimerN<1> timer;
+int8_t id;
+int fired;
+int followed;
+
+void onFollowUp(void* context)
+{
+	followed++;
+}
+
+// Stops the event it's fired by and starts a one-shot in its place
+void onRestart(void* context)
+{
+	fired++;
+	timer.stop(id);
+	id = timer.after(100, onFollowUp, NULL);
+}
+
+// Chained one-shots: each stops itself and starts the next, @context
+// of them in all
+void onChain(void* context)
+{
+	fired++;
+	timer.stop(id);
+	if (fired < *(int*)context)
+		id = timer.after(100, onChain, context);
+}
+
+// Runs the timer for @ms on the clock
+void run(unsigned long ms)
+{
+	for (unsigned long t = 0; t < ms; t++)
+	{
+		timer.update();
+		VirtualClock::advance(1);
+	}
+}
+
+int main()
+{
+	timer.setClock(&VirtualClock::clock);
+
+	// Periodic event restarted as a one-shot by its own callback
+	{
+		VirtualClock::set(0);
+		fired = followed = 0;
+		id = timer.every(1000, onRestart, NULL);
+		run(1001);
+		CHECK(fired == 1);
+		CHECK(id == 0);
+		CHECK(timer.getEvent(id) && timer.getEvent(id)->count == 0);
+		CHECK(timer.getEvent(id) && timer.getEvent(id)->deadline() == 1100);
+		run(200);
+		CHECK(followed == 1);
+		CHECK(timer.getEvent(id) == NULL);
+	}
+
+	// Same with periods to catch up: only the first one fires, the rest
+	// are the old event's and go with it
+	{
+		VirtualClock::set(0);
+		fired = followed = 0;
+		id = timer.every(1000, onRestart, NULL);
+		timer.setPolicy(id, EVENT_CATCH_UP);
+		VirtualClock::set(3500);
+		timer.update();
+		CHECK(fired == 1);
+		CHECK(timer.getEvent(id) && timer.getEvent(id)->deadline() == 3600);
+		run(200);
+		CHECK(followed == 1);
+		CHECK(timer.getEvent(id) == NULL);
+	}
+
+	// One-shots chained through the same slot all fire, 100 apart
+	{
+		VirtualClock::set(0);
+		fired = 0;
+		int chain = 5;
+		id = timer.after(100, onChain, &chain);
+		run(450);
+		CHECK(fired == 4);
+		run(100);
+		CHECK(fired == 5);
+		CHECK(timer.getEvent(id) == NULL);
+		run(1000);
+		CHECK(fired == 5);
+	}
+
+	return TEST_RESULT();
+}
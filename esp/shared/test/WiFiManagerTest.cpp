@@ -0,0 +1,97 @@
+/*
+	WiFiManager: idle time is the slack till the next deadline capped by
+	the power policy, none in POWER_FULL or below MIN_IDLE. idle() sleeps
+	that long on the clock only when connected, its own connection check
+	is a deadline too.
+*/
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiManager.h>
+#include "Test.h"
+
+TEST_MAIN_DATA
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+unsigned long millis() { return VirtualClock::clock.millis(); }
+unsigned long micros() { return VirtualClock::clock.micros(); }
+void delay(unsigned long ms) { VirtualClock::clock.delay(ms); }
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t value) {}
+int digitalRead(uint8_t pin) { return 0; }
+
+// No RTC memory, every start is a cold one
+bool loadRTCData(uint32_t offset, void* data, size_t size) { return false; }
+void saveRTCData(uint32_t offset, void* data, size_t size) {}
+void clearRTCData(uint32_t offset) {}
+
+// How long idle() at @now slept with the next job due at @deadline
+unsigned long idleAt(unsigned long now, unsigned long deadline)
+{
+	VirtualClock::set(now);
+	WiFiManager::idle(deadline);
+	return millis() - now;
+}
+
+int main()
+{
+	using namespace WiFiManager;
+
+	// POWER_FULL never idles, unknown policy is POWER_FULL
+	setPowerPolicy(POWER_FULL);
+	CHECK(getIdleTime(1000, 2000) == 0);
+	setPowerPolicy(7);
+	CHECK(getIdleTime(1000, 2000) == 0);
+
+	// POWER_BALANCED: slack, capped at 50 ms
+	setPowerPolicy(POWER_BALANCED);
+	CHECK(getIdleTime(1000, 2000) == 50);
+	CHECK(getIdleTime(1000, 1050) == 50);
+	CHECK(getIdleTime(1000, 1030) == 30);
+	CHECK(getIdleTime(1000, 1005) == 5);
+	CHECK(getIdleTime(1000, 1004) == 0);		// not worth it
+	CHECK(getIdleTime(1000, 1000) == 0);
+	CHECK(getIdleTime(1000, 900) == 0);		// overdue
+	CHECK(getIdleTime((unsigned long)-16, 16) == 32);	// across millis() wrap
+
+	// POWER_SAVING: capped at 500 ms
+	setPowerPolicy(POWER_SAVING);
+	CHECK(getIdleTime(1000, 60000) == 500);
+	CHECK(getIdleTime(1000, 1200) == 200);
+	CHECK(getIdleTime(1000, 1003) == 0);
+	CHECK(getIdleTime((unsigned long)-256, 256) == 500);
+
+	// Connection check runs every 500 ms from 0 on the virtual clock
+	static ConnectedESPConfiguration config = { EEPROM_INIT_CODE, "net", "secret", "floor" };
+	VirtualClock::set(0);
+	setClock(&VirtualClock::clock);
+	init(&config);
+
+	// Radio stays up while connecting
+	setPowerPolicy(POWER_SAVING);
+	CHECK(idleAt(100, 60000) == 0);
+
+	WiFi.ip = IPAddress(10, 0, 0, 2);
+	VirtualClock::set(1000);
+	update();
+
+	// Balanced: up to 50 ms, less if the job is due sooner
+	setPowerPolicy(POWER_BALANCED);
+	CHECK(idleAt(1000, 60000) == 50);
+	CHECK(idleAt(1000, 1020) == 20);
+	CHECK(idleAt(1000, 1003) == 0);
+
+	// Saving: up to 500 ms, and not past the own check at 1500
+	setPowerPolicy(POWER_SAVING);
+	CHECK(idleAt(1000, 60000) == 500);
+	CHECK(idleAt(1000, 1200) == 200);
+	CHECK(idleAt(1100, 60000) == 400);
+	CHECK(idleAt(1498, 60000) == 0);
+
+	setPowerPolicy(POWER_FULL);
+	CHECK(idleAt(1000, 60000) == 0);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,23 @@
+#ifndef DNS_SERVER_H
+#define DNS_SERVER_H
+
+/*
+	Host stand-in for WiFiManager tests: captive portal DNS does nothing.
+*/
+
+#include <ESP8266WiFi.h>
+
+enum class DNSReplyCode
+{
+	NoError
+};
+
+class DNSServer
+{
+public:
+	void setErrorReplyCode(DNSReplyCode) {}
+	bool start(uint16_t, const char*, IPAddress) { return true; }
+	void processNextRequest() {}
+};
+
+#endif
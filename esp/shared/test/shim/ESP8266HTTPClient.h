@@ -0,0 +1,22 @@
+#ifndef ESP8266_HTTP_CLIENT_H
+#define ESP8266_HTTP_CLIENT_H
+
+/*
+	Host stand-in for HTTPPool tests: just the error codes of the core.
+*/
+
+#include <WiFiClient.h>
+
+#define HTTPC_ERROR_CONNECTION_REFUSED	(-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED	(-2)
+#define HTTPC_ERROR_SEND_PAYLOAD_FAILED	(-3)
+#define HTTPC_ERROR_NOT_CONNECTED	(-4)
+#define HTTPC_ERROR_CONNECTION_LOST	(-5)
+#define HTTPC_ERROR_NO_STREAM		(-6)
+#define HTTPC_ERROR_NO_HTTP_SERVER	(-7)
+#define HTTPC_ERROR_TOO_LESS_RAM	(-8)
+#define HTTPC_ERROR_ENCODING		(-9)
+#define HTTPC_ERROR_STREAM_WRITE	(-10)
+#define HTTPC_ERROR_READ_TIMEOUT	(-11)
+
+#endif
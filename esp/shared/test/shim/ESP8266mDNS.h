@@ -0,0 +1,16 @@
+#ifndef ESP8266_MDNS_H
+#define ESP8266_MDNS_H
+
+/*
+	Host stand-in for WiFiManager tests: responder always starts.
+*/
+
+#include <ESP8266WiFi.h>
+
+class MDNSResponder
+{
+public:
+	bool begin(const char*, IPAddress) { return true; }
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef WIFI_CLIENT_H
+#define WIFI_CLIENT_H
+
+/*
+	Host stand-in for HTTPPool tests: every client talks to the one
+	VirtualServer, whatever the host. Connect takes connectTime ms of the
+	virtual clock, limited by the client timeout, and fails when it is
+	over it. Each request is answered with response, delay ms later.
+	Connection is kept alive until the client stops it.
+*/
+
+#include <ESP8266WiFi.h>
+
+struct VirtualServer
+{
+	unsigned long		connectTime;	// ms
+	unsigned long		delay;		// ms from request to response
+	std::string		response;
+	unsigned long		connects;
+	unsigned long		requests;
+
+	static VirtualServer& get()
+	{
+		static VirtualServer server = { 0, 0, std::string(), 0, 0 };
+		return server;
+	}
+};
+
+class WiFiClient
+{
+public:
+	void setTimeout(unsigned long timeout) { this->timeout = timeout; }
+	void setNoDelay(bool) {}
+	bool connected() { return open; }
+
+	int connect(IPAddress, uint16_t)
+	{
+		VirtualServer& server = VirtualServer::get();
+		::delay(min(timeout, server.connectTime));
+		if (server.connectTime > timeout)
+			return 0;
+		server.connects++;
+		open = true;
+		return 1;
+	}
+
+	size_t print(const String& message)
+	{
+		if (!open)
+			return 0;
+		VirtualServer& server = VirtualServer::get();
+		server.requests++;
+		pending = server.response;
+		readyAt = millis() + server.delay;
+		return message.length();
+	}
+
+	int available()
+	{
+		if (pending.length() && (long)(millis() - readyAt) >= 0)
+		{
+			received += pending;
+			pending.clear();
+		}
+		return received.length() - position;
+	}
+
+	int read(uint8_t* buffer, size_t size)
+	{
+		size_t length = std::min(size, received.length() - position);
+		memcpy(buffer, received.data() + position, length);
+		position += length;
+		return length;
+	}
+
+	void stop()
+	{
+		open = false;
+		pending.clear();
+		received.clear();
+		position = 0;
+	}
+
+private:
+	bool			open = false;
+	unsigned long		timeout = 1000;
+	std::string		pending;
+	unsigned long		readyAt = 0;
+	std::string		received;
+	size_t			position = 0;
+};
+
+#endif
@@ -0,0 +1,37 @@
+// For Arduino 1.0 and earlier
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Clock.h"
+
+const Clock hardwareClock = { millis, micros, delay };
+
+namespace VirtualClock
+{
+	unsigned long long now = 0;		// us
+
+	unsigned long getMillis(void)
+	{
+		return now / 1000;
+	}
+
+	unsigned long getMicros(void)
+	{
+		return now;
+	}
+
+	void advance(unsigned long ms)
+	{
+		now += ms * 1000ULL;
+	}
+
+	void set(unsigned long ms)
+	{
+		now = ms * 1000ULL;
+	}
+
+	const Clock clock = { getMillis, getMicros, advance };
+}
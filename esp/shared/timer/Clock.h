@@ -0,0 +1,27 @@
+#ifndef Clock_h
+#define Clock_h
+
+// Time source of Timer, Event, WiFiManager and DSM501. On target it is
+// the hardware one, host simulations give them the virtual one to run
+// hours of controller time in jumps. Plain function pointers, so it is
+// there before any global constructor runs.
+struct Clock
+{
+	unsigned long	(*millis)(void);
+	unsigned long	(*micros)(void);
+	void		(*delay)(unsigned long ms);
+};
+
+// Arduino millis(), micros() and delay().
+extern const Clock hardwareClock;
+
+// Stands still until set or advanced, delay() advances it.
+namespace VirtualClock
+{
+	extern const Clock clock;
+
+	void set(unsigned long ms);
+	void advance(unsigned long ms);
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/*  * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ Code by Simon Monk
+ http://www.simonmonk.org
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// For Arduino 1.0 and earlier
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Event.h"
+
+Event::Event(void)
+{
+	eventType = EVENT_NONE;
+	clock = &hardwareClock;
+	contextCallback = NULL;
+	context = NULL;
+	generation = 0;
+	reset();
+}
+
+void Event::reset(void)
+{
+	policy = EVENT_SKIP;
+	name = NULL;
+	missed = 0;
+	lateMax = 0;
+	for (uint8_t i = 0; i < EVENT_LATE_BUCKETS; i++)
+		late[i] = 0;
+}
+
+void Event::update(void)
+{
+    unsigned long now = clock->millis();
+    update(now);
+}
+
+/*
+ * Periods stay in phase: the next one is counted from when this one was
+ * due, not from when it got fired. Periods missed while the loop was
+ * blocked are fired back to back (EVENT_CATCH_UP, up to EVENT_MAX_CATCH_UP
+ * of them) or skipped (EVENT_SKIP), either way the ones not fired are
+ * counted as missed. Callback may stop the event and start another one in
+ * its slot, then the slot belongs to the new one and is left as it is.
+ */
+void Event::update(unsigned long now)
+{
+	unsigned long elapsed = now - lastEventTime;
+	if (elapsed >= period)
+	{
+		unsigned long lateBy = elapsed - period;
+		uint8_t bucket = lateBy < 10 ? 0 : lateBy < 100 ? 1 : lateBy < 1000 ? 2 : 3;
+		if (late[bucket] < 0xFFFF)
+			late[bucket]++;
+		if (lateBy > lateMax)
+			lateMax = lateBy;
+
+		unsigned long due = period ? elapsed / period : 1;
+		unsigned long runs = EVENT_CATCH_UP == policy ? min(due, (unsigned long)EVENT_MAX_CATCH_UP) : 1;
+		uint8_t started = generation;
+		for (unsigned long n = 0; n < runs && eventType != EVENT_NONE; n++)
+		{
+			fire();
+			if (generation != started)
+				return;
+			count++;
+			if (repeatCount > -1 && count >= repeatCount)
+				eventType = EVENT_NONE;
+		}
+
+		if (eventType != EVENT_NONE && due > runs)
+			missed = min(missed + due - runs, 0xFFFFUL);
+		lastEventTime = period ? lastEventTime + due * period : now;
+	}
+	if (repeatCount > -1 && count >= repeatCount)
+	{
+		eventType = EVENT_NONE;
+	}
+}
+
+void Event::fire(void)
+{
+	switch (eventType)
+	{
+		case EVENT_EVERY:
+			if (contextCallback)
+				(*contextCallback)(context);
+			else
+				(*callback)();
+			break;
+
+		case EVENT_OSCILLATE:
+			pinState = ! pinState;
+			digitalWrite(pin, pinState);
+			break;
+	}
+}
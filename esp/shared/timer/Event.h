@@ -24,11 +24,19 @@
 #define Event_h
 
 #include <inttypes.h>
+#include "Clock.h"
 
 #define EVENT_NONE 0
 #define EVENT_EVERY 1
 #define EVENT_OSCILLATE 2
 
+// What a periodic event does with the periods missed while blocked
+#define EVENT_SKIP 0
+#define EVENT_CATCH_UP 1
+
+#define EVENT_MAX_CATCH_UP (4)
+#define EVENT_LATE_BUCKETS (4)  // fired late by <10ms, <100ms, <1s, more
+
 class Event
 {
 
@@ -36,14 +44,36 @@ public:
   Event(void);
   void update(void);
   void update(unsigned long now);
+
+  // Starts statistics over, skip policy, no name.
+  void reset(void);
+
   int8_t eventType;
   unsigned long period;
   int repeatCount;
   uint8_t pin;
   uint8_t pinState;
+  const Clock* clock;  // update(void) reads it
   void (*callback)(void);
+  void (*contextCallback)(void*);  // called with context instead, if set
+  void* context;
   unsigned long lastEventTime;
   int count;
+
+  uint8_t policy;
+  const char* name;  // for statistics
+
+  uint8_t generation;  // TimerBase counts starts of the event slot in it
+
+  uint16_t missed;  // periods not fired
+  uint16_t late[EVENT_LATE_BUCKETS];
+  unsigned long lateMax;
+
+  // Time (millis) the event is due next.
+  unsigned long deadline(void) const { return lastEventTime + period; }
+
+private:
+  void fire(void);
 };
 
 #endif
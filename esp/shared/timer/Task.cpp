@@ -0,0 +1,72 @@
+// For Arduino 1.0 and earlier
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Task.h"
+
+Task::Task(Body body, void* context, TimerBase* timer)
+	: context(context), line(0), _body(body), _timer(timer),
+	  _event(NO_TIMER_AVAILABLE), _running(false)
+{
+}
+
+void Task::setTimer(TimerBase* timer)
+{
+	_timer = timer;
+}
+
+bool Task::start(void)
+{
+	if (_running)
+		return false;
+
+	_running = true;
+	line = 0;
+	_body(this);
+	return true;
+}
+
+void Task::stop(void)
+{
+	if (_event != NO_TIMER_AVAILABLE)
+	{
+		_timer->stop(_event);
+		_event = NO_TIMER_AVAILABLE;
+	}
+	_running = false;
+	line = 0;
+}
+
+bool Task::running(void)
+{
+	return _running;
+}
+
+// Only a suspended task goes on, one waiting for its timer keeps waiting.
+void Task::resume(void)
+{
+	if (_running && _event == NO_TIMER_AVAILABLE)
+		_body(this);
+}
+
+// Schedules the body to go on in @ms. Without a free timer event the
+// task can't wait, so it is abandoned, as the caller returns right after.
+void Task::wait(unsigned long ms)
+{
+	_event = _timer ? _timer->after(ms, onTimer, this) : NO_TIMER_AVAILABLE;
+	if (_event == NO_TIMER_AVAILABLE)
+	{
+		Serial.println("Task: no timer event to wait on, stopped.");
+		stop();
+	}
+}
+
+void Task::onTimer(void* task)
+{
+	Task* t = (Task*)task;
+	t->_event = NO_TIMER_AVAILABLE;
+	t->resume();
+}
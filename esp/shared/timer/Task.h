@@ -0,0 +1,85 @@
+#ifndef Task_h
+#define Task_h
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "Timer.h"
+
+#define TASK_POLL_PERIOD (10)  // ms, TASK_WAIT_UNTIL checks the condition
+
+/*
+ * Stackless coroutine on Timer: task body is written as sequential code
+ * and returns to loop() at every wait, the timer calls it again when the
+ * wait is over and it goes on from there.
+ *
+ *	void blink(Task* task)
+ *	{
+ *		TASK_BEGIN(task);
+ *		digitalWrite(LED, LOW);
+ *		TASK_WAIT(task, 200);
+ *		digitalWrite(LED, HIGH);
+ *		TASK_END(task);
+ *	}
+ *
+ * Body runs as a switch on the line it stopped at, so local variables
+ * don't live across waits, keep them in the context. No switch statements
+ * of its own around waits either, and one wait per line.
+ */
+class Task
+{
+
+public:
+  typedef void (*Body)(Task* task);
+
+  Task(Body body, void* context = NULL, TimerBase* timer = NULL);
+
+  // Timer waits are scheduled on, NULL if the task only suspends.
+  void setTimer(TimerBase* timer);
+
+  // Runs the body from the beginning, false if it is running already.
+  bool start(void);
+
+  // Abandons the task wherever it waits.
+  void stop(void);
+
+  bool running(void);
+
+  // Goes on with the suspended task, e.g. from a callback.
+  void resume(void);
+
+  void* context;
+
+  // Used by the TASK_ macros
+  uint16_t line;  // where to go on, 0 if not running
+  void wait(unsigned long ms);
+
+private:
+  static void onTimer(void* task);
+
+  Body _body;
+  TimerBase* _timer;
+  int8_t _event;  // timer event of the wait
+  bool _running;
+};
+
+#define TASK_BEGIN(task) switch ((task)->line) { case 0:
+
+// Return to loop(), go on in @ms.
+#define TASK_WAIT(task, ms) \
+  do { (task)->line = __LINE__; (task)->wait(ms); return; case __LINE__:; } while (0)
+
+// Return to loop() until @condition holds, it is checked every TASK_POLL_PERIOD.
+#define TASK_WAIT_UNTIL(task, condition) \
+  do { (task)->line = __LINE__; case __LINE__: \
+    if (!(condition)) { (task)->wait(TASK_POLL_PERIOD); return; } } while (0)
+
+// Return to loop() until someone calls resume().
+#define TASK_SUSPEND(task) \
+  do { (task)->line = __LINE__; return; case __LINE__:; } while (0)
+
+// Finish the task right here.
+#define TASK_EXIT(task) do { (task)->stop(); return; } while (0)
+
+#define TASK_END(task) } (task)->stop()
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+/*  * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ Code by Simon Monk
+ http://www.simonmonk.org
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// For Arduino 1.0 and earlier
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Timer.h"
+
+/*
+ * _heap holds all event indexes: the first _size of them are the heap of
+ * active events by deadline, the rest are free. So a free event is always
+ * the one right after the heap, where it goes when started, and a removed
+ * event goes right back there.
+ */
+
+TimerBase::TimerBase(Event* events, uint8_t* heap, uint8_t* positions, uint8_t capacity)
+	: _events(events), _heap(heap), _positions(positions), _clock(&hardwareClock),
+	  _capacity(capacity), _size(0)
+{
+	for (uint8_t i = 0; i < capacity; i++)
+	{
+		_heap[i] = i;
+		_positions[i] = i;
+	}
+}
+
+int8_t TimerBase::every(unsigned long period, void (*callback)(), int repeatCount)
+{
+	int8_t i = findFreeEventIndex();
+	if (i == -1) return -1;
+
+	_events[i].eventType = EVENT_EVERY;
+	_events[i].period = period;
+	_events[i].repeatCount = repeatCount;
+	_events[i].callback = callback;
+	_events[i].contextCallback = NULL;
+	_events[i].lastEventTime = _clock->millis();
+	_events[i].count = 0;
+	return start(i);
+}
+
+int8_t TimerBase::every(unsigned long period, void (*callback)())
+{
+	return every(period, callback, -1); // - means forever
+}
+
+int8_t TimerBase::after(unsigned long period, void (*callback)())
+{
+	return every(period, callback, 1);
+}
+
+int8_t TimerBase::every(unsigned long period, void (*callback)(void*), void* context, int repeatCount)
+{
+	int8_t i = findFreeEventIndex();
+	if (i == NO_TIMER_AVAILABLE) return NO_TIMER_AVAILABLE;
+
+	_events[i].eventType = EVENT_EVERY;
+	_events[i].period = period;
+	_events[i].repeatCount = repeatCount;
+	_events[i].callback = NULL;
+	_events[i].contextCallback = callback;
+	_events[i].context = context;
+	_events[i].lastEventTime = _clock->millis();
+	_events[i].count = 0;
+	return start(i);
+}
+
+int8_t TimerBase::after(unsigned long period, void (*callback)(void*), void* context)
+{
+	return every(period, callback, context, 1);
+}
+
+int8_t TimerBase::oscillate(uint8_t pin, unsigned long period, uint8_t startingValue, int repeatCount)
+{
+	int8_t i = findFreeEventIndex();
+	if (i == NO_TIMER_AVAILABLE) return NO_TIMER_AVAILABLE;
+
+	_events[i].eventType = EVENT_OSCILLATE;
+	_events[i].pin = pin;
+	_events[i].period = period;
+	_events[i].pinState = startingValue;
+	digitalWrite(pin, startingValue);
+	_events[i].repeatCount = repeatCount * 2; // full cycles not transitions
+	_events[i].lastEventTime = _clock->millis();
+	_events[i].count = 0;
+	return start(i);
+}
+
+int8_t TimerBase::oscillate(uint8_t pin, unsigned long period, uint8_t startingValue)
+{
+	return oscillate(pin, period, startingValue, -1); // forever
+}
+
+/**
+ * This method will generate a pulse of !startingValue, occuring period after the
+ * call of this method and lasting for period. The Pin will be left in !startingValue.
+ */
+int8_t TimerBase::pulse(uint8_t pin, unsigned long period, uint8_t startingValue)
+{
+	return oscillate(pin, period, startingValue, 1); // once
+}
+
+/**
+ * This method will generate a pulse of startingValue, starting immediately and of
+ * length period. The pin will be left in the !startingValue state
+ */
+int8_t TimerBase::pulseImmediate(uint8_t pin, unsigned long period, uint8_t pulseValue)
+{
+	int8_t id(oscillate(pin, period, pulseValue, 1));
+	// now fix the repeat count
+	if (id >= 0 && id < _capacity) {
+		_events[id].repeatCount = 1;
+	}
+	return id;
+}
+
+
+void TimerBase::stop(int8_t id)
+{
+	if (id >= 0 && id < _capacity && _events[id].eventType != EVENT_NONE) {
+		remove(_positions[id]);
+		_events[id].eventType = EVENT_NONE;
+	}
+}
+
+void TimerBase::update(void)
+{
+	unsigned long now = _clock->millis();
+	update(now);
+}
+
+void TimerBase::update(unsigned long now)
+{
+	// Bounded, so an event of zero period doesn't hold the loop
+	for (uint8_t n = 0; n < _capacity && _size > 0; n++)
+	{
+		uint8_t i = _heap[0];
+		if (now - _events[i].lastEventTime < _events[i].period)
+			break;
+
+		_events[i].update(now);
+
+		// Callback may have started and stopped events, this one too
+		if (_events[i].eventType == EVENT_NONE)
+		{
+			if (_positions[i] < _size && _heap[_positions[i]] == i)
+				remove(_positions[i]);
+		}
+		else
+		{
+			siftDown(_positions[i]);
+		}
+	}
+}
+
+unsigned long TimerBase::nextDeadline(void)
+{
+	return nextDeadline(_clock->millis());
+}
+
+unsigned long TimerBase::nextDeadline(unsigned long now)
+{
+	if (_size == 0)
+		return now + TIMER_MAX_IDLE;
+
+	Event& next = _events[_heap[0]];
+	unsigned long elapsed = now - next.lastEventTime;
+	if (elapsed >= next.period)
+		return now;
+	return now + min(next.period - elapsed, TIMER_MAX_IDLE);
+}
+
+void TimerBase::setClock(const Clock* clock)
+{
+	_clock = clock;
+	for (uint8_t i = 0; i < _capacity; i++)
+		_events[i].clock = clock;
+}
+
+int8_t TimerBase::setName(int8_t id, const char* name)
+{
+	if (id >= 0 && id < _capacity)
+		_events[id].name = name;
+	return id;
+}
+
+void TimerBase::setPolicy(int8_t id, uint8_t policy)
+{
+	if (id >= 0 && id < _capacity)
+		_events[id].policy = policy;
+}
+
+const Event* TimerBase::getEvent(int8_t id)
+{
+	if (id >= 0 && id < _capacity && _events[id].eventType != EVENT_NONE)
+		return &_events[id];
+	return NULL;
+}
+
+String TimerBase::getStatistics(void)
+{
+	String json = "[ ";
+	bool first = true;
+	for (uint8_t i = 0; i < _size; i++)
+	{
+		Event& event = _events[_heap[i]];
+		if (!event.name)
+			continue;
+
+		json += String(first ? "" : ", ") + "{ " +
+			"\"Name\" : \"" + event.name + "\", " +
+			"\"Period\" : " + String(event.period) + ", " +
+			"\"Count\" : " + String(event.count) + ", " +
+			"\"Missed\" : " + String(event.missed) + ", " +
+			"\"LateMax\" : " + String(event.lateMax) + ", " +
+			"\"Late\" : [ ";
+		for (uint8_t j = 0; j < EVENT_LATE_BUCKETS; j++)
+			json += String(event.late[j]) + (j < EVENT_LATE_BUCKETS - 1 ? ", " : " ] }");
+		first = false;
+	}
+	return json + " ]";
+}
+
+int8_t TimerBase::findFreeEventIndex(void)
+{
+	if (_size < _capacity)
+		return _heap[_size];
+	return NO_TIMER_AVAILABLE;
+}
+
+// Puts free event @i, the one right after the heap, into the heap. New
+// generation of the slot, so an update() firing the event it had before
+// leaves this one alone.
+int8_t TimerBase::start(int8_t i)
+{
+	_events[i].generation++;
+	_events[i].reset();
+	_size++;
+	siftUp(_positions[i]);
+	return i;
+}
+
+bool TimerBase::earlier(uint8_t a, uint8_t b)
+{
+	return (long)(_events[a].deadline() - _events[b].deadline()) < 0;
+}
+
+void TimerBase::place(uint8_t position, uint8_t i)
+{
+	_heap[position] = i;
+	_positions[i] = position;
+}
+
+void TimerBase::siftUp(uint8_t position)
+{
+	uint8_t i = _heap[position];
+	while (position > 0)
+	{
+		uint8_t parent = (position - 1) / 2;
+		if (!earlier(i, _heap[parent]))
+			break;
+		place(position, _heap[parent]);
+		position = parent;
+	}
+	place(position, i);
+}
+
+void TimerBase::siftDown(uint8_t position)
+{
+	uint8_t i = _heap[position];
+	for (;;)
+	{
+		uint8_t child = 2 * position + 1;
+		if (child >= _size)
+			break;
+		if (child + 1 < _size && earlier(_heap[child + 1], _heap[child]))
+			child++;
+		if (!earlier(_heap[child], i))
+			break;
+		place(position, _heap[child]);
+		position = child;
+	}
+	place(position, i);
+}
+
+// Takes event at heap @position out, it goes free right after the heap.
+void TimerBase::remove(uint8_t position)
+{
+	uint8_t i = _heap[position];
+	uint8_t last = _heap[--_size];
+	place(_size, i);
+	if (position < _size)
+	{
+		place(position, last);
+		siftUp(position);
+		siftDown(_positions[last]);
+	}
+}
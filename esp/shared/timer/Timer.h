@@ -0,0 +1,149 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+
+/*  * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ Code by Simon Monk
+ http://www.simonmonk.org
+* * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef Timer_h
+#define Timer_h
+
+#include <inttypes.h>
+#include "Event.h"
+#include "Clock.h"
+
+class String;
+
+#define MAX_NUMBER_OF_EVENTS (10)
+
+#define TIMER_NOT_AN_EVENT (-2)
+#define NO_TIMER_AVAILABLE (-1)
+
+#define TIMER_MAX_IDLE (60000UL)
+
+/**
+ * Events are kept in a min-heap by deadline: update() only looks at the
+ * events that are due and nextDeadline() is the top of the heap. Event
+ * storage comes from TimerN, so the capacity is set at compile time.
+ */
+class TimerBase
+{
+
+public:
+  int8_t every(unsigned long period, void (*callback)(void));
+  int8_t every(unsigned long period, void (*callback)(void), int repeatCount);
+  int8_t after(unsigned long duration, void (*callback)(void));
+
+  /**
+   * Same as above, callback gets context pointer given here.
+   */
+  int8_t every(unsigned long period, void (*callback)(void*), void* context, int repeatCount = -1);
+  int8_t after(unsigned long duration, void (*callback)(void*), void* context);
+
+  int8_t oscillate(uint8_t pin, unsigned long period, uint8_t startingValue);
+  int8_t oscillate(uint8_t pin, unsigned long period, uint8_t startingValue, int repeatCount);
+  
+  /**
+   * This method will generate a pulse of !startingValue, occuring period after the
+   * call of this method and lasting for period. The Pin will be left in !startingValue.
+   */
+  int8_t pulse(uint8_t pin, unsigned long period, uint8_t startingValue);
+  
+  /**
+   * This method will generate a pulse of pulseValue, starting immediately and of
+   * length period. The pin will be left in the !pulseValue state
+   */
+  int8_t pulseImmediate(uint8_t pin, unsigned long period, uint8_t pulseValue);
+  void stop(int8_t id);
+  void update(void);
+  void update(unsigned long now);
+
+  /**
+   * Returns time (millis) when the next event is due, so the caller knows
+   * how long it can idle. If there are no events, now + TIMER_MAX_IDLE.
+   */
+  unsigned long nextDeadline(void);
+  unsigned long nextDeadline(unsigned long now);
+
+  /**
+   * Time source of the timer and its events, hardwareClock by default.
+   */
+  void setClock(const Clock* clock);
+
+  /**
+   * Names event id for statistics, returns id, so it can wrap every():
+   * timer->setName(timer->every(5000, update), "update").
+   */
+  int8_t setName(int8_t id, const char* name);
+
+  /**
+   * EVENT_SKIP (default) or EVENT_CATCH_UP periods missed by event id.
+   */
+  void setPolicy(int8_t id, uint8_t policy);
+
+  /**
+   * Event id, NULL if there is no such one running.
+   */
+  const Event* getEvent(int8_t id);
+
+  /**
+   * Named events lateness and missed periods as JSON array.
+   */
+  String getStatistics(void);
+
+protected:
+  TimerBase(Event* events, uint8_t* heap, uint8_t* positions, uint8_t capacity);
+
+  Event* _events;
+  int8_t findFreeEventIndex(void);
+
+private:
+  int8_t start(int8_t i);
+  bool earlier(uint8_t a, uint8_t b);
+  void place(uint8_t position, uint8_t i);
+  void siftUp(uint8_t position);
+  void siftDown(uint8_t position);
+  void remove(uint8_t position);
+
+  uint8_t* _heap;       // event indexes, heap of _size then free ones
+  uint8_t* _positions;  // heap position by event index
+  const Clock* _clock;
+  uint8_t _capacity;
+  uint8_t _size;
+};
+
+/**
+ * Timer for up to capacity events.
+ */
+template <uint8_t capacity>
+class TimerN : public TimerBase
+{
+
+public:
+  TimerN(void) : TimerBase(_storage, _heapStorage, _positionStorage, capacity) {}
+
+private:
+  Event _storage[capacity];
+  uint8_t _heapStorage[capacity];
+  uint8_t _positionStorage[capacity];
+};
+
+typedef TimerN<MAX_NUMBER_OF_EVENTS> Timer;
+
+#endif
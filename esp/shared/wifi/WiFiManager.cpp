@@ -4,14 +4,43 @@ How it works:
 WiFiManager is a module to support WiFi connectivity for ESP chip. Firts thing,
 it shoud be initialised by calling init(cfg) function that receives configuration
 structure with wifi credentials and other info. Init creates internal timer and
-tries to connect to the wifi by calling handleWiFiConnectivity(). After init,
-handleWiFiConnectivity() is called by timer with RECONNECTION_CYCLE interval.
+starts the first connection attempt. Nothing in this module waits for the WiFi:
+the connection is driven by a small state machine advanced from update(), so
+the rest of the loop() (heating control, switch inputs, web server) keeps
+running while we are connecting.
 
-Each reconnection cycle starts with checking connection status. If wifi is in
-WL_CONNECTED, we are done. If not, we use current credentials to do
-MAX_CONNECTION_ATTEMPTS to connect. If we managed to connect, we are done. If
-not, a software access point (AP) is initialised for configuration and credentials
-update. AP name as follows: [mDNS name of the module]_[ChipId].
+States are as follows:
+
+	WIFI_CONNECTED	- we are connected, connection status is monitored each
+			  CONNECTION_CHECK_PERIOD ms. Once lost, reconnection starts.
+	WIFI_CONNECTING	- WiFi.begin() is called with current credentials, waiting
+			  up to CONNECTION_TIMEOUT ms for the connection to come up.
+	WIFI_WAITING	- last attempt failed, next one is scheduled after backoff
+			  delay. Backoff starts with INITIAL_BACKOFF and doubles
+			  with every failed attempt up to RECONNECTION_CYCLE.
+
+When an attempt fails, a software access point (AP) is initialised for
+configuration and credentials update. AP name as follows: [mDNS name of the
+module]_[ChipId]. AP is kept up (together with DNS captive portal) while the
+next attempts are made in AP+STA mode, and is switched off once connected.
+
+handleWiFiConnectivity() forces a new attempt right now with backoff reset, to
+be used when the credentials got updated.
+
+Fast reconnection: once connected, BSSID, channel and IP settings (address,
+gateway, mask, DNS) are cached in RTC user memory. After reboot or OTA the
+first attempt is a directed connect with these and the static IP, so no scan
+and no DHCP exchange are needed. If it doesn't succeed in FAST_CONNECTION_TIMEOUT
+ms, the cache is dropped and we go the normal scan + DHCP way. The time the last
+connection took is available via getConnectionTime().
+
+Power policy: when connected, loop() may idle till the next timer event is
+due by calling idle(timer->nextDeadline()). Depending on the policy, the
+radio is put to modem sleep (POWER_BALANCED) or the whole chip to light sleep
+(POWER_SAVING) in between DTIM beacons while idling. Incoming TCP is still
+received, but served only when idle period is over, so idle period is capped
+by BALANCED_MAX_IDLE/SAVING_MAX_IDLE to keep HTTP latency bounded. No idling
+in AP mode or while connecting.
 
 Module should be in the loop() cycle via update() entry point.
 */
@@ -20,20 +49,67 @@ Module should be in the loop() cycle via update() entry point.
 #include <Timer.h>
 #include <DNSServer.h>
 
-#define MAX_CONNECTION_ATTEMPTS		200
-#define RECONNECTION_CYCLE		4 * 60 * 1000	// each 4 minutes
+#define CONNECTION_CHECK_PERIOD		500			// state machine step, ms
+#define CONNECTION_TIMEOUT		(30 * 1000L)		// single attempt, ms
+#define FAST_CONNECTION_TIMEOUT		(3 * 1000L)		// attempt with cached data, ms
+#define INITIAL_BACKOFF			(10 * 1000L)		// first retry in 10 seconds
+#define RECONNECTION_CYCLE		(4 * 60 * 1000L)	// max retry delay 4 minutes
+#define MIN_IDLE			5			// don't bother to sleep less, ms
+#define BALANCED_MAX_IDLE		50			// POWER_BALANCED max latency, ms
+#define SAVING_MAX_IDLE			500			// POWER_SAVING max latency, ms
 #define BLUE_LED_PIN			2		// HIGH = off, LOW = on.
 #define DNS_PORT			53		// DNS server
 
 namespace WiFiManager
 {
+	enum ConnectionState
+	{
+		WIFI_CONNECTED,
+		WIFI_CONNECTING,
+		WIFI_WAITING
+	};
+
 	ConnectedESPConfiguration* config;
 	MDNSResponder* mDNS = new MDNSResponder();;
 	Timer* connectionPulse = new Timer();
+	const Clock* clock = &hardwareClock;
+
+	// Last good connection data, kept in RTC memory
+	struct WiFiCache
+	{
+		uint32_t	ssidHash;
+		uint8_t		bssid[6];
+		uint8_t		channel;
+		uint8_t		reserved;
+		uint32_t	localIP;
+		uint32_t	gateway;
+		uint32_t	subnetMask;
+		uint32_t	dns;
+	} cache;
+
+	ConnectionState state = WIFI_WAITING;
+	unsigned long stateChangedAt = 0;	// when current state was entered
+	unsigned long backoff = INITIAL_BACKOFF;
+	bool cacheValid = false;		// cache can be used for the next attempt
+	bool fastAttempt = false;		// current attempt uses the cache
+	unsigned long connectionTime = 0;	// last connection duration, ms
+	PowerPolicy powerPolicy = POWER_FULL;
 
 	// This is only for AP mode to redirect ALL domain request to configuration page
 	DNSServer* dnsServer = NULL;
 
+	void connectionStep();
+	void onConnected();
+
+	// Cache is only good for the same SSID
+	uint32_t ssidHash()
+	{
+		uint32_t hash = 5381;
+		for (const char* c = config->ssid; *c; c++)
+			hash = hash * 33 + *c;
+		return hash;
+	}
+
 	void init(ConnectedESPConfiguration* cfg)
 	{
 		config = cfg;
@@ -42,102 +118,265 @@ namespace WiFiManager
 		pinMode(BLUE_LED_PIN, OUTPUT);
 		digitalWrite(BLUE_LED_PIN, HIGH);
 
+		cacheValid =
+			loadRTCData(RTC_WIFI_CACHE_OFFSET, &cache, sizeof(cache)) &&
+			cache.ssidHash == ssidHash();
+
+		WiFi.mode(WIFI_STA);
 		handleWiFiConnectivity();
 
-		connectionPulse->every(RECONNECTION_CYCLE, handleWiFiConnectivity);
+		connectionPulse->every(CONNECTION_CHECK_PERIOD, connectionStep);
 	}
 
 	void update()
 	{
 		connectionPulse->update();
+
+		// Catch connection as soon as it is up to get accurate timing
+		if (WIFI_CONNECTING == state && WL_CONNECTED == WiFi.status())
+			onConnected();
+
 		if (dnsServer)
 			dnsServer->processNextRequest();
-		// 	// short blinks each 4 seconds
-		// 	digitalWrite(BLUE_LED_PIN, (millis() % 5000) < 4500);
 	}
 
-	// Ensure wifi connectivity
-	void handleWiFiConnectivity()
+	void enterState(ConnectionState newState)
 	{
-		if (WL_CONNECTED != WiFi.status())
+		state = newState;
+		stateChangedAt = clock->millis();
+	}
+
+	// Kick off connection attempt, don't wait for the result
+	void beginConnection()
+	{
+		fastAttempt = cacheValid;
+		if (fastAttempt)
 		{
-			Serial.println("Disconnected.");
-			WiFi.mode(WIFI_STA);
+			Serial.printf("Connecting to WiFi: %s (cached, channel %d)\n", config->ssid, cache.channel);
+			WiFi.config(
+				IPAddress(cache.localIP), IPAddress(cache.gateway),
+				IPAddress(cache.subnetMask), IPAddress(cache.dns));
+			WiFi.begin(config->ssid, config->secret, cache.channel, cache.bssid);
+		}
+		else
+		{
+			Serial.printf("Connecting to WiFi: %s\n", config->ssid);
+			// back to DHCP
+			WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
 			WiFi.begin(config->ssid, config->secret);
+		}
+		enterState(WIFI_CONNECTING);
+	}
+
+	// Keep current connection data for the next time
+	void updateCache()
+	{
+		cache.ssidHash = ssidHash();
+		memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+		cache.channel = WiFi.channel();
+		cache.reserved = 0;
+		cache.localIP = WiFi.localIP();
+		cache.gateway = WiFi.gatewayIP();
+		cache.subnetMask = WiFi.subnetMask();
+		cache.dns = WiFi.dnsIP();
+		saveRTCData(RTC_WIFI_CACHE_OFFSET, &cache, sizeof(cache));
+		cacheValid = true;
+	}
+
+	void onConnected()
+	{
+		connectionTime = clock->millis() - stateChangedAt;
+
+		Serial.printf("Connected to: %s in %lu ms%s\n", config->ssid,
+			connectionTime, fastAttempt ? " (cached)" : "");
+		Serial.printf("IP address: %s\n", WiFi.localIP().toString().c_str());
 
-			// // --- brod debug
-			// IPAddress my_ip(192,168,1,100);
-			// IPAddress gw(192,168,1,1);
-			// IPAddress subnet(255,255,255,0);
-			//
-			// WiFi.config(my_ip, gw, subnet);
-			// // ---
+		updateCache();
 
-			Serial.print("Connecting to WiFi: ");
+		if (mDNS->begin(config->MDNSHost, WiFi.localIP()))
+		{
+			Serial.println("MDNS responder started.");
+		}
 
-			// Connection loop
-			int connectionAttempts = 0;
-			while (WiFi.status() != WL_CONNECTED)
-			{
-				delay(500);
-				Serial.print(".");
+		if (dnsServer)
+		{
+			delete dnsServer;
+			dnsServer = NULL;
 
-				// Blink blue led
-				digitalWrite(BLUE_LED_PIN, !digitalRead(BLUE_LED_PIN));
+			// No need in SoftAP, disconnect
+			// True will switch the soft-AP mode off
+			WiFi.softAPdisconnect(true);
+			WiFi.mode(WIFI_STA);
+		}
+
+		// Blue led is ON as we are now connected
+		digitalWrite(BLUE_LED_PIN, LOW);
+
+		backoff = INITIAL_BACKOFF;
+		enterState(WIFI_CONNECTED);
+	}
+
+	// Bring up configuration AP with DNS captive portal. STA stays enabled
+	// so that the next connection attempts could be made meanwhile.
+	void startAccessPoint()
+	{
+		Serial.println("Fallback to AP configuration.");
+
+		String chipID = String(ESP.getChipId(), HEX);
+		chipID.toUpperCase();
+		String APName = String(config->MDNSHost) + String("_") + chipID;
+		Serial.printf("Configuation access point: %s\n", APName.c_str());
+		WiFi.mode(WIFI_AP_STA);
+		WiFi.softAP(APName.c_str());
+
+		Serial.printf("Configuation access point IP address: %s\n", WiFi.softAPIP().toString().c_str());
+
+		/* Setup the DNS server redirecting all the domains to the apIP */
+		dnsServer = new DNSServer();
+		dnsServer->setErrorReplyCode(DNSReplyCode::NoError);
+		dnsServer->start(DNS_PORT, "*", WiFi.softAPIP());
+	}
 
-				if (++connectionAttempts > MAX_CONNECTION_ATTEMPTS)
+	void onConnectionFailed()
+	{
+		Serial.println("WiFi connection failed.");
+
+		if (!dnsServer)
+			startAccessPoint();
+
+		// Blue led is OFF as we are disconnected
+		digitalWrite(BLUE_LED_PIN, HIGH);
+
+		Serial.printf("Next WiFi connection attempt in %lu ms.\n", backoff);
+		enterState(WIFI_WAITING);
+	}
+
+	// Connection state machine step, called by connectionPulse
+	void connectionStep()
+	{
+		unsigned long inState = clock->millis() - stateChangedAt;
+
+		switch (state)
+		{
+			case WIFI_CONNECTED:
+				if (WL_CONNECTED != WiFi.status())
 				{
-					Serial.println(" failed.");
-					break;
+					Serial.println("Disconnected.");
+					digitalWrite(BLUE_LED_PIN, HIGH);
+					beginConnection();
 				}
-			}
+				break;
 
-			if (WL_CONNECTED == WiFi.status())
-			{
-				// Connected:
-				Serial.println();
-				Serial.printf("Connected to: %s\n", config->ssid);
-				Serial.printf("IP address: %s\n", WiFi.localIP().toString().c_str());
+			case WIFI_CONNECTING:
+				if (WL_CONNECTED == WiFi.status())
+				{
+					onConnected();
+				}
+				else if (fastAttempt && inState > FAST_CONNECTION_TIMEOUT)
+				{
+					// AP moved or lease is gone, go the long way
+					Serial.println("Cached WiFi data didn't work.");
+					cacheValid = false;
+					clearRTCData(RTC_WIFI_CACHE_OFFSET);
+					beginConnection();
+				}
+				else if (inState > CONNECTION_TIMEOUT)
+				{
+					onConnectionFailed();
+				}
+				else
+				{
+					// Blink blue led
+					digitalWrite(BLUE_LED_PIN, !digitalRead(BLUE_LED_PIN));
+				}
+				break;
 
-				if (mDNS->begin(config->MDNSHost, WiFi.localIP()))
+			case WIFI_WAITING:
+				if (WL_CONNECTED == WiFi.status())
 				{
-					Serial.println("MDNS responder started.");
+					// Got connected by SDK autoreconnect
+					onConnected();
 				}
+				else if (inState > backoff)
+				{
+					backoff = min(2 * backoff, (unsigned long)RECONNECTION_CYCLE);
+					beginConnection();
+				}
+				break;
+		}
+	}
+
+	unsigned long getConnectionTime()
+	{
+		return connectionTime;
+	}
 
-				// No need in SoftAP, disconnect
-				// True will switch the soft-AP mode off
-				WiFi.softAPdisconnect(true);
+	void setPowerPolicy(uint8_t policy)
+	{
+		switch (policy)
+		{
+			case POWER_BALANCED:
+				powerPolicy = POWER_BALANCED;
+				WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+				break;
 
-				// // Blue led is ON as we are now connected
-				digitalWrite(BLUE_LED_PIN, LOW);
+			case POWER_SAVING:
+				powerPolicy = POWER_SAVING;
+				WiFi.setSleepMode(WIFI_LIGHT_SLEEP);
+				break;
 
-				if (dnsServer) {
-					delete dnsServer;
-					dnsServer = NULL;
-				}
-			}
-			else
-			{
-				Serial.println("Fallback to AP configuration.");
-
-				String chipID = String(ESP.getChipId(), HEX);
-				chipID.toUpperCase();
-				String APName = String(config->MDNSHost) + String("_") + chipID;
-				Serial.printf("Configuation access point: %s\n", APName.c_str());
-				WiFi.mode(WIFI_AP);
-				WiFi.softAP(APName.c_str());
-
-				Serial.printf("Configuation access point IP address: %s\n", WiFi.softAPIP().toString().c_str());
-				Serial.printf("Next WiFi connection attempt in %d ms.\n", RECONNECTION_CYCLE);
-
-				// Blue led is OFF as we are disconnected
-				digitalWrite(BLUE_LED_PIN, HIGH);
-
-				/* Setup the DNS server redirecting all the domains to the apIP */
-				dnsServer = new DNSServer();
-				dnsServer->setErrorReplyCode(DNSReplyCode::NoError);
-				dnsServer->start(DNS_PORT, "*", WiFi.softAPIP());
-			}
+			default:
+				powerPolicy = POWER_FULL;
+				WiFi.setSleepMode(WIFI_NONE_SLEEP);
+				break;
 		}
 	}
+
+	unsigned long getIdleTime(unsigned long now, unsigned long deadline)
+	{
+		long slack = (long)(deadline - now);
+		if (POWER_FULL == powerPolicy || slack < MIN_IDLE)
+			return 0;
+
+		unsigned long maxIdle =
+			(POWER_SAVING == powerPolicy) ? SAVING_MAX_IDLE : BALANCED_MAX_IDLE;
+		return min((unsigned long)slack, maxIdle);
+	}
+
+	void idle(unsigned long deadline)
+	{
+		// Radio should be up for AP and for connecting
+		if (WIFI_CONNECTED != state || dnsServer)
+			return;
+
+		// Our own connection check is a deadline too
+		unsigned long now = clock->millis();
+		unsigned long ownDeadline = connectionPulse->nextDeadline(now);
+		if ((long)(ownDeadline - deadline) < 0)
+			deadline = ownDeadline;
+
+		unsigned long idleTime = getIdleTime(now, deadline);
+
+		// SDK sleeps as set by setSleepMode() while in delay()
+		if (idleTime)
+			clock->delay(idleTime);
+	}
+
+	void setClock(const Clock* clock)
+	{
+		WiFiManager::clock = clock;
+		connectionPulse->setClock(clock);
+	}
+
+	// Start connecting with the current credentials right now.
+	void handleWiFiConnectivity()
+	{
+		if (WIFI_CONNECTED == state && WL_CONNECTED == WiFi.status())
+			return;
+
+		// Credentials might be changed
+		cacheValid = cacheValid && cache.ssidHash == ssidHash();
+		backoff = INITIAL_BACKOFF;
+		beginConnection();
+	}
 }
@@ -2,12 +2,42 @@
 #define WIFI_MANAGER_H
 
 #include <ConnectedESPConfiguration.h>
+#include <Clock.h>
 
 namespace WiFiManager
 {
+	// Power policy trades HTTP response latency for power.
+	enum PowerPolicy
+	{
+		POWER_FULL = 0,		// no sleep, immediate response
+		POWER_BALANCED = 1,	// modem sleep, idle up to BALANCED_MAX_IDLE ms
+		POWER_SAVING = 2	// light sleep, idle up to SAVING_MAX_IDLE ms
+	};
+
 	void init(ConnectedESPConfiguration* cfg);
+
+	// Advances connection state machine, never blocks. Call from loop().
 	void update();
+
+	// Starts a new connection attempt with the current credentials.
 	void handleWiFiConnectivity();
+
+	// How long the last successful connection took, ms.
+	unsigned long getConnectionTime();
+
+	// Set power policy, unknown values fall back to POWER_FULL.
+	void setPowerPolicy(uint8_t policy);
+
+	// How long loop() may idle at @now if the next job is due at @deadline.
+	unsigned long getIdleTime(unsigned long now, unsigned long deadline);
+
+	// Idle (sleep) until @deadline as far as power policy allows. Call at
+	// the end of loop() with the timer next deadline.
+	void idle(unsigned long deadline);
+
+	// Time source, hardwareClock by default. Idling on the virtual one
+	// just advances it.
+	void setClock(const Clock* clock);
 }
 // class WiFiManager
 // {
@@ -15,6 +15,7 @@ Schematics: https://github.com/Shden/ShHarbor/blob/master/docs/schematics.pdf.
 #include "operation.h"
 #include "Arduino.h"
 #include "temperatureSensor.h"
+#include "Timer.h"
 
 // these pins go to the particle density sensor:
 #define PARTICLES_10 		2
@@ -23,9 +24,14 @@ Schematics: https://github.com/Shden/ShHarbor/blob/master/docs/schematics.pdf.
 #define SPAN_TIME 		60000.0 	// 60 sec time span to measure air quality
 #define HC_BUILD 		"1.1.0"
 #define TEMP_THRESHOLD_FAN_ON	27.0		// fan is on if above 27.0 degree celcius
+#define SPEED_SETTLE_TIME	250		// ms the fan may be off the controller speed before it's pushed
+#define MODE_SETTLE_TIME	500		// ms after ON button quick push before the mode changes
 
 #define NO__DEBUG__NO
 
+void restoreSpeed(Task* task);
+void changeMode(Task* task);
+
 // Global data used by the controller. At least keep this in one struct.
 struct ControllerData
 {
@@ -33,11 +39,17 @@ struct ControllerData
 	Control controlPanel;			// This is the front panel representation.
 	Operation operationModule;		// This is under the hood operation module representation.
 	TemperatureSensor* temperatureSensor;	// DS1820 stuff is hidden here.
+	TimerN<3> timer;			// Runs the tasks, one wait of each at a time.
+	Task speedTask;				// Brings the fan back to the controller speed.
+	Task modeTask;				// Changes the controller mode on ON button push.
+	unsigned long settleStart;		// When speedTask started to wait for the fan.
 
 	volatile uint32_t tn[2];		// These weird stuff is for dust counting.
 	volatile uint32_t tlow[2];
 	volatile float lowRatio[2];
 	volatile uint32_t spanStart;
+
+	ControllerData() : speedTask(restoreSpeed, NULL, &timer), modeTask(changeMode, NULL, &timer) {}
 } GD;
 
 /*
@@ -160,6 +172,8 @@ void setup()
 	attachInterrupt(digitalPinToInterrupt(PARTICLES_10), p10handler, CHANGE);
 	attachInterrupt(digitalPinToInterrupt(PARTICLES_25), p25handler, CHANGE);
 
+	gd->operationModule.setTimer(&gd->timer);
+
 	// Get the current controller state from operation module as a starting point
 	gd->controllerState.speed = gd->operationModule.getFanState();
 	gd->controllerState.autoMode = 1;
@@ -210,12 +224,100 @@ int speedSelect(int currentAQI, float currentTemp, int currentSpeed)
 	return currentSpeed;
 }
 
+// True when the operation module runs the fan at the controller speed.
+bool fanAtSpeed()
+{
+	// Warning: uses global data.
+	ControllerData *gd = &GD;
+
+	return gd->operationModule.getFanState() == gd->controllerState.speed;
+}
+
+// Fan is off the controller speed: the ON button may be on the way to
+// it, or the operation module still switching. Gives it SPEED_SETTLE_TIME
+// to get there before pushing for the speed, unless an ON button push is
+// changing the mode meanwhile.
+void restoreSpeed(Task* task)
+{
+	// Warning: uses global data.
+	ControllerData *gd = &GD;
+
+	TASK_BEGIN(task);
+	gd->settleStart = millis();
+	TASK_WAIT_UNTIL(task, fanAtSpeed() || millis() - gd->settleStart >= SPEED_SETTLE_TIME);
+	if (!fanAtSpeed() && gd->controllerState.speed && !gd->operationModule.busy() && !gd->modeTask.running())
+		gd->operationModule.setFanState(gd->controllerState.speed);
+	TASK_END(task);
+}
+
+// ON button quick push: lets everything settle for MODE_SETTLE_TIME, then
+// goes for the next speed in manual mode or leaves the auto mode.
+void changeMode(Task* task)
+{
+	// Warning: uses global data.
+	ControllerData *gd = &GD;
+
+	TASK_BEGIN(task);
+	TASK_WAIT(task, MODE_SETTLE_TIME);
+
+	Serial.print("Changing controller state from: ");
+	Serial.print(gd->controllerState.speed);
+
+	if (!gd->controllerState.autoMode) 
+	{
+		// ...in the manual mode:
+		switch (gd->controllerState.speed) 
+		{
+			case FAN_OFF:
+				Serial.println(" to: S1.");
+				gd->controllerState.speed = FAN_S1;
+				break;
+			case FAN_S1:
+				Serial.println(" to: S2.");
+				gd->controllerState.speed = FAN_S2;
+				break;
+			case FAN_S2:
+				Serial.println(" to: S3.");
+				gd->controllerState.speed = FAN_S3;
+				break;
+			case FAN_S3:
+				Serial.println(" to AUTO mode.");
+				gd->controllerState.autoMode = 1;
+				break;
+		}
+	} 
+	else 
+	{
+		// ... in the auto mode and ON is already released
+		Serial.println(" now leaving AUTO mode, change speed to S1.");
+		gd->controllerState.autoMode = 0;
+		gd->controllerState.speed = FAN_S1;
+		gd->operationModule.setFanState(gd->controllerState.speed);
+	}
+	TASK_END(task);
+}
+
+#ifdef __DEBUG__
+// Sets fan state and waits till the button pushes are done.
+void setFanStateAndWait(int mode)
+{
+	// Warning: uses global data.
+	ControllerData *gd = &GD;
+
+	gd->operationModule.setFanState(mode);
+	while (gd->operationModule.busy())
+		gd->timer.update();
+}
+#endif
+
 // The main loop.
 void loop() 
 {
 	// Warning: uses global data.
 	ControllerData *gd = &GD;
 
+	gd->timer.update();
+
 	/// debug stub code begin --->
 	#ifdef __DEBUG__
 
@@ -224,31 +326,32 @@ void loop()
 		Serial.print(button);
 
 	Serial.println("Setting fan to S1");
-	gd->operationModule.setFanState(FAN_S1);
+	setFanStateAndWait(FAN_S1);
 	delay(2000);
 
 	Serial.println("Setting fan to S2");
-	gd->operationModule.setFanState(FAN_S2);
+	setFanStateAndWait(FAN_S2);
 	delay(2000);
 
 	Serial.println("Setting fan to S3");
-	gd->operationModule.setFanState(FAN_S3);
+	setFanStateAndWait(FAN_S3);
 	delay(2000);
 
 	Serial.println("Turning fan OFF");
-	gd->operationModule.setFanState(FAN_OFF);
+	setFanStateAndWait(FAN_OFF);
 
 	return;
 	#endif
 	/// <--- debug stub code end
 
 	// just mirror buttons signal level from the control module to the operation
-	// module
+	// module. ON button is not mirrored while the controller pushes it.
 	gd->operationModule.setLightSignal(gd->controlPanel.getLightButtonSignal());
-	gd->operationModule.setFanSignal(gd->controlPanel.getOnButtonSignal());
+	if (!gd->operationModule.busy())
+		gd->operationModule.setFanSignal(gd->controlPanel.getOnButtonSignal());
 
 	// if operation is OFF, controller does the same
-	if (gd->operationModule.getFanState() == FAN_OFF && !gd->controllerState.autoMode) 
+	if (!gd->operationModule.busy() && gd->operationModule.getFanState() == FAN_OFF && !gd->controllerState.autoMode) 
 	{
 	    /*for (int i=0; i<50; i++)
 	    {
@@ -259,59 +362,14 @@ void loop()
 	    gd->controllerState.speed = FAN_OFF;
 	}
 
-	if (gd->controllerState.speed)
-		if (gd->operationModule.getFanState() != gd->controllerState.speed) 
-		{
-			for (int i = 0; i < 50; i++) 
-			{
-				delay(5);
-				if (gd->operationModule.getFanState() == gd->controllerState.speed)
-				return;
-			}
-			gd->operationModule.setFanState(gd->controllerState.speed);
-		}
-
-	// update controller state
-	if (gd->controlPanel.getOnPressed() == QUICK_PUSH) 
-	{
-		// let everything settle
-		delay(500);
-
-		Serial.print("Changing controller state from: ");
-		Serial.print(gd->controllerState.speed);
+	// fan is not at the controller speed: give it a moment, then push
+	if (gd->controllerState.speed && !gd->operationModule.busy() && !gd->modeTask.running())
+		if (gd->operationModule.getFanState() != gd->controllerState.speed)
+			gd->speedTask.start();
 
-		if (!gd->controllerState.autoMode) 
-		{
-			// ...in the manual mode:
-			switch (gd->controllerState.speed) 
-			{
-				case FAN_OFF:
-					Serial.println(" to: S1.");
-					gd->controllerState.speed = FAN_S1;
-					break;
-				case FAN_S1:
-					Serial.println(" to: S2.");
-					gd->controllerState.speed = FAN_S2;
-					break;
-				case FAN_S2:
-					Serial.println(" to: S3.");
-					gd->controllerState.speed = FAN_S3;
-					break;
-				case FAN_S3:
-					Serial.println(" to AUTO mode.");
-					gd->controllerState.autoMode = 1;
-					break;
-			}
-		} 
-		else 
-		{
-			// ... in the auto mode and ON is already released
-			Serial.println(" now leaving AUTO mode, change speed to S1.");
-			gd->controllerState.autoMode = 0;
-			gd->controllerState.speed = FAN_S1;
-			gd->operationModule.setFanState(gd->controllerState.speed);
-		}
-	}
+	// update controller state, a push while the last one settles is dropped
+	if (gd->controlPanel.getOnPressed() == QUICK_PUSH)
+		gd->modeTask.start();
 
 	// display the current *controller* mode (not the operation module state!)
 	gd->controlPanel.displayMode(gd->controllerState);
@@ -319,8 +377,8 @@ void loop()
 	// do the housekeeping for DS1820
 	gd->temperatureSensor->updateTemperature();
 
-	// the fan control itself:
-	if (gd->controllerState.autoMode) 
+	// the fan control itself, not while the mode changes:
+	if (gd->controllerState.autoMode && !gd->modeTask.running()) 
 	{
 		gd->controllerState.speed = speedSelect(getAQI(), gd->temperatureSensor->getTemperature(), gd->controllerState.speed);
 		gd->operationModule.setFanState(gd->controllerState.speed);
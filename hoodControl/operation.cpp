@@ -2,7 +2,7 @@
 #include "control.h"
 #include "Arduino.h"
 
-Operation::Operation() 
+Operation::Operation() : fanTask(fanControl, this), fanTarget(FAN_OFF), fanTaskTarget(FAN_OFF), attempt(0)
 {
 	// initialize operation-side pins:
 	pinMode(OPERATION_ON, OUTPUT);
@@ -14,6 +14,12 @@ Operation::Operation()
 	digitalWrite(OPERATION_ON, HIGH);
 }
 
+// Timer the fan task waits on.
+void Operation::setTimer(TimerBase* timer)
+{
+	fanTask.setTimer(timer);
+}
+
 void Operation::setLightSignal(int value) 
 {
 	digitalWrite(OPERATION_LIGHT, value);
@@ -47,40 +53,66 @@ int Operation::getFanState()
 	return fanSpeed;
 }
 
-// Sets fan speed, turns on or off
+// Sets fan speed, turns on or off. Returns right away, the button is
+// pushed by fanTask as the timer goes, busy() till it's done.
 void Operation::setFanState(int mode) 
 {
-	if (getFanState() != mode) 
-	{
-	// Shutting down the fan
-	if (mode == FAN_OFF) 
-	{
-		Serial.println("Turning fan off...");
-		pushOnButton(LONG_PUSH);
-		Serial.println("Fan is off now.");
+	if (mode != FAN_OFF && mode != FAN_S1 && mode != FAN_S2 && mode != FAN_S3)
 		return;
-	}
 
-	else if (FAN_S1 == mode || FAN_S2 == mode || FAN_S3 == mode) 
+	// Task already running goes for the new mode after the push it's in
+	fanTarget = mode;
+	if (!fanTask.running() && getFanState() != mode)
+		fanTask.start();
+}
+
+bool Operation::busy()
+{
+	return fanTask.running();
+}
+
+void Operation::fanControl(Task* task)
+{
+	Operation* op = (Operation*)task->context;
+
+	TASK_BEGIN(task);
+
+	// Starts over when fanTarget is changed on the way
+	do
 	{
+		op->fanTaskTarget = op->fanTarget;
+
+		// Shutting down the fan, unless the speed cycle on the way has got
+		// it off already, same as setFanState() doesn't start for it
+		if (op->fanTaskTarget == FAN_OFF) 
+		{
+			if (op->getFanState() == FAN_OFF)
+				continue;
+			Serial.println("Turning fan off...");
+			digitalWrite(OPERATION_ON, LOW);
+			TASK_WAIT(task, LONG_PUSH);
+			digitalWrite(OPERATION_ON, HIGH);
+			Serial.println("Fan is off now.");
+			continue;
+		}
+
 		// Adjust the speed cycle
-		for (int i = 0; i < 3; i++)
-			if (getFanState() != mode) 
-			{
-				pushOnButton(200);
-				delay(500);
-			} 
-			else
-				break;
-
-		// Serial.print("Fan speed now: ");
-		// Serial.println(getFanState());
-		return;
+		for (op->attempt = 0;
+			op->attempt < 3 && op->fanTaskTarget == op->fanTarget && op->getFanState() != op->fanTaskTarget;
+			op->attempt++)
+		{
+			digitalWrite(OPERATION_ON, LOW);
+			TASK_WAIT(task, 200);
+			digitalWrite(OPERATION_ON, HIGH);
+			TASK_WAIT(task, 500);
 		}
 	}
+	while (op->fanTaskTarget != op->fanTarget);
+
+	TASK_END(task);
 }
 
-// Push on button for a certain time (ms)
+// Push on button for a certain time (ms), blocking
 void Operation::pushOnButton(int pushTime) 
 {
 	digitalWrite(OPERATION_ON, LOW);
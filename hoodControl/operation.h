@@ -1,6 +1,8 @@
 #ifndef OPERATION_H
 #define OPERATION_H
 
+#include "Task.h"
+
 // these pins go to the operation module of the hood:
 #define OPERATION_ON 	12
 #define OPERATION_LIGHT 13
@@ -34,11 +36,21 @@ struct ControllerStatus
 class Operation {
 public:
 	Operation();
+	void setTimer(TimerBase* timer);
 	void setLightSignal(int value);
 	void setFanSignal(int value);
 	int getFanState();
 	void setFanState(int mode);
+	bool busy();
 	void pushOnButton(int pushTime);
+
+private:
+	static void fanControl(Task* task);
+
+	Task fanTask;		// pushes ON button till the fan is in fanTarget
+	int fanTarget;
+	int fanTaskTarget;	// fanTarget the pushes are going for now
+	int attempt;		// speed cycle pushes done
 };
 
 #endif
@@ -1,9 +1,9 @@
 #include "DSM501.h"
 
 // Constructor
-DSM501::DSM501()
+DSM501::DSM501(const Clock* clock) : clock(clock)
 {
-	spanStart = millis();
+	spanStart = clock->millis();
 	lowRatio[0] = lowRatio[1] = 0.0;
 	tlow[0] = tlow[1] = 0;
 }
@@ -61,22 +61,22 @@ void DSM501::particlesHandler(int idx, int signal)
 	if (!signal) 
 	{
 		// signal changed to 0: keep time
-		tn[idx] = micros();
+		tn[idx] = clock->micros();
 	} 
 	else 
 	{
 		// signal changed to 1: keep time it was 0
-		tlow[idx] += (micros() - tn[idx]);
+		tlow[idx] += (clock->micros() - tn[idx]);
 	}
 
-	if (millis() - spanStart > SPAN_TIME) 
+	if (clock->millis() - spanStart > SPAN_TIME) 
 	{
 
 		// tlow in microseconds so div 1000 mul 100 = div 10
 		lowRatio[0] = tlow[0] / SPAN_TIME / 10.0;
 		lowRatio[1] = tlow[1] / SPAN_TIME / 10.0;
 
-		spanStart = millis();
+		spanStart = clock->millis();
 		tlow[0] = tlow[1] = 0;
 
 		Serial.print("AQI update: ");
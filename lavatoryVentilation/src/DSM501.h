@@ -1,4 +1,5 @@
 #include "Arduino.h"
+#include "Clock.h"
 
 #ifndef DSM501_H
 #define DSM501_H
@@ -16,10 +17,11 @@ private:
 	volatile uint32_t tlow[2];
 	volatile float lowRatio[2];
 	volatile uint32_t spanStart;
+	const Clock* clock;
 	
 	float getParticalWeight(int i);
 public:
-	DSM501();
+	DSM501(const Clock* clock = &hardwareClock);
 	float getPM25();
 	uint32_t getAQI();
 	void particlesHandler(int idx, int signal);	